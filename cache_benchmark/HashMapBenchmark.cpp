@@ -0,0 +1,26 @@
+#include "pch.h"
+#include "HashMapBenchmark.h"
+#include "MapBenchmark.h"
+#include "../weak_ref_in_container/FlatHashMap.h"
+
+using namespace std;
+
+void BenchmarkHashMaps(const vector<size_t>& sizes)
+{
+	mt19937_64 rnd(42);
+	for (auto size : sizes)
+	{
+		cout << "Hash maps with " << size << " items\n";
+
+		vector<uint64_t> keys(size);
+		generate(keys.begin(), keys.end(), ref(rnd));
+		// Keys are looked up in an order different from the insertion one
+		vector<uint64_t> lookupKeys = keys;
+		shuffle(lookupKeys.begin(), lookupKeys.end(), rnd);
+		vector<uint64_t> missingKeys(size);
+		generate(missingKeys.begin(), missingKeys.end(), ref(rnd));
+
+		BenchmarkMap<unordered_map<uint64_t, uint64_t>>("std::unordered_map", keys, lookupKeys, missingKeys);
+		BenchmarkMap<FlatHashMap<uint64_t, uint64_t>>("FlatHashMap", keys, lookupKeys, missingKeys);
+	}
+}
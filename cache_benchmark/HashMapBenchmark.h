@@ -0,0 +1,5 @@
+#pragma once
+
+// Measures insertion and lookup costs of the backing stores of CacheT and WeakMap
+// for tables of the given sizes
+void BenchmarkHashMaps(const std::vector<size_t>& sizes);
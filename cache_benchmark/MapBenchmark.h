@@ -0,0 +1,66 @@
+#pragma once
+
+// Shared measurement code of the hash map benchmarks
+
+using BenchmarkClock = std::chrono::high_resolution_clock;
+
+// Small tables are measured over several rounds, so that every measurement
+// performs at least this number of operations
+constexpr size_t MIN_OPERATION_COUNT = 10'000'000;
+
+inline volatile uint64_t g_sink; // Keeps the optimizer from throwing the measured work away
+
+// Measures insertion of keys, lookups of keys in a different order (hits) and lookups
+// of missingKeys (misses). The value of a key is its index in keys
+template <typename Map, typename Key>
+void BenchmarkMap(const char* name, const std::vector<Key>& keys, const std::vector<Key>& lookupKeys,
+	const std::vector<Key>& missingKeys)
+{
+	const size_t rounds = std::max<size_t>(1, MIN_OPERATION_COUNT / keys.size());
+	const size_t opCount = rounds * keys.size();
+
+	BenchmarkClock::duration insertDuration{};
+	Map map;
+	for (size_t round = 0; round < rounds; ++round)
+	{
+		Map roundMap;
+		auto start = BenchmarkClock::now();
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			roundMap.emplace(keys[i], uint64_t(i));
+		}
+		insertDuration += BenchmarkClock::now() - start;
+		if (round + 1 == rounds)
+		{
+			map = std::move(roundMap);
+		}
+	}
+
+	auto measureLookups = [&](const std::vector<Key>& lookups) {
+		uint64_t found = 0;
+		auto start = BenchmarkClock::now();
+		for (size_t round = 0; round < rounds; ++round)
+		{
+			for (auto& key : lookups)
+			{
+				if (auto it = map.find(key); it != map.end())
+				{
+					found += it->second;
+				}
+			}
+		}
+		auto duration = BenchmarkClock::now() - start;
+		g_sink = found;
+		return duration;
+	};
+	auto hitDuration = measureLookups(lookupKeys);
+	auto missDuration = measureLookups(missingKeys);
+
+	auto nsPerOp = [opCount](BenchmarkClock::duration duration) {
+		return std::chrono::duration<double, std::nano>(duration).count() / opCount;
+	};
+	std::cout << "  " << name
+			  << ": insert " << nsPerOp(insertDuration)
+			  << "ns, hit " << nsPerOp(hitDuration)
+			  << "ns, miss " << nsPerOp(missDuration) << "ns\n";
+}
@@ -0,0 +1,77 @@
+#include "pch.h"
+#include "ResourceUsage.h"
+#include <cstdlib>
+#include <new>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+namespace
+{
+
+// Per thread, so that counting doesn't make threads contend
+thread_local uint64_t t_allocationCount = 0;
+
+} // namespace
+
+// The replaced operators count allocations of the whole program. Array and nothrow forms call
+// these ones. Over-aligned allocations are not counted
+void* operator new(size_t size)
+{
+	++t_allocationCount;
+	if (void* p = std::malloc(size != 0 ? size : 1))
+	{
+		return p;
+	}
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void* p, size_t /*size*/) noexcept
+{
+	std::free(p);
+}
+
+uint64_t GetThreadAllocationCount() noexcept
+{
+	return t_allocationCount;
+}
+
+uint64_t GetPeakResidentSetSize() noexcept
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+	{
+		return counters.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+	{
+		// Kilobytes on Linux, bytes on macOS
+#ifdef __APPLE__
+		return static_cast<uint64_t>(usage.ru_maxrss);
+#else
+		return static_cast<uint64_t>(usage.ru_maxrss) * 1024;
+#endif
+	}
+	return 0;
+#endif
+}
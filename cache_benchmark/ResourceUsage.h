@@ -0,0 +1,7 @@
+#pragma once
+
+// The number of operator new calls the calling thread has made since it started
+uint64_t GetThreadAllocationCount() noexcept;
+
+// The largest resident set size of the process so far, in bytes. Zero if unknown
+uint64_t GetPeakResidentSetSize() noexcept;
@@ -0,0 +1,110 @@
+#include "pch.h"
+#include "WeakKeyBenchmark.h"
+#include "MapBenchmark.h"
+#include "../weak_ref_in_container/WeakMap.h"
+
+using namespace std;
+
+namespace
+{
+
+// Larger tables would take gigabytes of key objects
+constexpr size_t MAX_KEY_COUNT = 10'000'000;
+
+struct Object
+{
+	uint64_t payload[3];
+};
+using Key = detail::WeakKey<Object>;
+
+// The murmur3 finalizer, which makes every bit of the address affect every bit of the hash
+struct MixedHasher
+{
+	size_t operator()(const Key& key) const noexcept
+	{
+		uint64_t h = reinterpret_cast<uintptr_t>(key.key);
+		h ^= h >> 33;
+		h *= 0xFF51AFD7ED558CCDull;
+		h ^= h >> 33;
+		h *= 0xC4CEB9FE1A85EC53ull;
+		h ^= h >> 33;
+		return static_cast<size_t>(h);
+	}
+};
+
+// Allocates objects the way an application does: with make_shared, interleaved with
+// allocations of other sizes, some of which are freed, so that addresses are aligned,
+// mostly ascending and have gaps
+class ObjectHeap
+{
+public:
+	explicit ObjectHeap(mt19937_64& rnd)
+		: m_rnd(rnd)
+	{
+	}
+
+	vector<Key> Allocate(size_t count)
+	{
+		uniform_int_distribution<size_t> noiseSize(8, 512);
+		vector<Key> keys;
+		keys.reserve(count);
+		for (size_t i = 0; i < count; ++i)
+		{
+			m_objects.push_back(make_shared<Object>());
+			keys.push_back(m_objects.back().get());
+			if (m_rnd() % 4 == 0)
+			{
+				m_noise.push_back(make_unique<char[]>(noiseSize(m_rnd)));
+			}
+			if (m_rnd() % 8 == 0 && !m_noise.empty())
+			{
+				swap(m_noise[m_rnd() % m_noise.size()], m_noise.back());
+				m_noise.pop_back();
+			}
+		}
+		return keys;
+	}
+
+private:
+	mt19937_64& m_rnd;
+	vector<shared_ptr<Object>> m_objects;
+	vector<unique_ptr<char[]>> m_noise;
+};
+
+} // namespace
+
+void BenchmarkWeakKeys(const vector<size_t>& sizes)
+{
+	mt19937_64 rnd(42);
+	for (auto size : sizes)
+	{
+		if (size > MAX_KEY_COUNT)
+		{
+			cout << "Weak keys: skipping " << size << " items\n";
+			continue;
+		}
+		cout << "Weak keys with " << size << " items\n";
+
+		ObjectHeap heap(rnd);
+		auto keys = heap.Allocate(size);
+		// Keys are looked up in an order different from the insertion one
+		auto lookupKeys = keys;
+		shuffle(lookupKeys.begin(), lookupKeys.end(), rnd);
+		// Live objects which are not in the table
+		auto missingKeys = heap.Allocate(size);
+		shuffle(missingKeys.begin(), missingKeys.end(), rnd);
+
+		BenchmarkMap<unordered_map<Key, uint64_t, detail::WeakKeyHasher>>(
+			"std::unordered_map, identity hash", keys, lookupKeys, missingKeys);
+		BenchmarkMap<unordered_map<Key, uint64_t, MixedHasher>>(
+			"std::unordered_map, mixed hash", keys, lookupKeys, missingKeys);
+		BenchmarkMap<FlatHashMap<Key, uint64_t, detail::WeakKeyHasher>>(
+			"FlatHashMap, identity hash", keys, lookupKeys, missingKeys);
+		BenchmarkMap<FlatHashMap<Key, uint64_t, MixedHasher>>(
+			"FlatHashMap, mixed hash", keys, lookupKeys, missingKeys);
+		BenchmarkMap<PackedKeyMap<Key, uint64_t, detail::WeakKeyHasher>>(
+			"PackedKeyMap, identity hash", keys, lookupKeys, missingKeys);
+		BenchmarkMap<PackedKeyMap<Key, uint64_t, MixedHasher>>(
+			"PackedKeyMap, mixed hash", keys, lookupKeys, missingKeys);
+	}
+}
@@ -0,0 +1,5 @@
+#pragma once
+
+// Measures WeakMap backing stores keyed by the addresses of heap objects, with the identity
+// pointer hash and with the mixed one, for tables of the given sizes
+void BenchmarkWeakKeys(const std::vector<size_t>& sizes);
@@ -0,0 +1,572 @@
+#include "pch.h"
+#include "WorkloadBenchmark.h"
+#include "MapBenchmark.h"
+#include "ResourceUsage.h"
+#include "../weak_ref_in_container/Cache.h"
+#include "../weak_ref_in_container/WeakMap.h"
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <numeric>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+using namespace std;
+
+namespace
+{
+
+enum class KeyDistribution
+{
+	Uniform,
+	Zipf,
+	// Most requests walk through all the keys in order, like a batch job, while the rest
+	// are Zipf distributed, like requests of a service sharing the cache with the job
+	Scan,
+};
+
+// The share of the requests of the scan-heavy distribution which walk through the keys
+constexpr double SCAN_SHARE = 0.75;
+
+struct WorkloadOptions
+{
+	KeyDistribution distribution = KeyDistribution::Zipf;
+	double zipfExponent = 0.99;
+	size_t keyCount = 100'000;
+	// The share of the operations which read. Caches have no write operation, their values
+	// are created by reads which miss, so they treat writes as reads
+	double readShare = 0.9;
+	// Every thread holds the values of its last holdCount reads, which keeps them cached.
+	// With zero, values are released right away and survive only while other threads hold them
+	size_t holdCount = 1'000;
+	size_t threadCount = 1;
+	size_t opsPerThread = 1'000'000;
+};
+
+struct WorkloadResult
+{
+	double opsPerSecond = 0;
+	double p50Ns = 0;
+	double p99Ns = 0;
+	double p999Ns = 0;
+	// The peak of the process so far, so that it covers the workloads run before. Run one
+	// workload per process to measure its own peak
+	uint64_t peakRss = 0;
+	double allocationsPerOp = 0;
+};
+
+// Results of an earlier run by their names
+using Baseline = unordered_map<string, WorkloadResult>;
+
+// Samples ranks from 0 to n - 1 with probabilities proportional to 1 / (rank + 1)^s
+class ZipfDistribution
+{
+public:
+	ZipfDistribution(size_t n, double s)
+		: m_cdf(n)
+	{
+		double sum = 0;
+		for (size_t i = 0; i < n; ++i)
+		{
+			sum += 1 / pow(double(i + 1), s);
+			m_cdf[i] = sum;
+		}
+		for (auto& p : m_cdf)
+		{
+			p /= sum;
+		}
+	}
+
+	size_t operator()(mt19937_64& rnd) const
+	{
+		const double u = uniform_real_distribution<double>()(rnd);
+		const auto rank = size_t(lower_bound(m_cdf.begin(), m_cdf.end(), u) - m_cdf.begin());
+		return min(rank, m_cdf.size() - 1);
+	}
+
+private:
+	vector<double> m_cdf;
+};
+
+// An operation is the index of its key, with this bit set for writes
+constexpr uint32_t WRITE_FLAG = 0x8000'0000u;
+
+// Generated before the measurement, so that the cost of sampling is not measured
+vector<vector<uint32_t>> GenerateOperations(const WorkloadOptions& options)
+{
+	mt19937_64 rnd(42);
+	// Popular keys are scattered over the key space, rather than being the first ones
+	vector<uint32_t> keysByRank(options.keyCount);
+	iota(keysByRank.begin(), keysByRank.end(), 0);
+	shuffle(keysByRank.begin(), keysByRank.end(), rnd);
+	const ZipfDistribution zipf(options.keyCount, options.zipfExponent);
+	uniform_int_distribution<uint32_t> uniform(0, uint32_t(options.keyCount - 1));
+	bernoulli_distribution isRead(options.readShare);
+	bernoulli_distribution isScan(SCAN_SHARE);
+
+	vector<vector<uint32_t>> operations(options.threadCount);
+	for (size_t t = 0; t < options.threadCount; ++t)
+	{
+		// Threads scan from different positions
+		size_t scanPosition = t * options.keyCount / options.threadCount;
+		auto& threadOperations = operations[t];
+		threadOperations.reserve(options.opsPerThread);
+		for (size_t i = 0; i < options.opsPerThread; ++i)
+		{
+			uint32_t key = 0;
+			switch (options.distribution)
+			{
+			case KeyDistribution::Uniform:
+				key = uniform(rnd);
+				break;
+			case KeyDistribution::Zipf:
+				key = keysByRank[zipf(rnd)];
+				break;
+			case KeyDistribution::Scan:
+				if (isScan(rnd))
+				{
+					key = uint32_t(scanPosition);
+					scanPosition = (scanPosition + 1) % options.keyCount;
+				}
+				else
+				{
+					key = keysByRank[zipf(rnd)];
+				}
+				break;
+			}
+			threadOperations.push_back(isRead(rnd) ? key : key | WRITE_FLAG);
+		}
+	}
+	return operations;
+}
+
+struct BenchmarkValue
+{
+	uint64_t payload[4];
+};
+
+template <typename Val, typename Key, typename CacheCleaner>
+shared_ptr<Val> MakeCachedValue(const Key& key, CacheCleaner&& cleaner)
+{
+	return shared_ptr<Val>(new Val{ { uint64_t(key) } }, [cleaner = std::move(cleaner)](Val* value) {
+		cleaner();
+		delete value;
+	});
+}
+
+// Workloads adapt the benchmarked containers to the operations. Read returns the value
+// the thread may hold
+
+class CacheWorkload
+{
+public:
+	static constexpr const char* NAME = "Cache";
+	static constexpr bool IS_THREAD_SAFE = false;
+
+	explicit CacheWorkload(size_t keyCount)
+		: m_cache(make_shared<Cache>())
+	{
+		for (size_t key = 0; key < keyCount; ++key)
+		{
+			m_ids.push_back("object" + to_string(key));
+		}
+	}
+
+	shared_ptr<const void> Read(uint32_t key)
+	{
+		return m_cache->GetObjectById(m_ids[key]);
+	}
+
+	shared_ptr<const void> Write(uint32_t key)
+	{
+		return Read(key);
+	}
+
+private:
+	vector<string> m_ids;
+	shared_ptr<Cache> m_cache;
+};
+
+class CacheTWorkload
+{
+public:
+	static constexpr const char* NAME = "CacheT";
+	static constexpr bool IS_THREAD_SAFE = true;
+
+	explicit CacheTWorkload(size_t /*keyCount*/)
+		: m_cache(make_shared<CacheT<uint64_t, BenchmarkValue>>([](const uint64_t& key, auto&& cleaner) {
+			return MakeCachedValue<BenchmarkValue>(key, std::move(cleaner));
+		}))
+	{
+	}
+
+	shared_ptr<const void> Read(uint32_t key)
+	{
+		return m_cache->GetValue(key);
+	}
+
+	shared_ptr<const void> Write(uint32_t key)
+	{
+		return Read(key);
+	}
+
+private:
+	shared_ptr<CacheT<uint64_t, BenchmarkValue>> m_cache;
+};
+
+class DataCacheWorkload
+{
+public:
+	static constexpr const char* NAME = "DataCache";
+	static constexpr bool IS_THREAD_SAFE = true;
+
+	explicit DataCacheWorkload(size_t keyCount)
+		: m_cache(make_shared<DataCache>())
+	{
+		for (size_t key = 0; key < keyCount; ++key)
+		{
+			m_sources.push_back(make_shared<DataSource>());
+		}
+	}
+
+	shared_ptr<const void> Read(uint32_t key)
+	{
+		return m_cache->GetValue(m_sources[key]);
+	}
+
+	shared_ptr<const void> Write(uint32_t key)
+	{
+		return Read(key);
+	}
+
+private:
+	vector<DataSourcePtr> m_sources;
+	shared_ptr<DataCache> m_cache;
+};
+
+struct MapKey : DestructionObservable
+{
+};
+
+// The map holds its values, so there is nothing for threads to hold
+class WeakMapWorkload
+{
+public:
+	static constexpr const char* NAME = "WeakMap";
+	static constexpr bool IS_THREAD_SAFE = false;
+
+	explicit WeakMapWorkload(size_t keyCount)
+		: m_map(make_shared<WeakMap<MapKey, uint64_t>>())
+	{
+		for (size_t key = 0; key < keyCount; ++key)
+		{
+			m_keys.push_back(make_shared<MapKey>());
+		}
+	}
+
+	shared_ptr<const void> Read(uint32_t key)
+	{
+		if (auto value = m_map->TryGetValue(m_keys[key]))
+		{
+			g_sink = *value;
+		}
+		return nullptr;
+	}
+
+	shared_ptr<const void> Write(uint32_t key)
+	{
+		m_map->SetValue(m_keys[key], uint64_t(key));
+		return nullptr;
+	}
+
+private:
+	vector<shared_ptr<const MapKey>> m_keys;
+	shared_ptr<WeakMap<MapKey, uint64_t>> m_map;
+};
+
+double GetPercentile(vector<uint32_t>& latencies, double percentile)
+{
+	auto it = latencies.begin() + ptrdiff_t(percentile * double(latencies.size() - 1));
+	nth_element(latencies.begin(), it, latencies.end());
+	return *it;
+}
+
+template <typename Workload>
+WorkloadResult MeasureWorkload(const WorkloadOptions& options, const vector<vector<uint32_t>>& operations)
+{
+	Workload workload(options.keyCount);
+	// Nanoseconds per operation
+	vector<vector<uint32_t>> latencies(options.threadCount);
+	vector<uint64_t> allocationCounts(options.threadCount);
+	atomic<size_t> readyCount = 0;
+	atomic<bool> isStarted = false;
+
+	vector<thread> threads;
+	for (size_t t = 0; t < options.threadCount; ++t)
+	{
+		threads.emplace_back([&, t] {
+			auto& threadOperations = operations[t];
+			auto& threadLatencies = latencies[t];
+			threadLatencies.resize(threadOperations.size());
+			vector<shared_ptr<const void>> heldValues(options.holdCount);
+			++readyCount;
+			while (!isStarted.load(memory_order_acquire))
+			{
+				this_thread::yield();
+			}
+
+			const uint64_t allocationCount = GetThreadAllocationCount();
+			for (size_t i = 0; i < threadOperations.size(); ++i)
+			{
+				const uint32_t operation = threadOperations[i];
+				const uint32_t key = operation & ~WRITE_FLAG;
+				const auto start = BenchmarkClock::now();
+				auto value = (operation & WRITE_FLAG) ? workload.Write(key) : workload.Read(key);
+				if (!heldValues.empty())
+				{
+					// Releases the value of an earlier operation
+					heldValues[i % heldValues.size()] = std::move(value);
+				}
+				else
+				{
+					value.reset();
+				}
+				const auto latency = chrono::duration_cast<chrono::nanoseconds>(BenchmarkClock::now() - start);
+				threadLatencies[i] = uint32_t(min<int64_t>(latency.count(), UINT32_MAX));
+			}
+			allocationCounts[t] = GetThreadAllocationCount() - allocationCount;
+		});
+	}
+
+	while (readyCount.load() < options.threadCount)
+	{
+		this_thread::yield();
+	}
+	const auto start = BenchmarkClock::now();
+	isStarted.store(true, memory_order_release);
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+	const auto duration = BenchmarkClock::now() - start;
+
+	const size_t opCount = options.threadCount * options.opsPerThread;
+	vector<uint32_t> allLatencies;
+	allLatencies.reserve(opCount);
+	for (auto& threadLatencies : latencies)
+	{
+		allLatencies.insert(allLatencies.end(), threadLatencies.begin(), threadLatencies.end());
+	}
+
+	WorkloadResult result;
+	result.opsPerSecond = double(opCount) / chrono::duration<double>(duration).count();
+	result.p50Ns = GetPercentile(allLatencies, 0.5);
+	result.p99Ns = GetPercentile(allLatencies, 0.99);
+	result.p999Ns = GetPercentile(allLatencies, 0.999);
+	result.peakRss = GetPeakResidentSetSize();
+	result.allocationsPerOp = double(accumulate(allocationCounts.begin(), allocationCounts.end(), uint64_t(0))) / double(opCount);
+	return result;
+}
+
+string DescribeWorkload(const WorkloadOptions& options)
+{
+	ostringstream name;
+	switch (options.distribution)
+	{
+	case KeyDistribution::Uniform:
+		name << "uniform";
+		break;
+	case KeyDistribution::Zipf:
+		name << "zipf(" << options.zipfExponent << ')';
+		break;
+	case KeyDistribution::Scan:
+		name << "scan+zipf(" << options.zipfExponent << ')';
+		break;
+	}
+	name << " keys=" << options.keyCount << " reads=" << options.readShare << " hold=" << options.holdCount
+		 << " threads=" << options.threadCount << " ops=" << options.opsPerThread;
+	return name.str();
+}
+
+// Percents of the change from the baseline
+string FormatChange(double value, double baselineValue)
+{
+	if (baselineValue == 0)
+	{
+		return "";
+	}
+	ostringstream change;
+	change.precision(3);
+	change << showpos << (value / baselineValue - 1) * 100 << '%';
+	return change.str();
+}
+
+template <typename Workload>
+void BenchmarkWorkload(const WorkloadOptions& options, const vector<vector<uint32_t>>& operations,
+	const Baseline& baseline, ostream* results)
+{
+	if (options.threadCount > 1 && !Workload::IS_THREAD_SAFE)
+	{
+		cout << "  " << Workload::NAME << ": skipping, it is not thread-safe\n";
+		return;
+	}
+	const auto name = string(Workload::NAME) + ' ' + DescribeWorkload(options);
+	const auto result = MeasureWorkload<Workload>(options, operations);
+
+	cout << "  " << Workload::NAME
+		 << ": " << result.opsPerSecond / 1e6 << "M ops/s"
+		 << ", p50 " << result.p50Ns << "ns, p99 " << result.p99Ns << "ns, p99.9 " << result.p999Ns << "ns"
+		 << ", peak RSS " << result.peakRss / (1024 * 1024) << "MB"
+		 << ", " << result.allocationsPerOp << " allocations/op\n";
+	if (auto it = baseline.find(name); it != baseline.end())
+	{
+		cout << "    vs baseline: throughput " << FormatChange(result.opsPerSecond, it->second.opsPerSecond)
+			 << ", p99 " << FormatChange(result.p99Ns, it->second.p99Ns)
+			 << ", p99.9 " << FormatChange(result.p999Ns, it->second.p999Ns)
+			 << ", allocations " << FormatChange(result.allocationsPerOp, it->second.allocationsPerOp) << '\n';
+	}
+	if (results)
+	{
+		*results << name << '\t' << result.opsPerSecond << '\t' << result.p50Ns << '\t' << result.p99Ns
+				 << '\t' << result.p999Ns << '\t' << result.peakRss << '\t' << result.allocationsPerOp << '\n';
+	}
+}
+
+// Reads results in the format BenchmarkWorkload writes them
+Baseline LoadBaseline(const string& path)
+{
+	ifstream in(path);
+	if (!in)
+	{
+		throw invalid_argument("can't read the baseline " + path);
+	}
+	Baseline baseline;
+	string line;
+	while (getline(in, line))
+	{
+		const auto tab = line.find('\t');
+		if (tab == string::npos)
+		{
+			continue;
+		}
+		istringstream fields(line.substr(tab + 1));
+		WorkloadResult result;
+		if (fields >> result.opsPerSecond >> result.p50Ns >> result.p99Ns >> result.p999Ns >> result.peakRss
+			>> result.allocationsPerOp)
+		{
+			baseline[line.substr(0, tab)] = result;
+		}
+	}
+	return baseline;
+}
+
+KeyDistribution ParseDistribution(const string& name)
+{
+	if (name == "uniform")
+	{
+		return KeyDistribution::Uniform;
+	}
+	if (name == "zipf")
+	{
+		return KeyDistribution::Zipf;
+	}
+	if (name == "scan")
+	{
+		return KeyDistribution::Scan;
+	}
+	throw invalid_argument("unknown key distribution " + name);
+}
+
+} // namespace
+
+void BenchmarkWorkloads(const vector<string>& options)
+{
+	WorkloadOptions workloadOptions;
+	// Unless the options choose ones, all the distributions are run with one thread and with a thread per core
+	vector<KeyDistribution> distributions{ KeyDistribution::Uniform, KeyDistribution::Zipf, KeyDistribution::Scan };
+	vector<size_t> threadCounts{ 1, max(2u, thread::hardware_concurrency()) };
+	string resultsPath;
+	Baseline baseline;
+
+	for (size_t i = 0; i < options.size(); i += 2)
+	{
+		const auto& option = options[i];
+		if (i + 1 == options.size())
+		{
+			throw invalid_argument("no value of " + option);
+		}
+		const auto& value = options[i + 1];
+		if (option == "--distribution")
+		{
+			distributions = { ParseDistribution(value) };
+		}
+		else if (option == "--zipf")
+		{
+			workloadOptions.zipfExponent = stod(value);
+		}
+		else if (option == "--keys")
+		{
+			workloadOptions.keyCount = stoul(value);
+		}
+		else if (option == "--reads")
+		{
+			workloadOptions.readShare = stod(value);
+		}
+		else if (option == "--hold")
+		{
+			workloadOptions.holdCount = stoul(value);
+		}
+		else if (option == "--threads")
+		{
+			threadCounts = { stoul(value) };
+		}
+		else if (option == "--ops")
+		{
+			workloadOptions.opsPerThread = stoul(value);
+		}
+		else if (option == "--save")
+		{
+			resultsPath = value;
+		}
+		else if (option == "--baseline")
+		{
+			baseline = LoadBaseline(value);
+		}
+		else
+		{
+			throw invalid_argument("unknown option " + option);
+		}
+	}
+	if (workloadOptions.keyCount == 0 || workloadOptions.keyCount >= WRITE_FLAG || threadCounts.front() == 0
+		|| workloadOptions.opsPerThread == 0 || workloadOptions.readShare < 0 || workloadOptions.readShare > 1)
+	{
+		throw invalid_argument("the key, thread and operation counts must be positive and reads must be a share");
+	}
+
+	ofstream results;
+	if (!resultsPath.empty())
+	{
+		results.open(resultsPath, ios::trunc);
+		if (!results)
+		{
+			throw invalid_argument("can't write the results to " + resultsPath);
+		}
+	}
+	for (auto distribution : distributions)
+	{
+		for (auto threadCount : threadCounts)
+		{
+			workloadOptions.distribution = distribution;
+			workloadOptions.threadCount = threadCount;
+			cout << "Workload " << DescribeWorkload(workloadOptions) << '\n';
+
+			const auto operations = GenerateOperations(workloadOptions);
+			ostream* out = results.is_open() ? &results : nullptr;
+			BenchmarkWorkload<CacheWorkload>(workloadOptions, operations, baseline, out);
+			BenchmarkWorkload<CacheTWorkload>(workloadOptions, operations, baseline, out);
+			BenchmarkWorkload<DataCacheWorkload>(workloadOptions, operations, baseline, out);
+			BenchmarkWorkload<WeakMapWorkload>(workloadOptions, operations, baseline, out);
+		}
+	}
+}
@@ -0,0 +1,7 @@
+#pragma once
+
+// Drives Cache, CacheT, DataCache and WeakMap with requests for keys of uniform, Zipf and
+// scan-heavy distributions from several threads, and reports throughput, latency percentiles,
+// peak memory and allocations per operation. Results may be saved and compared with saved ones.
+// Throws std::invalid_argument if the options are malformed, see main.cpp for them
+void BenchmarkWorkloads(const std::vector<std::string>& options);
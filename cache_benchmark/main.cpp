@@ -0,0 +1,41 @@
+#include "pch.h"
+#include "HashMapBenchmark.h"
+#include "WeakKeyBenchmark.h"
+#include "WorkloadBenchmark.h"
+#include <stdexcept>
+
+using namespace std;
+
+int main(int argc, char* argv[])
+{
+	// Workloads of the caches are benchmarked separately:
+	// cache_benchmark --workload [--distribution uniform|zipf|scan] [--zipf 0.99] [--keys 100000]
+	//     [--reads 0.9] [--hold 1000] [--threads 4] [--ops 1000000] [--save results.tsv] [--baseline results.tsv]
+	if (argc > 1 && argv[1] == string("--workload"))
+	{
+		try
+		{
+			BenchmarkWorkloads(vector<string>(argv + 2, argv + argc));
+		}
+		catch (const invalid_argument& e)
+		{
+			cerr << e.what() << '\n';
+			return 1;
+		}
+		return 0;
+	}
+
+	// Table sizes can be overridden from the command line: cache_benchmark 1000 1000000
+	vector<size_t> sizes{ 1'000, 1'000'000, 50'000'000 };
+	if (argc > 1)
+	{
+		sizes.clear();
+		for (int i = 1; i < argc; ++i)
+		{
+			sizes.push_back(stoul(argv[i]));
+		}
+	}
+
+	BenchmarkHashMaps(sizes);
+	BenchmarkWeakKeys(sizes);
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+// A value shared between threads that are mostly reading it. Readers take snapshots of the current
+// version without locking, a snapshot keeps its version alive and unchanged. A writer copies the
+// current version, changes the copy, and publishes it if no other writer published a version
+// in the meantime, otherwise it starts over with the newer version. A replaced version is deleted
+// when the last snapshot of it is released.
+// Unlike Cow, which copies when its use_count() is above one and so needs outside locking when its
+// copies are used from several threads, an AtomicCow may be read and written from any thread.
+//
+// Taking a snapshot loads the version and then counts a reference to it, so a replaced version
+// must not be released by the AtomicCow while a reader is between the two steps. Readers count
+// themselves in one of two counters, chosen by an epoch, for the duration of these steps.
+// A writer that replaced a version flips the epoch and waits for the readers counted under the
+// previous epoch, which are the only ones that could have loaded that version. The waits of writers
+// are serialized, readers never wait
+template <typename T>
+class AtomicCow
+{
+	struct Version
+	{
+		template <typename... Args>
+		explicit Version(Args&&... args)
+			: value(std::forward<Args>(args)...)
+		{
+		}
+
+		T value;
+		std::atomic<size_t> refCount{ 1 };
+	};
+
+	static void Release(Version* version)
+	{
+		if (version && version->refCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		{
+			delete version;
+		}
+	}
+
+public:
+	// A version of the value, which may be read from any thread while the snapshot is held
+	class Snapshot
+	{
+	public:
+		Snapshot() = default;
+
+		Snapshot(Snapshot const& rhs)
+			: m_version(rhs.m_version)
+		{
+			if (m_version)
+			{
+				m_version->refCount.fetch_add(1, std::memory_order_relaxed);
+			}
+		}
+
+		Snapshot(Snapshot&& rhs) noexcept
+			: m_version(std::exchange(rhs.m_version, nullptr))
+		{
+		}
+
+		Snapshot& operator=(Snapshot rhs) noexcept
+		{
+			std::swap(m_version, rhs.m_version);
+			return *this;
+		}
+
+		~Snapshot()
+		{
+			Release(m_version);
+		}
+
+		T const& operator*() const
+		{
+			assert(m_version);
+			return m_version->value;
+		}
+
+		T const* operator->() const
+		{
+			assert(m_version);
+			return &m_version->value;
+		}
+
+		explicit operator bool() const
+		{
+			return m_version != nullptr;
+		}
+
+	private:
+		friend class AtomicCow;
+		// Takes over a counted reference
+		explicit Snapshot(Version* version)
+			: m_version(version)
+		{
+		}
+
+		Version* m_version = nullptr;
+	};
+
+	template <typename... Args, typename = std::enable_if_t<std::is_constructible_v<T, Args...>>>
+	AtomicCow(Args&&... args)
+		: m_current(new Version(std::forward<Args>(args)...))
+	{
+	}
+
+	AtomicCow(AtomicCow const&) = delete;
+	AtomicCow& operator=(AtomicCow const&) = delete;
+
+	// There must be no readers or writers left, snapshots may outlive the AtomicCow
+	~AtomicCow()
+	{
+		Release(m_current.load());
+	}
+
+	Snapshot Load() const
+	{
+		for (;;)
+		{
+			size_t epoch = m_epoch.load();
+			m_readerCounts[epoch].fetch_add(1);
+			// A writer that flipped the epoch since it was loaded could miss this reader
+			if (m_epoch.load() == epoch)
+			{
+				Version* version = m_current.load();
+				version->refCount.fetch_add(1, std::memory_order_relaxed);
+				m_readerCounts[epoch].fetch_sub(1);
+				return Snapshot(version);
+			}
+			m_readerCounts[epoch].fetch_sub(1);
+		}
+	}
+
+	// Reads a snapshot that lives until the end of the full expression
+	Snapshot operator->() const
+	{
+		return Load();
+	}
+
+	// Calls mutate with a copy of the current version and publishes the copy. If another version has
+	// been published meanwhile, mutate is called again with a copy of that one, so it should only
+	// change the copy. Returns a snapshot of the published version
+	template <typename Mutator>
+	Snapshot Update(Mutator&& mutate)
+	{
+		Snapshot current = Load();
+		for (;;)
+		{
+			auto next = std::make_unique<Version>(*current);
+			mutate(next->value);
+			// Counts the result before publishing, another writer may retire the version right away
+			next->refCount.store(2, std::memory_order_relaxed);
+			// The snapshot keeps the expected version alive, so its address can't be reused by another
+			Version* expected = current.m_version;
+			if (m_current.compare_exchange_strong(expected, next.get()))
+			{
+				Snapshot result(next.release());
+				Retire(current.m_version);
+				return result;
+			}
+			current = Load();
+		}
+	}
+
+	// Publishes the value regardless of the versions published meanwhile
+	void Store(T value)
+	{
+		Retire(m_current.exchange(new Version(std::move(value))));
+	}
+
+private:
+	// Releases the reference of the AtomicCow to a version that has been replaced
+	void Retire(Version* replaced)
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_retireMutex);
+			size_t epoch = m_epoch.load();
+			m_epoch.store(epoch ^ 1);
+			while (m_readerCounts[epoch].load() != 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+		Release(replaced);
+	}
+
+	std::atomic<Version*> m_current;
+	std::atomic<size_t> m_epoch{ 0 };
+	mutable std::atomic<size_t> m_readerCounts[2] = {};
+	std::mutex m_retireMutex;
+};
@@ -1,29 +1,122 @@
 #pragma once
 
+// Values of trivially copyable types that take at most this many bytes are kept in the Cow handle
+// by default rather than shared on the heap. Copying such a value costs less than counting
+// a reference to it and the first write after a copy doesn't allocate
+constexpr size_t COW_INLINE_SIZE = 2 * sizeof(void*);
+
+template <typename T, size_t InlineSize = COW_INLINE_SIZE>
+constexpr bool IsCowInline = std::is_trivially_copyable_v<T> && !std::is_polymorphic_v<T> && sizeof(T) <= InlineSize;
+
+// Polymorphic types may implement
+//     std::shared_ptr<Base> CloneInto(CowCloneStorage const& storage) const
+//     {
+//         return storage.Construct<Derived>(*this);
+//     }
+// rather than Clone(), so that a copy made by a Cow is allocated together with its reference count
+// from the memory resource of the Cow
+class CowCloneStorage
+{
+public:
+	explicit CowCloneStorage(std::pmr::memory_resource* resource)
+		: m_resource(resource)
+	{
+	}
+
+	template <typename U, typename... Args>
+	std::shared_ptr<U> Construct(Args&&... args) const
+	{
+		return std::allocate_shared<U>(std::pmr::polymorphic_allocator<U>(m_resource), std::forward<Args>(args)...);
+	}
+
+private:
+	std::pmr::memory_resource* m_resource;
+};
+
+namespace detail
+{
+
+template <typename T, typename = void>
+struct HasCloneInto : std::false_type
+{
+};
+
 template <typename T>
-class Cow
+struct HasCloneInto<T, std::void_t<decltype(std::declval<T const&>().CloneInto(std::declval<CowCloneStorage const&>()))>>
+	: std::true_type
+{
+};
+
+// Doesn't look at T if inline storage is turned off, so that HeapCow<T> can be named while T is incomplete
+template <typename T, size_t InlineSize>
+struct IsCowInlineStorage : std::bool_constant<IsCowInline<T, InlineSize>>
+{
+};
+
+template <typename T>
+struct IsCowInlineStorage<T, 0> : std::false_type
+{
+};
+
+// Handles keep their allocators on assignment unless the allocators propagate on it,
+// see std::allocator_traits
+template <typename Propagate, typename Allocator>
+void AssignCowAllocator(Allocator& lhs, Allocator const& rhs)
+{
+	if constexpr (Propagate::value)
+	{
+		lhs = rhs;
+	}
+}
+
+template <typename... Args>
+struct IsAllocatorArgFirst : std::false_type
+{
+};
+
+template <typename First, typename... Rest>
+struct IsAllocatorArgFirst<First, Rest...> : std::is_same<std::decay_t<First>, std::allocator_arg_t>
+{
+};
+
+} // namespace detail
+
+// The value is shared on the heap and copied on the first write through a shared handle.
+// Small trivially copyable values are kept in the handle instead, see COW_INLINE_SIZE. Choosing
+// between the two needs a complete T, so recursive types use HeapCow, which never keeps values inline.
+// The value and its copies are allocated with Allocator, which is rebound to the types allocated.
+// A handle keeps the allocator of the value it was constructed from. Assignment shares the value
+// but replaces the allocator only if it propagates, so a PmrCow stays with its memory resource
+template <typename T, size_t InlineSize = COW_INLINE_SIZE, typename Allocator = std::allocator<std::byte>,
+	bool = detail::IsCowInlineStorage<T, InlineSize>::value>
+class Cow : private Allocator
 {
 	template <typename U>
 	struct CopyConstr
 	{
-		static auto Copy(U const& other)
+		static auto Copy(U const& other, Allocator const& allocator)
+		{
+			return std::allocate_shared<U>(allocator, other);
+		}
+	};
+
+	template <typename U>
+	struct CloneIntoConstr
+	{
+		static auto Copy(U const& other, Allocator const& allocator)
 		{
-			return std::make_shared<U>(other);
+			return other.CloneInto(CowCloneStorage(GetMemoryResource(allocator)));
 		}
 	};
 
 	template <typename U>
 	struct CloneConstr
 	{
-		static auto Copy(U const& other)
+		static auto Copy(U const& other, Allocator const& /*allocator*/)
 		{
 			return other.Clone();
 		}
 	};
-	using CopyClass = typename std::conditional_t<!std::is_abstract_v<T> && std::is_copy_constructible_v<T>,
-		CopyConstr<T>,
-		CloneConstr<T>>;
-
 public:
 	struct WriteProxy
 	{
@@ -44,9 +137,17 @@ public:
 		T* m_p;
 	};
 
-	template <typename... Args, typename = std::enable_if_t<!std::is_abstract_v<T>>>
+	template <typename... Args, typename U = T,
+		typename = std::enable_if_t<!std::is_abstract_v<U> && !detail::IsAllocatorArgFirst<Args...>::value>>
 	Cow(Args&&... args)
-		: m_shared(std::make_shared<T>(std::forward<Args>(args)...))
+		: m_shared(std::allocate_shared<T>(GetAllocator(), std::forward<Args>(args)...))
+	{
+	}
+
+	template <typename... Args, typename U = T, typename = std::enable_if_t<!std::is_abstract_v<U>>>
+	Cow(std::allocator_arg_t, Allocator const& allocator, Args&&... args)
+		: Allocator(allocator)
+		, m_shared(std::allocate_shared<T>(allocator, std::forward<Args>(args)...))
 	{
 	}
 
@@ -56,18 +157,20 @@ public:
 	{
 	}
 
-	template <class U>
+	template <typename U, size_t, typename, bool>
 	friend class Cow;
 
-	template <typename U>
-	Cow(Cow<U>& rhs)
-		: m_shared(rhs.m_shared)
+	template <typename U, size_t N>
+	Cow(Cow<U, N, Allocator, false>& rhs)
+		: Allocator(rhs.GetAllocator())
+		, m_shared(rhs.m_shared)
 	{
 	}
 
-	template <typename U>
-	Cow(const Cow<U>& rhs)
-		: m_shared(rhs.m_shared)
+	template <typename U, size_t N>
+	Cow(const Cow<U, N, Allocator, false>& rhs)
+		: Allocator(rhs.GetAllocator())
+		, m_shared(rhs.m_shared)
 	{
 	}
 
@@ -75,16 +178,27 @@ public:
 
 	Cow(Cow const& rhs) = default;
 
-	template <typename U>
-	Cow& operator=(Cow<U>& rhs)
+	template <typename U, size_t N>
+	Cow& operator=(Cow<U, N, Allocator, false>& rhs)
 	{
+		detail::AssignCowAllocator<PropagateOnCopy>(static_cast<Allocator&>(*this), rhs.GetAllocator());
 		m_shared = rhs.m_shared;
 		return *this;
 	}
 
-	Cow& operator=(Cow&& rhs) = default;
+	Cow& operator=(Cow&& rhs) noexcept
+	{
+		detail::AssignCowAllocator<PropagateOnMove>(static_cast<Allocator&>(*this), rhs.GetAllocator());
+		m_shared = std::move(rhs.m_shared);
+		return *this;
+	}
 
-	Cow& operator=(Cow const& rhs) = default;
+	Cow& operator=(Cow const& rhs)
+	{
+		detail::AssignCowAllocator<PropagateOnCopy>(static_cast<Allocator&>(*this), rhs.GetAllocator());
+		m_shared = rhs.m_shared;
+		return *this;
+	}
 
 	T const& operator*() const
 	{
@@ -112,14 +226,145 @@ public:
 		return *m_shared;
 	}
 
+	Allocator const& GetAllocator() const
+	{
+		return *this;
+	}
+
 private:
+	using PropagateOnCopy = typename std::allocator_traits<Allocator>::propagate_on_container_copy_assignment;
+	using PropagateOnMove = typename std::allocator_traits<Allocator>::propagate_on_container_move_assignment;
+
+	// CloneInto needs a memory resource, as a virtual function can't take allocators of any type
+	static std::pmr::memory_resource* GetMemoryResource(Allocator const& allocator)
+	{
+		if constexpr (std::is_same_v<Allocator, std::allocator<std::byte>>)
+		{
+			return std::pmr::new_delete_resource();
+		}
+		else
+		{
+			static_assert(std::is_convertible_v<Allocator const&, std::pmr::polymorphic_allocator<std::byte>>,
+				"CloneInto needs std::allocator or std::pmr::polymorphic_allocator");
+			return std::pmr::polymorphic_allocator<std::byte>(allocator).resource();
+		}
+	}
+
 	void EnsureUnique()
 	{
+		// Chosen here rather than in the class, where T of a HeapCow may be incomplete
+		using CopyClass = typename std::conditional_t<!std::is_abstract_v<T> && std::is_copy_constructible_v<T>,
+			CopyConstr<T>,
+			std::conditional_t<detail::HasCloneInto<T>::value, CloneIntoConstr<T>, CloneConstr<T>>>;
 		if (m_shared.use_count() > 1)
 		{
-			m_shared = CopyClass::Copy(*m_shared);
+			m_shared = CopyClass::Copy(*m_shared, GetAllocator());
 		}
 	}
 
 	std::shared_ptr<T> m_shared;
 };
+
+// A Cow whose values are allocated from a memory resource, the default one unless one is passed with
+// std::allocator_arg
+template <typename T, size_t InlineSize = COW_INLINE_SIZE>
+using PmrCow = Cow<T, InlineSize, std::pmr::polymorphic_allocator<std::byte>>;
+
+// A Cow which shares even small values on the heap. Unlike Cow<T>, it doesn't look at T where it is
+// named, so T may be incomplete there, e.g. in struct Tree { std::vector<HeapCow<Tree>> children; }
+template <typename T, typename Allocator = std::allocator<std::byte>>
+using HeapCow = Cow<T, 0, Allocator>;
+
+// The value is kept in the handle, copies of the handle are copies of the value.
+// Nothing is allocated, the allocator is only kept like in the shared Cow
+template <typename T, size_t InlineSize, typename Allocator>
+class Cow<T, InlineSize, Allocator, true> : private Allocator
+{
+public:
+	struct WriteProxy
+	{
+		T* operator->()
+		{
+			return m_p;
+		}
+
+	private:
+		friend class Cow;
+		WriteProxy(WriteProxy const&) = default;
+		WriteProxy& operator=(WriteProxy const&) = delete;
+		WriteProxy(T* p)
+			: m_p(p)
+		{
+		}
+
+		T* m_p;
+	};
+
+	template <typename... Args, typename = std::enable_if_t<std::is_constructible_v<T, Args...>>>
+	Cow(Args&&... args)
+		: m_value(std::forward<Args>(args)...)
+	{
+	}
+
+	template <typename... Args, typename = std::enable_if_t<std::is_constructible_v<T, Args...>>>
+	Cow(std::allocator_arg_t, Allocator const& allocator, Args&&... args)
+		: Allocator(allocator)
+		, m_value(std::forward<Args>(args)...)
+	{
+	}
+
+	template <typename U, typename Deleter>
+	Cow(std::unique_ptr<U, Deleter> pUniqueObj)
+		: m_value(*pUniqueObj)
+	{
+	}
+
+	Cow(Cow&& rhs) = default;
+
+	Cow(Cow const& rhs) = default;
+
+	Cow& operator=(Cow&& rhs) noexcept
+	{
+		detail::AssignCowAllocator<PropagateOnMove>(static_cast<Allocator&>(*this), rhs.GetAllocator());
+		m_value = std::move(rhs.m_value);
+		return *this;
+	}
+
+	Cow& operator=(Cow const& rhs)
+	{
+		detail::AssignCowAllocator<PropagateOnCopy>(static_cast<Allocator&>(*this), rhs.GetAllocator());
+		m_value = rhs.m_value;
+		return *this;
+	}
+
+	T const& operator*() const
+	{
+		return m_value;
+	}
+
+	T const* operator->() const
+	{
+		return &m_value;
+	}
+
+	WriteProxy operator--(int)
+	{
+		return { &m_value };
+	}
+
+	T& Write()
+	{
+		return m_value;
+	}
+
+	Allocator const& GetAllocator() const
+	{
+		return *this;
+	}
+
+private:
+	using PropagateOnCopy = typename std::allocator_traits<Allocator>::propagate_on_container_copy_assignment;
+	using PropagateOnMove = typename std::allocator_traits<Allocator>::propagate_on_container_move_assignment;
+
+	T m_value;
+};
@@ -0,0 +1,90 @@
+#include "pch.h"
+#include "CowBenchmark.h"
+#include "Cow.h"
+#include "LocalCow.h"
+
+using namespace std;
+
+namespace
+{
+
+using BenchmarkClock = chrono::steady_clock;
+
+constexpr size_t OPERATION_COUNT = 10'000'000;
+
+volatile int g_sink; // Keeps the optimizer from throwing the measured work away
+
+double GetNsPerOp(BenchmarkClock::duration duration)
+{
+	return chrono::duration<double, nano>(duration).count() / OPERATION_COUNT;
+}
+
+// Copies of two handles are assigned in turn to the handles of a small ring, so that every
+// assignment counts a reference to one value and releases one to the other
+template <typename CowType>
+void BenchmarkCow(const char* name, CowType const& original)
+{
+	CowType sources[] = { original, CowType(*original) };
+	array<CowType, 16> copies;
+	copies.fill(original);
+
+	auto start = BenchmarkClock::now();
+	for (size_t i = 0; i < OPERATION_COUNT; ++i)
+	{
+		copies[i % copies.size()] = sources[i / copies.size() % 2];
+	}
+	auto copyDuration = BenchmarkClock::now() - start;
+
+	int sum = 0;
+	start = BenchmarkClock::now();
+	for (size_t i = 0; i < OPERATION_COUNT; ++i)
+	{
+		auto& copy = copies[i % copies.size()];
+		copy = sources[i / copies.size() % 2];
+		sum += copy.Write().GetValue();
+	}
+	auto writeDuration = BenchmarkClock::now() - start;
+	g_sink = sum;
+
+	cout << "  " << name << " (" << sizeof(CowType) << " bytes)"
+		 << ": copy " << GetNsPerOp(copyDuration)
+		 << "ns, copy and write " << GetNsPerOp(writeDuration) << "ns\n";
+}
+
+struct SmallValue
+{
+	int GetValue() const
+	{
+		return m_value;
+	}
+
+	int m_value = 1;
+};
+
+struct LargeValue
+{
+	int GetValue() const
+	{
+		return static_cast<int>(m_values.size());
+	}
+
+	vector<int> m_values = vector<int>(16);
+};
+
+} // namespace
+
+void BenchmarkCows()
+{
+	// libstdc++ counts shared_ptr references without atomics until the process starts a thread,
+	// while the programs that use Cow have threads
+	thread([] {}).join();
+
+	cout << "int-sized value\n";
+	BenchmarkCow("Cow", Cow<SmallValue>());
+	BenchmarkCow("HeapCow", HeapCow<SmallValue>());
+	BenchmarkCow("LocalCow", LocalCow<SmallValue>());
+
+	cout << "vector of 16 ints\n";
+	BenchmarkCow("Cow", Cow<LargeValue>());
+	BenchmarkCow("LocalCow", LocalCow<LargeValue>());
+}
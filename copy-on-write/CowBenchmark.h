@@ -0,0 +1,4 @@
+#pragma once
+
+// Measures copying handles and the first write after a copy with Cow and LocalCow
+void BenchmarkCows();
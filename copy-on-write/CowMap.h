@@ -0,0 +1,508 @@
+#pragma once
+
+// A hash map with copy-on-write semantics that doesn't copy all of its items on the first write
+// after a copy. The items are kept in a hash array mapped trie: each node takes 5 bits of the hash
+// and keeps bitmaps of which of its 32 slots hold an item and which hold a child node, the items
+// and the children are stored densely in that order. Copies of a map share the nodes, and an update
+// copies only the nodes on the path to the item, so it costs O(log32 n) node copies rather than O(n).
+// A node holds the items of its slots in place, so a lookup follows a few pointers and iteration
+// visits the items node by node. Items whose hashes are equal in all bits are kept in one node.
+// As with Cow, reads go through operator-> and writes through operator--(int) or Write(),
+// so CowMap<K, V> can replace Cow<std::unordered_map<K, V>> for the usual map operations.
+// Nodes that are not shared are modified in place. Like Cow, a map must not be written while it is
+// being copied on another thread
+template <typename K, typename V, typename Hash = std::hash<K>, typename KeyEqual = std::equal_to<K>>
+class CowMap
+{
+	static constexpr size_t BITS = 5;
+	static constexpr size_t MASK = (size_t(1) << BITS) - 1;
+	static constexpr size_t HASH_BITS = std::numeric_limits<size_t>::digits;
+	// The levels that take bits of the hash, and the level of items with equal hashes
+	static constexpr size_t MAX_DEPTH = HASH_BITS / BITS + 2;
+
+	struct Entry
+	{
+		std::pair<K, V> item;
+		size_t hash;
+	};
+
+	struct Node;
+	using NodePtr = std::shared_ptr<Node>;
+
+	// Below HASH_BITS, entries and children are in the order of their bits in itemMap and childMap.
+	// At HASH_BITS, entries have equal hashes, are not ordered and the node has no children
+	struct Node
+	{
+		uint32_t itemMap = 0;
+		uint32_t childMap = 0;
+		std::vector<Entry> entries;
+		std::vector<NodePtr> children;
+	};
+
+public:
+	struct WriteProxy
+	{
+		CowMap* operator->()
+		{
+			return m_p;
+		}
+
+	private:
+		friend class CowMap;
+		WriteProxy(WriteProxy const&) = default;
+		WriteProxy& operator=(WriteProxy const&) = delete;
+		WriteProxy(CowMap* p)
+			: m_p(p)
+		{
+		}
+
+		CowMap* m_p;
+	};
+
+	class ConstIterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = std::pair<K, V>;
+		using difference_type = ptrdiff_t;
+		using pointer = value_type const*;
+		using reference = value_type const&;
+
+		ConstIterator() = default;
+
+		reference operator*() const
+		{
+			return GetEntry()->item;
+		}
+
+		pointer operator->() const
+		{
+			return &GetEntry()->item;
+		}
+
+		ConstIterator& operator++()
+		{
+			++m_entryIndex;
+			Settle();
+			return *this;
+		}
+
+		ConstIterator operator++(int)
+		{
+			auto result = *this;
+			++*this;
+			return result;
+		}
+
+		friend bool operator==(ConstIterator const& lhs, ConstIterator const& rhs)
+		{
+			return lhs.GetEntry() == rhs.GetEntry();
+		}
+
+		friend bool operator!=(ConstIterator const& lhs, ConstIterator const& rhs)
+		{
+			return lhs.GetEntry() != rhs.GetEntry();
+		}
+
+	private:
+		friend class CowMap;
+
+		// The next child to visit in a node on the path to the current entry.
+		// The entries of a node are visited before its children
+		struct Frame
+		{
+			Node const* node;
+			size_t childIndex;
+		};
+
+		Entry const* GetEntry() const
+		{
+			return m_depth > 0 ? &m_path[m_depth - 1].node->entries[m_entryIndex] : nullptr;
+		}
+
+		void Push(Node const* node, size_t childIndex)
+		{
+			assert(m_depth < MAX_DEPTH);
+			m_path[m_depth++] = { node, childIndex };
+		}
+
+		// Moves to the first entry at or after the current position in the visiting order
+		void Settle()
+		{
+			while (m_depth > 0)
+			{
+				Frame& top = m_path[m_depth - 1];
+				if (m_entryIndex < top.node->entries.size())
+				{
+					return;
+				}
+				if (top.childIndex < top.node->children.size())
+				{
+					Push(top.node->children[top.childIndex++].get(), 0);
+					m_entryIndex = 0;
+				}
+				else
+				{
+					// The entries of the parent have been visited before this node
+					--m_depth;
+					m_entryIndex = std::numeric_limits<size_t>::max();
+				}
+			}
+		}
+
+		std::array<Frame, MAX_DEPTH> m_path{};
+		size_t m_depth = 0;
+		size_t m_entryIndex = 0;
+	};
+
+	CowMap() = default;
+
+	CowMap(std::initializer_list<std::pair<K, V>> items)
+	{
+		for (auto& item : items)
+		{
+			insert_or_assign(item.first, item.second);
+		}
+	}
+
+	CowMap(CowMap const& rhs) = default;
+
+	CowMap(CowMap&& rhs) noexcept
+		: m_root(std::move(rhs.m_root))
+		, m_size(std::exchange(rhs.m_size, 0))
+	{
+	}
+
+	CowMap& operator=(CowMap const& rhs) = default;
+
+	CowMap& operator=(CowMap&& rhs) noexcept
+	{
+		m_root = std::move(rhs.m_root);
+		m_size = std::exchange(rhs.m_size, 0);
+		return *this;
+	}
+
+	CowMap const* operator->() const
+	{
+		return this;
+	}
+
+	WriteProxy operator--(int)
+	{
+		return { this };
+	}
+
+	CowMap& Write()
+	{
+		return *this;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+
+	ConstIterator begin() const
+	{
+		ConstIterator it;
+		if (m_root)
+		{
+			it.Push(m_root.get(), 0);
+			it.Settle();
+		}
+		return it;
+	}
+
+	ConstIterator end() const
+	{
+		return {};
+	}
+
+	ConstIterator find(K const& key) const
+	{
+		ConstIterator it;
+		size_t hash = m_hash(key);
+		Node const* node = m_root.get();
+		for (size_t shift = 0; node; shift += BITS)
+		{
+			if (shift >= HASH_BITS)
+			{
+				for (size_t i = 0; i < node->entries.size(); ++i)
+				{
+					if (m_keyEqual(node->entries[i].item.first, key))
+					{
+						it.Push(node, 0);
+						it.m_entryIndex = i;
+						return it;
+					}
+				}
+				return {};
+			}
+			uint32_t bit = GetBit(hash, shift);
+			if (node->itemMap & bit)
+			{
+				size_t i = GetIndex(node->itemMap, bit);
+				Entry const& entry = node->entries[i];
+				if (entry.hash != hash || !m_keyEqual(entry.item.first, key))
+				{
+					return {};
+				}
+				it.Push(node, 0);
+				it.m_entryIndex = i;
+				return it;
+			}
+			if (!(node->childMap & bit))
+			{
+				return {};
+			}
+			size_t childIndex = GetIndex(node->childMap, bit);
+			it.Push(node, childIndex + 1);
+			node = node->children[childIndex].get();
+		}
+		return {};
+	}
+
+	size_t count(K const& key) const
+	{
+		return FindEntry(key) ? 1 : 0;
+	}
+
+	// Throws std::out_of_range if there is no such key
+	V const& at(K const& key) const
+	{
+		Entry const* entry = FindEntry(key);
+		if (!entry)
+		{
+			throw std::out_of_range("CowMap has no such key");
+		}
+		return entry->item.second;
+	}
+
+	// Returns true if the key was inserted, false if it was there and the value is kept
+	bool insert(K const& key, V value)
+	{
+		if (count(key))
+		{
+			return false;
+		}
+		bool isInserted = false;
+		Upsert(key, [&value] { return std::move(value); }, isInserted);
+		return true;
+	}
+
+	// Returns true if the key was inserted, false if its value was replaced
+	bool insert_or_assign(K const& key, V value)
+	{
+		bool isInserted = false;
+		V& target = Upsert(key, [&value] { return std::move(value); }, isInserted);
+		if (!isInserted)
+		{
+			target = std::move(value);
+		}
+		return isInserted;
+	}
+
+	// Copies the nodes on the path to the value if they are shared, inserting a value-initialized
+	// value if there is no such key
+	V& WriteAt(K const& key)
+	{
+		bool isInserted = false;
+		return Upsert(key, [] { return V(); }, isInserted);
+	}
+
+	// Returns the number of erased items. Nothing is copied if there is no such key
+	size_t erase(K const& key)
+	{
+		if (!count(key))
+		{
+			return 0;
+		}
+		Erase(m_root, 0, m_hash(key), key);
+		if (--m_size == 0)
+		{
+			m_root.reset();
+		}
+		return 1;
+	}
+
+	void clear()
+	{
+		m_root.reset();
+		m_size = 0;
+	}
+
+private:
+	static uint32_t GetBit(size_t hash, size_t shift)
+	{
+		return uint32_t(1) << ((hash >> shift) & MASK);
+	}
+
+	// The position among the entries or children of the slot whose bit is given
+	static size_t GetIndex(uint32_t map, uint32_t bit)
+	{
+		uint32_t x = map & (bit - 1);
+		x = x - ((x >> 1) & 0x55555555);
+		x = (x & 0x33333333) + ((x >> 2) & 0x33333333);
+		return (((x + (x >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24;
+	}
+
+	// Like find, without keeping the path for iterating
+	Entry const* FindEntry(K const& key) const
+	{
+		size_t hash = m_hash(key);
+		Node const* node = m_root.get();
+		for (size_t shift = 0; node; shift += BITS)
+		{
+			if (shift >= HASH_BITS)
+			{
+				for (auto& entry : node->entries)
+				{
+					if (m_keyEqual(entry.item.first, key))
+					{
+						return &entry;
+					}
+				}
+				return nullptr;
+			}
+			uint32_t bit = GetBit(hash, shift);
+			if (node->itemMap & bit)
+			{
+				Entry const& entry = node->entries[GetIndex(node->itemMap, bit)];
+				return entry.hash == hash && m_keyEqual(entry.item.first, key) ? &entry : nullptr;
+			}
+			if (!(node->childMap & bit))
+			{
+				return nullptr;
+			}
+			node = node->children[GetIndex(node->childMap, bit)].get();
+		}
+		return nullptr;
+	}
+
+	static void MakeUnique(NodePtr& node)
+	{
+		if (node.use_count() > 1)
+		{
+			node = std::make_shared<Node>(*node);
+		}
+	}
+
+	template <typename ValueFactory>
+	V& Upsert(K const& key, ValueFactory&& valueFactory, bool& isInserted)
+	{
+		if (!m_root)
+		{
+			m_root = std::make_shared<Node>();
+		}
+		V& value = Upsert(m_root, 0, m_hash(key), key, valueFactory, isInserted);
+		if (isInserted)
+		{
+			++m_size;
+		}
+		return value;
+	}
+
+	template <typename ValueFactory>
+	V& Upsert(NodePtr& node, size_t shift, size_t hash, K const& key, ValueFactory& valueFactory, bool& isInserted)
+	{
+		MakeUnique(node);
+		if (shift >= HASH_BITS)
+		{
+			for (auto& entry : node->entries)
+			{
+				if (m_keyEqual(entry.item.first, key))
+				{
+					return entry.item.second;
+				}
+			}
+			isInserted = true;
+			node->entries.push_back({ { key, valueFactory() }, hash });
+			return node->entries.back().item.second;
+		}
+
+		uint32_t bit = GetBit(hash, shift);
+		if (node->childMap & bit)
+		{
+			return Upsert(node->children[GetIndex(node->childMap, bit)], shift + BITS, hash, key, valueFactory, isInserted);
+		}
+
+		size_t entryIndex = GetIndex(node->itemMap, bit);
+		if (!(node->itemMap & bit))
+		{
+			isInserted = true;
+			node->itemMap |= bit;
+			auto it = node->entries.insert(node->entries.begin() + entryIndex, { { key, valueFactory() }, hash });
+			return it->item.second;
+		}
+
+		Entry& entry = node->entries[entryIndex];
+		if (entry.hash == hash && m_keyEqual(entry.item.first, key))
+		{
+			return entry.item.second;
+		}
+
+		// The slot is taken by another key, both go down into a new child
+		auto child = std::make_shared<Node>();
+		size_t childShift = shift + BITS;
+		if (childShift < HASH_BITS)
+		{
+			child->itemMap = GetBit(entry.hash, childShift);
+		}
+		child->entries.push_back(std::move(entry));
+		node->entries.erase(node->entries.begin() + entryIndex);
+		node->itemMap &= ~bit;
+		node->childMap |= bit;
+		auto& slot = *node->children.insert(node->children.begin() + GetIndex(node->childMap, bit), std::move(child));
+		return Upsert(slot, childShift, hash, key, valueFactory, isInserted);
+	}
+
+	// The key must be in the map. A child left with one item and no children is merged into its
+	// parent, so that the trie has the same shape regardless of the order of updates
+	void Erase(NodePtr& node, size_t shift, size_t hash, K const& key)
+	{
+		MakeUnique(node);
+		if (shift >= HASH_BITS)
+		{
+			auto it = std::find_if(node->entries.begin(), node->entries.end(), [this, &key](Entry const& entry) {
+				return m_keyEqual(entry.item.first, key);
+			});
+			assert(it != node->entries.end());
+			node->entries.erase(it);
+			return;
+		}
+
+		uint32_t bit = GetBit(hash, shift);
+		if (node->itemMap & bit)
+		{
+			node->entries.erase(node->entries.begin() + GetIndex(node->itemMap, bit));
+			node->itemMap &= ~bit;
+			return;
+		}
+
+		assert(node->childMap & bit);
+		size_t childIndex = GetIndex(node->childMap, bit);
+		NodePtr& child = node->children[childIndex];
+		Erase(child, shift + BITS, hash, key);
+		if (!child->children.empty() || child->entries.size() > 1)
+		{
+			return;
+		}
+		if (!child->entries.empty())
+		{
+			node->entries.insert(node->entries.begin() + GetIndex(node->itemMap, bit), std::move(child->entries.front()));
+			node->itemMap |= bit;
+		}
+		node->children.erase(node->children.begin() + childIndex);
+		node->childMap &= ~bit;
+	}
+
+	NodePtr m_root;
+	size_t m_size = 0;
+	Hash m_hash;
+	KeyEqual m_keyEqual;
+};
@@ -0,0 +1,401 @@
+#pragma once
+
+// A vector with copy-on-write semantics that doesn't copy all of its elements on the first write
+// after a copy. The elements are kept in chunks of WIDTH in the leaves of a trie, the last chunk
+// (the tail) is kept apart from the trie. Copies of a vector share the chunks and the nodes, and a
+// write copies only the touched chunk and its ancestors, so it costs O(log32 n) rather than O(n).
+// push_back only copies the shared tail until it is full, so it is amortized O(1) plus the cost of
+// putting a full tail into the trie once per WIDTH elements.
+// As with Cow, reads go through operator-> and writes through operator--(int) or Write(),
+// so CowVector<T> can replace Cow<std::vector<T>> for the usual vector operations.
+// Nodes that are not shared are modified in place. Like Cow, a vector must not be written
+// while it is being copied on another thread
+template <typename T>
+class CowVector
+{
+	static constexpr size_t BITS = 5;
+	static constexpr size_t WIDTH = size_t(1) << BITS;
+	static constexpr size_t MASK = WIDTH - 1;
+
+	// An inner node has children and no values, a leaf has values and no children
+	struct Node
+	{
+		std::vector<std::shared_ptr<Node>> children;
+		std::vector<T> values;
+	};
+	using NodePtr = std::shared_ptr<Node>;
+
+public:
+	struct WriteProxy
+	{
+		CowVector* operator->()
+		{
+			return m_p;
+		}
+
+	private:
+		friend class CowVector;
+		WriteProxy(WriteProxy const&) = default;
+		WriteProxy& operator=(WriteProxy const&) = delete;
+		WriteProxy(CowVector* p)
+			: m_p(p)
+		{
+		}
+
+		CowVector* m_p;
+	};
+
+	class ConstIterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = T;
+		using difference_type = ptrdiff_t;
+		using pointer = T const*;
+		using reference = T const&;
+
+		ConstIterator() = default;
+
+		reference operator*() const
+		{
+			return m_chunk[m_index & MASK];
+		}
+
+		pointer operator->() const
+		{
+			return &m_chunk[m_index & MASK];
+		}
+
+		ConstIterator& operator++()
+		{
+			// The chunk is looked up once per WIDTH elements
+			if ((++m_index & MASK) == 0 && m_index < m_owner->m_size)
+			{
+				m_chunk = m_owner->GetChunk(m_index);
+			}
+			return *this;
+		}
+
+		ConstIterator operator++(int)
+		{
+			auto result = *this;
+			++*this;
+			return result;
+		}
+
+		friend bool operator==(ConstIterator const& lhs, ConstIterator const& rhs)
+		{
+			return lhs.m_index == rhs.m_index;
+		}
+
+		friend bool operator!=(ConstIterator const& lhs, ConstIterator const& rhs)
+		{
+			return lhs.m_index != rhs.m_index;
+		}
+
+	private:
+		friend class CowVector;
+		ConstIterator(CowVector const* owner, size_t index)
+			: m_owner(owner)
+			, m_index(index)
+			, m_chunk(index < owner->m_size ? owner->GetChunk(index) : nullptr)
+		{
+		}
+
+		CowVector const* m_owner = nullptr;
+		size_t m_index = 0;
+		T const* m_chunk = nullptr;
+	};
+
+	CowVector() = default;
+
+	explicit CowVector(size_t count, T const& value = T())
+	{
+		for (size_t i = 0; i < count; ++i)
+		{
+			push_back(value);
+		}
+	}
+
+	CowVector(std::initializer_list<T> values)
+	{
+		for (auto& value : values)
+		{
+			push_back(value);
+		}
+	}
+
+	CowVector(CowVector const& rhs) = default;
+
+	CowVector(CowVector&& rhs) noexcept
+		: m_root(std::move(rhs.m_root))
+		, m_tail(std::move(rhs.m_tail))
+		, m_size(std::exchange(rhs.m_size, 0))
+		, m_shift(std::exchange(rhs.m_shift, BITS))
+	{
+	}
+
+	CowVector& operator=(CowVector const& rhs) = default;
+
+	CowVector& operator=(CowVector&& rhs) noexcept
+	{
+		m_root = std::move(rhs.m_root);
+		m_tail = std::move(rhs.m_tail);
+		m_size = std::exchange(rhs.m_size, 0);
+		m_shift = std::exchange(rhs.m_shift, BITS);
+		return *this;
+	}
+
+	CowVector const* operator->() const
+	{
+		return this;
+	}
+
+	WriteProxy operator--(int)
+	{
+		return { this };
+	}
+
+	CowVector& Write()
+	{
+		return *this;
+	}
+
+	size_t size() const
+	{
+		return m_size;
+	}
+
+	bool empty() const
+	{
+		return m_size == 0;
+	}
+
+	T const& operator[](size_t index) const
+	{
+		assert(index < m_size);
+		return GetChunk(index)[index & MASK];
+	}
+
+	T const& front() const
+	{
+		return (*this)[0];
+	}
+
+	T const& back() const
+	{
+		return (*this)[m_size - 1];
+	}
+
+	ConstIterator begin() const
+	{
+		return { this, 0 };
+	}
+
+	ConstIterator end() const
+	{
+		return { this, m_size };
+	}
+
+	// Copies the chunk holding the element and its ancestors if they are shared
+	T& WriteAt(size_t index)
+	{
+		assert(index < m_size);
+		if (index >= GetTailOffset())
+		{
+			MakeUnique(m_tail);
+			return m_tail->values[index & MASK];
+		}
+		MakeUnique(m_root);
+		Node* node = m_root.get();
+		for (size_t level = m_shift; level > 0; level -= BITS)
+		{
+			auto& child = node->children[(index >> level) & MASK];
+			MakeUnique(child);
+			node = child.get();
+		}
+		return node->values[index & MASK];
+	}
+
+	void Set(size_t index, T value)
+	{
+		WriteAt(index) = std::move(value);
+	}
+
+	void push_back(T value)
+	{
+		if (!m_tail)
+		{
+			m_tail = MakeLeaf();
+		}
+		else if (m_size - GetTailOffset() == WIDTH)
+		{
+			PushTail();
+			m_tail = MakeLeaf();
+		}
+		else
+		{
+			MakeUnique(m_tail);
+		}
+		m_tail->values.push_back(std::move(value));
+		++m_size;
+	}
+
+	void pop_back()
+	{
+		assert(m_size > 0);
+		if (m_size == 1)
+		{
+			clear();
+		}
+		else if (m_size - GetTailOffset() > 1)
+		{
+			MakeUnique(m_tail);
+			m_tail->values.pop_back();
+			--m_size;
+		}
+		else
+		{
+			// The tail becomes empty, the last chunk of the trie takes its place
+			PopTail();
+			--m_size;
+		}
+	}
+
+	void clear()
+	{
+		m_root.reset();
+		m_tail.reset();
+		m_size = 0;
+		m_shift = BITS;
+	}
+
+private:
+	static NodePtr MakeLeaf()
+	{
+		auto leaf = std::make_shared<Node>();
+		leaf->values.reserve(WIDTH);
+		return leaf;
+	}
+
+	static void MakeUnique(NodePtr& node)
+	{
+		if (node.use_count() > 1)
+		{
+			node = std::make_shared<Node>(*node);
+		}
+	}
+
+	// A chain of inner nodes from level down to the leaf
+	static NodePtr MakePath(size_t level, NodePtr leaf)
+	{
+		if (level == 0)
+		{
+			return leaf;
+		}
+		auto node = std::make_shared<Node>();
+		node->children.push_back(MakePath(level - BITS, std::move(leaf)));
+		return node;
+	}
+
+	// The index of the first element of the tail
+	size_t GetTailOffset() const
+	{
+		return m_size < WIDTH ? 0 : ((m_size - 1) >> BITS) << BITS;
+	}
+
+	NodePtr const& GetLeaf(size_t index) const
+	{
+		if (index >= GetTailOffset())
+		{
+			return m_tail;
+		}
+		NodePtr const* node = &m_root;
+		for (size_t level = m_shift; level > 0; level -= BITS)
+		{
+			node = &(*node)->children[(index >> level) & MASK];
+		}
+		return *node;
+	}
+
+	T const* GetChunk(size_t index) const
+	{
+		return GetLeaf(index)->values.data();
+	}
+
+	// Moves the full tail into the trie, adding a level when the trie is full
+	void PushTail()
+	{
+		if (!m_root)
+		{
+			m_root = std::make_shared<Node>();
+			m_shift = BITS;
+		}
+		if ((m_size >> BITS) > (size_t(1) << m_shift))
+		{
+			auto root = std::make_shared<Node>();
+			root->children.push_back(std::move(m_root));
+			root->children.push_back(MakePath(m_shift, std::move(m_tail)));
+			m_root = std::move(root);
+			m_shift += BITS;
+		}
+		else
+		{
+			PushTail(m_shift, m_root);
+		}
+	}
+
+	void PushTail(size_t level, NodePtr& node)
+	{
+		MakeUnique(node);
+		size_t childIndex = ((m_size - 1) >> level) & MASK;
+		if (level == BITS)
+		{
+			node->children.push_back(std::move(m_tail));
+		}
+		else if (childIndex < node->children.size())
+		{
+			PushTail(level - BITS, node->children[childIndex]);
+		}
+		else
+		{
+			node->children.push_back(MakePath(level - BITS, std::move(m_tail)));
+		}
+	}
+
+	// Takes the last chunk of the trie as the tail, removing a level when the root has one child
+	void PopTail()
+	{
+		m_tail = GetLeaf(m_size - 2);
+		if (m_size - 1 == WIDTH)
+		{
+			m_root.reset();
+			m_shift = BITS;
+			return;
+		}
+		PopTail(m_shift, m_root);
+		if (m_shift > BITS && m_root->children.size() == 1)
+		{
+			NodePtr child = m_root->children.front();
+			m_root = std::move(child);
+			m_shift -= BITS;
+		}
+	}
+
+	// Returns true if the node became empty
+	bool PopTail(size_t level, NodePtr& node)
+	{
+		MakeUnique(node);
+		if (level > BITS && !PopTail(level - BITS, node->children.back()))
+		{
+			return false;
+		}
+		node->children.pop_back();
+		return node->children.empty();
+	}
+
+	NodePtr m_root;
+	NodePtr m_tail;
+	size_t m_size = 0;
+	size_t m_shift = BITS;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+// A Cow for values whose copies never leave one thread. The value and a plain reference count are
+// kept in one allocation and the handle is a pointer to it, so copying a handle is a non-atomic
+// increment, and a handle takes 8 bytes on 64-bit platforms rather than the 16 of a shared_ptr.
+// The read and write API is that of Cow. As the value is allocated together with the count,
+// a LocalCow<Derived> can't be converted to a LocalCow<Base>, polymorphic values need Cow
+template <typename T>
+class LocalCow
+{
+	struct Block
+	{
+		template <typename... Args>
+		explicit Block(Args&&... args)
+			: value(std::forward<Args>(args)...)
+		{
+		}
+
+		T value;
+		size_t refCount = 1;
+	};
+
+public:
+	struct WriteProxy
+	{
+		T* operator->()
+		{
+			return m_p;
+		}
+
+	private:
+		friend class LocalCow;
+		WriteProxy(WriteProxy const&) = default;
+		WriteProxy& operator=(WriteProxy const&) = delete;
+		WriteProxy(T* p)
+			: m_p(p)
+		{
+		}
+
+		T* m_p;
+	};
+
+	template <typename... Args, typename = std::enable_if_t<std::is_constructible_v<T, Args...>>>
+	LocalCow(Args&&... args)
+		: m_block(new Block(std::forward<Args>(args)...))
+	{
+	}
+
+	LocalCow(LocalCow const& rhs)
+		: m_block(rhs.m_block)
+	{
+		if (m_block)
+		{
+			++m_block->refCount;
+		}
+	}
+
+	LocalCow(LocalCow&& rhs) noexcept
+		: m_block(std::exchange(rhs.m_block, nullptr))
+	{
+	}
+
+	LocalCow& operator=(LocalCow const& rhs)
+	{
+		if (rhs.m_block)
+		{
+			++rhs.m_block->refCount;
+		}
+		Release();
+		m_block = rhs.m_block;
+		return *this;
+	}
+
+	LocalCow& operator=(LocalCow&& rhs) noexcept
+	{
+		if (this != &rhs)
+		{
+			Release();
+			m_block = std::exchange(rhs.m_block, nullptr);
+		}
+		return *this;
+	}
+
+	~LocalCow()
+	{
+		Release();
+	}
+
+	T const& operator*() const
+	{
+		assert(m_block);
+		return m_block->value;
+	}
+
+	T const* operator->() const
+	{
+		assert(m_block);
+		return &m_block->value;
+	}
+
+	WriteProxy operator--(int)
+	{
+		assert(m_block);
+		EnsureUnique();
+		return { &m_block->value };
+	}
+
+	T& Write()
+	{
+		assert(m_block);
+		EnsureUnique();
+		return m_block->value;
+	}
+
+private:
+	void EnsureUnique()
+	{
+		if (m_block->refCount > 1)
+		{
+			auto copy = new Block(std::as_const(m_block->value));
+			--m_block->refCount;
+			m_block = copy;
+		}
+	}
+
+	void Release()
+	{
+		if (m_block && --m_block->refCount == 0)
+		{
+			delete m_block;
+		}
+	}
+
+	Block* m_block;
+};
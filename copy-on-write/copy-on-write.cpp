@@ -1,12 +1,18 @@
 ﻿// copy-on-write.cpp : This file contains the 'main' function. Program execution begins and ends there.
 //
 #include "pch.h"
+#include "AtomicCow.h"
 #include "Cow.h"
+#include "CowBenchmark.h"
+#include "CowMap.h"
+#include "CowVector.h"
+#include "LocalCow.h"
 
 struct Base
 {
 	virtual ~Base() = default;
 	virtual std::shared_ptr<Base> Clone() const = 0;
+	virtual std::shared_ptr<Base> CloneInto(CowCloneStorage const& storage) const = 0;
 	virtual void SetValue(int value) = 0;
 	virtual int GetValue() const = 0;
 };
@@ -28,6 +34,11 @@ struct Derived : Base
 		return std::make_shared<Derived>(*this);
 	}
 
+	std::shared_ptr<Base> CloneInto(CowCloneStorage const& storage) const override
+	{
+		return storage.Construct<Derived>(*this);
+	}
+
 private:
 	int m_val = 0;
 };
@@ -58,6 +69,7 @@ struct Shape
 {
 	virtual ~Shape() = default;
 	virtual shared_ptr<Shape> Clone() const = 0;
+	virtual shared_ptr<Shape> CloneInto(CowCloneStorage const& storage) const = 0;
 };
 
 struct Circle : public Shape
@@ -72,13 +84,63 @@ struct Circle : public Shape
 		return make_shared<Circle>(*this);
 	}
 
+	shared_ptr<Shape> CloneInto(CowCloneStorage const& storage) const override
+	{
+		return storage.Construct<Circle>(*this);
+	}
+
 private:
 	double m_radius;
 };
 
-int main()
+// HeapCow<Tree> is named, and even completed by optional, while Tree is still incomplete
+struct Tree
+{
+	int value = 0;
+	vector<HeapCow<Tree>> children;
+	optional<HeapCow<Tree>> previousVersion;
+};
+
+// An arena that counts the allocations made from it
+class CountingArena : public pmr::memory_resource
+{
+public:
+	size_t GetAllocationCount() const
+	{
+		return m_allocationCount;
+	}
+
+private:
+	void* do_allocate(size_t bytes, size_t alignment) override
+	{
+		++m_allocationCount;
+		return m_arena.allocate(bytes, alignment);
+	}
+
+	void do_deallocate(void* p, size_t bytes, size_t alignment) override
+	{
+		m_arena.deallocate(p, bytes, alignment);
+	}
+
+	bool do_is_equal(memory_resource const& other) const noexcept override
+	{
+		return this == &other;
+	}
+
+	pmr::monotonic_buffer_resource m_arena;
+	size_t m_allocationCount = 0;
+};
+
+int main(int argc, char* argv[])
 {
 	using namespace std;
+	// Handles are benchmarked separately: copy-on-write --benchmark
+	if (argc > 1 && argv[1] == string("--benchmark"))
+	{
+		BenchmarkCows();
+		return 0;
+	}
+
 	{
 		Cow<Circle> circle(100.0);
 		Cow<Shape> shape1{ circle };
@@ -102,6 +164,34 @@ int main()
 		assert(subj1->GetValue() == 1);
 		assert(subj2->GetValue() == 2);
 	}
+	{
+		// Small trivially copyable values are kept in the handle unless asked otherwise
+		static_assert(sizeof(Cow<Subject>) == sizeof(Subject));
+		static_assert(sizeof(HeapCow<Subject>) == sizeof(shared_ptr<Subject>));
+		static_assert(!IsCowInline<Circle>);
+
+		Cow<Subject> subj1;
+		subj1--->SetValue(1);
+
+		auto subj2 = subj1;
+		assert(&*subj1 != &*subj2);
+		subj2--->SetValue(2);
+
+		assert(subj1->GetValue() == 1);
+		assert(subj2->GetValue() == 2);
+	}
+	{
+		HeapCow<Tree> root;
+		root--->children.emplace_back();
+		root--->children.back()--->value = 1;
+
+		auto rootCopy = root;
+		assert(&*rootCopy->children.front() == &*root->children.front());
+		rootCopy--->children.front()--->value = 2;
+
+		assert(root->children.front()->value == 1);
+		assert(rootCopy->children.front()->value == 2);
+	}
 	{
 		Cow<vector<int>> v;
 		v.Write().push_back(100);
@@ -114,6 +204,148 @@ int main()
 		v2--->push_back(42);
 	}
 
+	{
+		// Only the tail chunk is copied, not all 100000 elements
+		CowVector<int> v1(100000u);
+		auto v2 = v1;
+		v2--->push_back(42);
+		v2.Write().Set(500, 1);
+
+		assert(v1->size() == 100000u);
+		assert(v2->size() == 100001u);
+		assert(v1[500] == 0 && v2[500] == 1);
+		assert(v2->back() == 42);
+
+		v2--->pop_back();
+		int sum = 0;
+		for (int x : v2)
+		{
+			sum += x;
+		}
+		assert(sum == 1);
+	}
+
+	{
+		// An update copies a few nodes, not all the settings
+		CowMap<string, int> settings;
+		for (int i = 0; i < 10000; ++i)
+		{
+			settings--->insert_or_assign("setting" + to_string(i), i);
+		}
+		auto snapshot = settings;
+		settings--->insert_or_assign("setting42", -42);
+		settings.Write().erase("setting7");
+		settings--->WriteAt("timeout") = 30;
+
+		assert(snapshot->at("setting42") == 42 && settings->at("setting42") == -42);
+		assert(snapshot->count("setting7") == 1 && settings->count("setting7") == 0);
+		assert(snapshot->find("timeout") == snapshot->end());
+		assert(settings->size() == 10000u);
+
+		size_t count = 0;
+		for (auto& item : snapshot)
+		{
+			if (item.first == "setting" + to_string(item.second))
+			{
+				++count;
+			}
+		}
+		assert(count == snapshot->size());
+	}
+
+	{
+		// Readers see either all or none of the elements of a version incremented
+		AtomicCow<vector<int>> counters(16u, 0);
+		atomic<bool> isDone{ false };
+		thread reader([&] {
+			while (!isDone)
+			{
+				auto snapshot = counters.Load();
+				assert(count(snapshot->begin(), snapshot->end(), snapshot->front()) == 16);
+			}
+		});
+		vector<thread> writers;
+		for (int i = 0; i < 2; ++i)
+		{
+			writers.emplace_back([&] {
+				for (int j = 0; j < 1000; ++j)
+				{
+					counters.Update([](vector<int>& values) {
+						for (auto& value : values)
+						{
+							++value;
+						}
+					});
+				}
+			});
+		}
+		for (auto& writer : writers)
+		{
+			writer.join();
+		}
+		isDone = true;
+		reader.join();
+
+		assert(counters->back() == 2000);
+	}
+
+	{
+		static_assert(sizeof(LocalCow<Subject>) == sizeof(void*));
+		LocalCow<Subject> subj1;
+		subj1--->SetValue(1);
+
+		auto subj2 = subj1;
+		assert(&*subj1 == &*subj2);
+		subj2--->SetValue(2);
+
+		assert(subj1->GetValue() == 1);
+		assert(subj2->GetValue() == 2);
+
+		LocalCow<vector<int>> v(3u, 42);
+		auto vCopy = v;
+		vCopy.Write().push_back(1);
+		assert(v->size() == 3u && vCopy->size() == 4u);
+	}
+
+	{
+		// Copies of abstract values are cloned into one allocation from the arena of the handle
+		CountingArena arena;
+		PmrCow<Circle> circle(allocator_arg, &arena, 1.0);
+		PmrCow<Shape> shape{ circle };
+		assert(arena.GetAllocationCount() == 1);
+		shape.Write();
+		assert(arena.GetAllocationCount() == 2);
+		assert(&*shape != &*circle);
+
+		PmrCow<Derived> derived(allocator_arg, &arena);
+		PmrCow<Base> base{ derived };
+		base--->SetValue(1);
+		assert(arena.GetAllocationCount() == 4);
+		assert(derived->GetValue() == 0 && base->GetValue() == 1);
+
+		PmrCow<vector<int>> v(allocator_arg, &arena, 100u, 42);
+		auto vCopy = v;
+		vCopy--->push_back(1);
+		assert(arena.GetAllocationCount() == 6);
+		assert(vCopy.GetAllocator().resource() == &arena);
+
+		// Assignment shares the value, while the handle keeps its own arena for later copies
+		CountingArena otherArena;
+		PmrCow<vector<int>> w(allocator_arg, &otherArena);
+		w = v;
+		assert(&*w == &*v && w.GetAllocator().resource() == &otherArena);
+		w--->push_back(2);
+		assert(otherArena.GetAllocationCount() == 2 && arena.GetAllocationCount() == 6);
+		w = std::move(vCopy);
+		assert(w->size() == 101u && w.GetAllocator().resource() == &otherArena);
+		shape = circle;
+		assert(&*shape == &*circle && shape.GetAllocator().resource() == &arena);
+
+		PmrCow<Subject> subj(allocator_arg, &arena);
+		subj = PmrCow<Subject>();
+		assert(subj.GetAllocator().resource() == &arena && arena.GetAllocationCount() == 6);
+	}
+
 	{
 		Cow<vector<int>> v(100000u, 42);
 		Cow<Base> base(make_unique<Derived>());
@@ -0,0 +1,166 @@
+#pragma once
+
+#include "CacheT.h"
+#include "WeakKeyCacheT.h"
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <unordered_map>
+
+class Obj
+{
+};
+using ObjWeakPtr = std::weak_ptr<Obj>;
+using ObjPtr = std::shared_ptr<Obj>;
+
+class Cache : public std::enable_shared_from_this<Cache>
+{
+public:
+	explicit Cache(EvictionMode evictionMode = EvictionMode::Immediate)
+	{
+		if (evictionMode == EvictionMode::Deferred)
+		{
+			m_expiredKeys = std::make_shared<ExpiredKeys>();
+		}
+	}
+
+	ObjPtr GetObjectById(const std::string& key) const
+	{
+		Sweep();
+
+		ObjPtr obj;
+		if (auto item = m_items.find(key);
+			item != m_items.end())
+		{
+			obj = item->second.lock();
+		}
+
+		if (obj)
+		{
+			m_metrics.RecordHit();
+		}
+		else
+		{
+			auto factoryCallStart = m_metrics.StartFactoryCall();
+			if (m_expiredKeys)
+			{
+				obj.reset(new Obj(), [pushKey = ExpiredKeys::Pusher(m_expiredKeys, key)](Obj* p) {
+					pushKey();
+					delete p;
+				});
+			}
+			else
+			{
+				obj.reset(new Obj(), [key, weakSelf = weak_from_this()](Obj* p) {
+					if (auto self = weakSelf.lock())
+					{
+						self->m_metrics.RecordExpirations(self->m_items.erase(key));
+					}
+					delete p;
+				});
+			}
+			m_metrics.RecordMiss(factoryCallStart);
+			m_items.insert_or_assign(key, obj);
+		}
+
+		return obj;
+	}
+
+	// Erases the items whose objects have been destroyed since the last sweep.
+	// Does nothing in the immediate eviction mode
+	void Sweep() const
+	{
+		if (!m_expiredKeys || m_expiredKeys->IsEmpty())
+		{
+			return;
+		}
+		size_t expiredCount = 0;
+		m_expiredKeys->Consume([this, &expiredCount](const std::string& key) {
+			if (auto it = m_items.find(key); it != m_items.end() && it->second.expired())
+			{
+				m_items.erase(it);
+				++expiredCount;
+			}
+		});
+		m_metrics.RecordExpirations(expiredCount);
+	}
+
+	// Erases the items whose objects have been destroyed, such as the ones the deferred eviction
+	// mode keeps until a sweep, and shrinks the table to fit
+	CacheShrinkResult ShrinkToFit() const
+	{
+		CacheShrinkResult result;
+		const size_t allocatedBytes = detail::GetMapAllocatedBytes(m_items);
+		for (auto it = m_items.begin(); it != m_items.end();)
+		{
+			if (it->second.expired())
+			{
+				it = m_items.erase(it);
+				++result.erasedCount;
+			}
+			else
+			{
+				++it;
+			}
+		}
+		m_metrics.RecordExpirations(result.erasedCount);
+		detail::ShrinkMapToFit(m_items);
+		result.reclaimedBytes = allocatedBytes - std::min(allocatedBytes, detail::GetMapAllocatedBytes(m_items));
+		return result;
+	}
+
+	size_t GetSize() const noexcept
+	{
+		return m_items.size();
+	}
+
+	CacheMetricsSnapshot GetMetrics() const noexcept
+	{
+		auto metrics = m_metrics.GetSnapshot();
+		metrics.entries = m_items.size();
+		return metrics;
+	}
+
+private:
+	using ExpiredKeys = detail::ExpiredKeyList<std::string>;
+
+	mutable std::unordered_map<std::string, ObjWeakPtr> m_items;
+	mutable detail::CacheMetricsRecorder m_metrics;
+	std::shared_ptr<ExpiredKeys> m_expiredKeys;
+};
+
+struct DataSource
+{
+};
+using DataSourcePtr = std::shared_ptr<DataSource>;
+
+struct Data
+{
+	explicit Data(DataSourcePtr dataSrc)
+		: m_dataSrc(std::move(dataSrc))
+	{
+	}
+
+private:
+	DataSourcePtr m_dataSrc;
+};
+using DataPtr = std::shared_ptr<Data>;
+
+// Data is keyed by the identity of its source. The cache itself doesn't keep sources alive
+class DataCache : public WeakKeyCacheT<DataSource, Data>
+{
+public:
+	DataCache()
+		: WeakKeyCacheT(DataCache::DataFactory)
+	{
+	}
+
+private:
+	static DataPtr DataFactory(const DataSourcePtr& key, CacheCleaner cleaner)
+	{
+		return DataPtr(new Data(key), [cleaner = std::move(cleaner)](Data* d) {
+			cleaner();
+			delete d;
+		});
+	}
+};
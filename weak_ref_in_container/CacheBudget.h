@@ -0,0 +1,304 @@
+#pragma once
+
+#include "FlatHashMap.h"
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <iterator>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+struct CacheBudgetUsage
+{
+	uint64_t capacity = 0;
+	// The weight and the number of the values the budget keeps alive
+	uint64_t retainedWeight = 0;
+	uint64_t retainedCount = 0;
+	// The weight of the values referred to by the caches of the budget, retained or not
+	uint64_t liveWeight = 0;
+	uint64_t admissions = 0;
+	uint64_t rejections = 0;
+	uint64_t evictions = 0;
+};
+
+namespace detail
+{
+
+// Estimates how often keys are accessed, with a count-min sketch of 4 bit counters.
+// The counters are halved every 10 accesses per counter of a row, so that the estimates
+// follow the recent popularity of keys
+class FrequencySketch
+{
+public:
+	explicit FrequencySketch(size_t width)
+		: m_width(std::max<size_t>(64, RoundUpToPowerOf2(width)))
+		, m_counters(ROW_COUNT * m_width)
+		, m_sampleSize(10 * m_width)
+	{
+	}
+
+	void Increment(uint64_t hash) noexcept
+	{
+		for (size_t row = 0; row < ROW_COUNT; ++row)
+		{
+			uint8_t& counter = m_counters[GetIndex(hash, row)];
+			if (counter < MAX_COUNT)
+			{
+				++counter;
+			}
+		}
+		if (++m_accessCount == m_sampleSize)
+		{
+			for (auto& counter : m_counters)
+			{
+				counter /= 2;
+			}
+			m_accessCount /= 2;
+		}
+	}
+
+	uint8_t Estimate(uint64_t hash) const noexcept
+	{
+		uint8_t estimate = MAX_COUNT;
+		for (size_t row = 0; row < ROW_COUNT; ++row)
+		{
+			estimate = std::min(estimate, m_counters[GetIndex(hash, row)]);
+		}
+		return estimate;
+	}
+
+private:
+	static constexpr size_t ROW_COUNT = 4;
+	static constexpr uint8_t MAX_COUNT = 15;
+
+	static size_t RoundUpToPowerOf2(size_t n) noexcept
+	{
+		size_t power = 1;
+		while (power < n)
+		{
+			power *= 2;
+		}
+		return power;
+	}
+
+	size_t GetIndex(uint64_t hash, size_t row) const noexcept
+	{
+		// Every row takes its index from a differently mixed hash
+		static constexpr uint64_t SEEDS[ROW_COUNT] = {
+			0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full, 0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull
+		};
+		const uint64_t h = (hash ^ (hash >> 29)) * SEEDS[row];
+		return row * m_width + static_cast<size_t>((h >> 32) & (m_width - 1));
+	}
+
+	size_t m_width;
+	std::vector<uint8_t> m_counters;
+	size_t m_sampleSize;
+	size_t m_accessCount = 0;
+};
+
+} // namespace detail
+
+// A memory budget shared by a group of caches, which keeps their recently used values alive
+// although nobody holds them, as long as the total weight of those values fits the capacity.
+//
+// Caches report accesses to their keys, identified by 64 bit hashes. The budget estimates the
+// popularity of keys with a TinyLFU frequency sketch: a value which doesn't fit is admitted only
+// if its key is accessed more often than the key of the eviction victim. The victim is the
+// heaviest of the EVICTION_SAMPLE_SIZE least recently used values, so a few cold large values
+// are let go before many small ones.
+//
+// Evicted values are released after the lock of the budget is released, and so is the value
+// of a rejected admission. Caches must not call Admit with their own locks held. The budget
+// never calls caches with its lock held, so they may call the other functions under their locks
+class CacheBudget
+{
+public:
+	static constexpr size_t EVICTION_SAMPLE_SIZE = 8;
+
+	// The sketch width is the number of counters per row. It should be about the number of
+	// distinct keys accessed between evictions of a value
+	explicit CacheBudget(uint64_t capacity, size_t sketchWidth = 16384)
+		: m_capacity(capacity)
+		, m_sketch(sketchWidth)
+	{
+	}
+
+	CacheBudget(const CacheBudget&) = delete;
+	CacheBudget& operator=(const CacheBudget&) = delete;
+
+	uint64_t GetCapacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+	// Counts an access to a key whose value is not offered for retention
+	void RecordAccess(uint64_t keyHash)
+	{
+		std::lock_guard lock(m_mutex);
+		m_sketch.Increment(keyHash);
+		if (auto it = m_index.find(keyHash); it != m_index.end())
+		{
+			m_lru.splice(m_lru.begin(), m_lru, it->second);
+		}
+	}
+
+	// Counts an access to the key and offers its value for retention. The value of a key
+	// which is retained already is replaced
+	void Admit(uint64_t keyHash, std::shared_ptr<const void> value, uint64_t weight)
+	{
+		// Destroyed after the lock is released, since cleaners of values lock their caches
+		std::vector<std::shared_ptr<const void>> released;
+		std::lock_guard lock(m_mutex);
+		m_sketch.Increment(keyHash);
+		if (auto it = m_index.find(keyHash); it != m_index.end())
+		{
+			Retained& retained = *it->second;
+			released.push_back(std::exchange(retained.value, std::move(value)));
+			m_retainedWeight = m_retainedWeight - retained.weight + weight;
+			retained.weight = weight;
+			m_lru.splice(m_lru.begin(), m_lru, it->second);
+			EvictLocked(0, released);
+			return;
+		}
+
+		if (weight > m_capacity)
+		{
+			++m_rejectionCount;
+			released.push_back(std::move(value));
+			return;
+		}
+		if (m_retainedWeight + weight > m_capacity
+			&& m_sketch.Estimate(keyHash) <= m_sketch.Estimate(FindVictimLocked()->keyHash))
+		{
+			++m_rejectionCount;
+			released.push_back(std::move(value));
+			return;
+		}
+		EvictLocked(weight, released);
+		m_lru.push_front({ keyHash, std::move(value), weight });
+		try
+		{
+			m_index.emplace(keyHash, m_lru.begin());
+		}
+		catch (...)
+		{
+			released.push_back(std::move(m_lru.front().value));
+			m_lru.pop_front();
+			throw;
+		}
+		m_retainedWeight += weight;
+		++m_admissionCount;
+	}
+
+	// Stops retaining the value of the key, once its cache has erased the key or is destroyed.
+	// The value is returned to be released after the locks of the cache
+	std::shared_ptr<const void> Forget(uint64_t keyHash)
+	{
+		std::lock_guard lock(m_mutex);
+		auto it = m_index.find(keyHash);
+		if (it == m_index.end())
+		{
+			return nullptr;
+		}
+		auto retained = it->second;
+		m_index.erase(it);
+		m_retainedWeight -= retained->weight;
+		auto value = std::move(retained->value);
+		m_lru.erase(retained);
+		return value;
+	}
+
+	// Caches report the weight of the values they refer to, whether the values are retained or not
+	void AddLiveWeight(int64_t delta) noexcept
+	{
+		m_liveWeight.fetch_add(delta, std::memory_order_relaxed);
+	}
+
+	CacheBudgetUsage GetUsage() const
+	{
+		CacheBudgetUsage usage;
+		usage.capacity = m_capacity;
+		usage.liveWeight = static_cast<uint64_t>(std::max<int64_t>(0, m_liveWeight.load(std::memory_order_relaxed)));
+		std::lock_guard lock(m_mutex);
+		usage.retainedWeight = m_retainedWeight;
+		usage.retainedCount = m_lru.size();
+		usage.admissions = m_admissionCount;
+		usage.rejections = m_rejectionCount;
+		usage.evictions = m_evictionCount;
+		return usage;
+	}
+
+private:
+	struct Retained
+	{
+		uint64_t keyHash;
+		std::shared_ptr<const void> value;
+		uint64_t weight;
+	};
+
+	using LruList = std::list<Retained>;
+
+	// The heaviest of the least recently used values
+	LruList::iterator FindVictimLocked()
+	{
+		auto victim = std::prev(m_lru.end());
+		auto it = victim;
+		for (size_t i = 1; i < EVICTION_SAMPLE_SIZE && it != m_lru.begin(); ++i)
+		{
+			--it;
+			if (it->weight > victim->weight)
+			{
+				victim = it;
+			}
+		}
+		return victim;
+	}
+
+	// Evicts values until the given weight fits
+	void EvictLocked(uint64_t weight, std::vector<std::shared_ptr<const void>>& released)
+	{
+		while (!m_lru.empty() && m_retainedWeight + weight > m_capacity)
+		{
+			auto victim = FindVictimLocked();
+			m_retainedWeight -= victim->weight;
+			released.push_back(std::move(victim->value));
+			m_index.erase(victim->keyHash);
+			m_lru.erase(victim);
+			++m_evictionCount;
+		}
+	}
+
+	const uint64_t m_capacity;
+	mutable std::mutex m_mutex;
+	detail::FrequencySketch m_sketch;
+	// Most recently used values first
+	LruList m_lru;
+	FlatHashMap<uint64_t, LruList::iterator> m_index;
+	uint64_t m_retainedWeight = 0;
+	uint64_t m_admissionCount = 0;
+	uint64_t m_rejectionCount = 0;
+	uint64_t m_evictionCount = 0;
+	std::atomic<int64_t> m_liveWeight = 0;
+};
+
+// Writes the usage in the Prometheus text exposition format
+inline void WriteCacheBudgetUsage(std::ostream& out, std::string_view budgetName, const CacheBudgetUsage& usage)
+{
+	auto writeValue = [&](std::string_view name, std::string_view type, uint64_t value) {
+		out << "# TYPE " << name << ' ' << type << '\n';
+		out << name << "{budget=\"" << budgetName << "\"} " << value << '\n';
+	};
+	writeValue("cache_budget_capacity_bytes", "gauge", usage.capacity);
+	writeValue("cache_budget_retained_bytes", "gauge", usage.retainedWeight);
+	writeValue("cache_budget_retained_values", "gauge", usage.retainedCount);
+	writeValue("cache_budget_live_bytes", "gauge", usage.liveWeight);
+	writeValue("cache_budget_admissions_total", "counter", usage.admissions);
+	writeValue("cache_budget_rejections_total", "counter", usage.rejections);
+	writeValue("cache_budget_evictions_total", "counter", usage.evictions);
+}
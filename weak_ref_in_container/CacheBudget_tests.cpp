@@ -0,0 +1,202 @@
+#include "pch.h"
+#include "CacheBudget.h"
+#include "CacheT.h"
+
+using namespace std;
+
+namespace
+{
+
+using BlobCache = CacheT<int, string>;
+
+// Values of key k weigh k bytes
+shared_ptr<BlobCache> MakeBlobCache(const shared_ptr<CacheBudget>& budget)
+{
+	auto cache = make_shared<BlobCache>([](const int& key, auto&& cleaner) {
+		return shared_ptr<string>(new string(size_t(key), 'x'),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	});
+	cache->SetBudget(budget, [](const int&, const string& value) {
+		return uint64_t(value.size());
+	});
+	return cache;
+}
+
+} // namespace
+
+SCENARIO("Cache budget")
+{
+	auto budget = make_shared<CacheBudget>(100);
+	auto cache = MakeBlobCache(budget);
+
+	WHEN("values fit the budget")
+	{
+		weak_ptr<string> weakValue = cache->GetValue(10);
+		cache->GetValue(20);
+		THEN("they are kept alive without holders")
+		{
+			CHECK(!weakValue.expired());
+			CHECK(cache->GetSize() == 2);
+			auto usage = budget->GetUsage();
+			CHECK(usage.retainedWeight == 30);
+			CHECK(usage.retainedCount == 2);
+			CHECK(usage.liveWeight == 30);
+			CHECK(usage.admissions == 2);
+			CHECK(cache->GetMetrics().misses == 2);
+			cache->GetValue(10);
+			CHECK(cache->GetMetrics().hits == 1);
+		}
+	}
+
+	WHEN("a value is heavier than the budget")
+	{
+		weak_ptr<string> weakValue = cache->GetValue(101);
+		THEN("it is not retained")
+		{
+			CHECK(weakValue.expired());
+			CHECK(budget->GetUsage().rejections == 1);
+			CHECK(budget->GetUsage().liveWeight == 0);
+		}
+	}
+
+	WHEN("the budget is full of popular values")
+	{
+		for (int i = 0; i < 3; ++i)
+		{
+			cache->GetValue(30);
+			cache->GetValue(31);
+			cache->GetValue(32);
+		}
+		THEN("a value of a rarely requested key is rejected")
+		{
+			weak_ptr<string> weakValue = cache->GetValue(8);
+			CHECK(weakValue.expired());
+			CHECK(budget->GetUsage().rejections == 1);
+			CHECK(budget->GetUsage().retainedWeight == 93);
+		}
+		THEN("a value of a key requested more often than the victim's evicts it")
+		{
+			for (int i = 0; i < 4; ++i)
+			{
+				cache->GetValue(8);
+			}
+			auto usage = budget->GetUsage();
+			CHECK(usage.evictions == 1);
+			CHECK(usage.retainedCount == 3);
+			// The heaviest value goes
+			CHECK(usage.retainedWeight == 30 + 31 + 8);
+		}
+	}
+
+	WHEN("the budget evicts cold values")
+	{
+		cache->GetValue(50);
+		for (int key = 10; key < 15; ++key)
+		{
+			cache->GetValue(key);
+		}
+		// The budget is full: 50 + 10 + 11 + 12 + 13 + 14 = 110 doesn't fit, so 14 is rejected
+		CHECK(budget->GetUsage().retainedWeight == 96);
+		cache->GetValue(5);
+		cache->GetValue(5);
+		THEN("the heaviest of the least recently used values goes first")
+		{
+			CHECK(cache->GetSize() == 5);
+			auto usage = budget->GetUsage();
+			CHECK(usage.evictions == 1);
+			CHECK(usage.retainedWeight == 96 - 50 + 5);
+		}
+	}
+
+	WHEN("caches share the budget")
+	{
+		auto otherCache = MakeBlobCache(budget);
+		cache->GetValue(40);
+		otherCache->GetValue(40);
+		THEN("their values are accounted together")
+		{
+			auto usage = budget->GetUsage();
+			CHECK(usage.retainedCount == 2);
+			CHECK(usage.liveWeight == 80);
+			otherCache.reset();
+			CHECK(budget->GetUsage().liveWeight == 40);
+		}
+	}
+
+	WHEN("a cache is destroyed")
+	{
+		weak_ptr<string> weakValue = cache->GetValue(10);
+		cache.reset();
+		THEN("the budget doesn't keep its values")
+		{
+			CHECK(weakValue.expired());
+			auto usage = budget->GetUsage();
+			CHECK(usage.retainedCount == 0);
+			CHECK(usage.retainedWeight == 0);
+			CHECK(usage.liveWeight == 0);
+		}
+	}
+
+	WHEN("values of the cache expire")
+	{
+		using namespace std::chrono_literals;
+		auto now = BlobCache::TimePoint();
+		BlobCache::ExpiryPolicy policy;
+		policy.timeToLive = 10ms;
+		policy.now = [&now] { return now; };
+		cache->SetExpiryPolicy(policy);
+		weak_ptr<string> weakValue = cache->GetValue(10);
+		cache->GetValue(20);
+		now += 10ms;
+		cache->Sweep();
+		THEN("the budget doesn't keep them")
+		{
+			CHECK(weakValue.expired());
+			CHECK(cache->GetSize() == 0);
+			auto usage = budget->GetUsage();
+			CHECK(usage.retainedCount == 0);
+			CHECK(usage.retainedWeight == 0);
+			CHECK(usage.liveWeight == 0);
+		}
+	}
+
+	WHEN("the usage is exported")
+	{
+		cache->GetValue(10);
+		ostringstream out;
+		WriteCacheBudgetUsage(out, "blobs", budget->GetUsage());
+		THEN("it is written in the Prometheus format")
+		{
+			CHECK(out.str().find("cache_budget_retained_bytes{budget=\"blobs\"} 10\n") != string::npos);
+			CHECK(out.str().find("# TYPE cache_budget_evictions_total counter\n") != string::npos);
+		}
+	}
+}
+
+TEST_CASE("Cache budget is shared by many threads")
+{
+	auto budget = make_shared<CacheBudget>(1000);
+	vector<shared_ptr<BlobCache>> caches{ MakeBlobCache(budget), MakeBlobCache(budget) };
+	vector<thread> threads;
+	for (int t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([&caches, t] {
+			for (int i = 0; i < 2000; ++i)
+			{
+				caches[size_t(t) % 2]->GetValues({ 1 + i % 97, 1 + (i * 7) % 113 });
+			}
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	auto usage = budget->GetUsage();
+	CHECK(usage.retainedWeight <= 1000);
+	CHECK(usage.liveWeight == usage.retainedWeight);
+	caches.clear();
+	CHECK(budget->GetUsage().liveWeight == 0);
+}
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <ostream>
+#include <string_view>
+
+// Caches collect metrics unless CACHE_METRICS_DISABLED is defined. In that case metrics calls
+// compile to nothing, and snapshots contain only the number of entries.
+// The macro must be defined in the same way for the whole program.
+
+// The number of factory latency histogram buckets. Bucket 0 counts calls shorter than 1us,
+// bucket i counts calls of [2^(i-1), 2^i) us, the last bucket counts all the longer calls
+constexpr size_t CACHE_LATENCY_BUCKET_COUNT = 24;
+
+struct CacheMetricsSnapshot
+{
+	uint64_t hits = 0;
+	uint64_t misses = 0;
+	// Items erased because their values have been destroyed
+	uint64_t expirations = 0;
+	// Items stored in the cache. It includes the items of destroyed values which are not swept yet
+	uint64_t entries = 0;
+	std::array<uint64_t, CACHE_LATENCY_BUCKET_COUNT> factoryLatency{};
+	std::chrono::nanoseconds factoryTime{};
+};
+
+namespace detail
+{
+
+#ifndef CACHE_METRICS_DISABLED
+
+// Counts the cache events in several slots, so that threads updating the counters
+// at the same time rarely share a cache line
+class CacheMetricsRecorder
+{
+public:
+	using Clock = std::chrono::steady_clock;
+	using TimePoint = Clock::time_point;
+
+	void RecordHit() noexcept
+	{
+		GetSlot().hits.fetch_add(1, std::memory_order_relaxed);
+	}
+
+	TimePoint StartFactoryCall() const noexcept
+	{
+		return Clock::now();
+	}
+
+	void RecordMiss(TimePoint factoryCallStart) noexcept
+	{
+		auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - factoryCallStart);
+		auto& slot = GetSlot();
+		slot.misses.fetch_add(1, std::memory_order_relaxed);
+		slot.factoryLatency[GetLatencyBucket(duration)].fetch_add(1, std::memory_order_relaxed);
+		slot.factoryTimeNs.fetch_add(static_cast<uint64_t>(duration.count()), std::memory_order_relaxed);
+	}
+
+	void RecordExpirations(size_t count) noexcept
+	{
+		GetSlot().expirations.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	CacheMetricsSnapshot GetSnapshot() const noexcept
+	{
+		CacheMetricsSnapshot snapshot;
+		for (auto& slot : m_slots)
+		{
+			snapshot.hits += slot.hits.load(std::memory_order_relaxed);
+			snapshot.misses += slot.misses.load(std::memory_order_relaxed);
+			snapshot.expirations += slot.expirations.load(std::memory_order_relaxed);
+			for (size_t i = 0; i < CACHE_LATENCY_BUCKET_COUNT; ++i)
+			{
+				snapshot.factoryLatency[i] += slot.factoryLatency[i].load(std::memory_order_relaxed);
+			}
+			snapshot.factoryTime += std::chrono::nanoseconds(slot.factoryTimeNs.load(std::memory_order_relaxed));
+		}
+		return snapshot;
+	}
+
+	static size_t GetLatencyBucket(std::chrono::nanoseconds duration) noexcept
+	{
+		auto us = static_cast<uint64_t>(duration.count()) / 1000;
+		size_t bucket = 0;
+		while (us && bucket + 1 < CACHE_LATENCY_BUCKET_COUNT)
+		{
+			us >>= 1;
+			++bucket;
+		}
+		return bucket;
+	}
+
+private:
+	static constexpr size_t SLOT_COUNT = 16;
+
+	struct alignas(64) Slot
+	{
+		std::atomic<uint64_t> hits{ 0 };
+		std::atomic<uint64_t> misses{ 0 };
+		std::atomic<uint64_t> expirations{ 0 };
+		std::atomic<uint64_t> factoryTimeNs{ 0 };
+		std::array<std::atomic<uint64_t>, CACHE_LATENCY_BUCKET_COUNT> factoryLatency{};
+	};
+
+	Slot& GetSlot() noexcept
+	{
+		// Threads get slots in a round robin manner
+		static std::atomic<size_t> nextSlot{ 0 };
+		thread_local const size_t slotIndex = nextSlot.fetch_add(1, std::memory_order_relaxed) % SLOT_COUNT;
+		return m_slots[slotIndex];
+	}
+
+	std::array<Slot, SLOT_COUNT> m_slots;
+};
+
+#else
+
+class CacheMetricsRecorder
+{
+public:
+	struct TimePoint
+	{
+	};
+
+	void RecordHit() noexcept
+	{
+	}
+
+	TimePoint StartFactoryCall() const noexcept
+	{
+		return {};
+	}
+
+	void RecordMiss(TimePoint) noexcept
+	{
+	}
+
+	void RecordExpirations(size_t) noexcept
+	{
+	}
+
+	CacheMetricsSnapshot GetSnapshot() const noexcept
+	{
+		return {};
+	}
+};
+
+#endif
+
+} // namespace detail
+
+// Writes the metrics in the Prometheus text exposition format
+inline void WriteCacheMetrics(std::ostream& out, std::string_view cacheName, const CacheMetricsSnapshot& metrics)
+{
+	auto writeValue = [&](std::string_view name, uint64_t value) {
+		out << name << "{cache=\"" << cacheName << "\"} " << value << '\n';
+	};
+	out << "# TYPE cache_hits_total counter\n";
+	writeValue("cache_hits_total", metrics.hits);
+	out << "# TYPE cache_misses_total counter\n";
+	writeValue("cache_misses_total", metrics.misses);
+	out << "# TYPE cache_expirations_total counter\n";
+	writeValue("cache_expirations_total", metrics.expirations);
+	out << "# TYPE cache_entries gauge\n";
+	writeValue("cache_entries", metrics.entries);
+
+	out << "# TYPE cache_factory_latency_seconds histogram\n";
+	uint64_t count = 0;
+	for (size_t i = 0; i < CACHE_LATENCY_BUCKET_COUNT; ++i)
+	{
+		count += metrics.factoryLatency[i];
+		out << "cache_factory_latency_seconds_bucket{cache=\"" << cacheName << "\",le=\"";
+		if (i + 1 < CACHE_LATENCY_BUCKET_COUNT)
+		{
+			out << double(uint64_t(1) << i) / 1e6;
+		}
+		else
+		{
+			out << "+Inf";
+		}
+		out << "\"} " << count << '\n';
+	}
+	out << "cache_factory_latency_seconds_sum{cache=\"" << cacheName << "\"} "
+		<< std::chrono::duration<double>(metrics.factoryTime).count() << '\n';
+	writeValue("cache_factory_latency_seconds_count", count);
+}
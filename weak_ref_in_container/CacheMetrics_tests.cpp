@@ -0,0 +1,109 @@
+#include "pch.h"
+#include "Cache.h"
+#include "CacheMetrics.h"
+
+using namespace std;
+
+#ifndef CACHE_METRICS_DISABLED
+
+SCENARIO("Cache metrics")
+{
+	GIVEN("a data cache")
+	{
+		auto cache = make_shared<DataCache>();
+		auto ds1 = make_shared<DataSource>();
+		auto ds2 = make_shared<DataSource>();
+
+		WHEN("values are requested")
+		{
+			auto d1 = cache->GetValue(ds1);
+			auto d1_1 = cache->GetValue(ds1);
+			auto d2 = cache->GetValue(ds2);
+			THEN("hits and misses are counted")
+			{
+				auto metrics = cache->GetMetrics();
+				CHECK(metrics.hits == 1);
+				CHECK(metrics.misses == 2);
+				CHECK(metrics.expirations == 0);
+				CHECK(metrics.entries == 2);
+				CHECK(accumulate(metrics.factoryLatency.begin(), metrics.factoryLatency.end(), uint64_t(0)) == 2);
+			}
+			AND_WHEN("a value is destroyed")
+			{
+				d2.reset();
+				THEN("its expiration is counted")
+				{
+					auto metrics = cache->GetMetrics();
+					CHECK(metrics.expirations == 1);
+					CHECK(metrics.entries == 1);
+				}
+			}
+		}
+	}
+
+	GIVEN("a cache with deferred eviction")
+	{
+		auto cache = make_shared<Cache>(EvictionMode::Deferred);
+		auto obj = cache->GetObjectById("obj"s);
+		obj.reset();
+		THEN("expirations are counted when items are swept")
+		{
+			CHECK(cache->GetMetrics().expirations == 0);
+			cache->Sweep();
+			CHECK(cache->GetMetrics().expirations == 1);
+		}
+	}
+}
+
+TEST_CASE("Cache metrics are collected from many threads")
+{
+	detail::CacheMetricsRecorder recorder;
+	vector<thread> threads;
+	for (int i = 0; i < 8; ++i)
+	{
+		threads.emplace_back([&recorder] {
+			for (int j = 0; j < 10000; ++j)
+			{
+				recorder.RecordHit();
+			}
+			recorder.RecordMiss(recorder.StartFactoryCall());
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	auto metrics = recorder.GetSnapshot();
+	CHECK(metrics.hits == 80000);
+	CHECK(metrics.misses == 8);
+}
+
+TEST_CASE("Factory latency buckets")
+{
+	using detail::CacheMetricsRecorder;
+	CHECK(CacheMetricsRecorder::GetLatencyBucket(999ns) == 0);
+	CHECK(CacheMetricsRecorder::GetLatencyBucket(1us) == 1);
+	CHECK(CacheMetricsRecorder::GetLatencyBucket(3us) == 2);
+	CHECK(CacheMetricsRecorder::GetLatencyBucket(1000s) == CACHE_LATENCY_BUCKET_COUNT - 1);
+}
+
+#endif
+
+TEST_CASE("Cache metrics text export")
+{
+	CacheMetricsSnapshot metrics;
+	metrics.hits = 3;
+	metrics.misses = 2;
+	metrics.entries = 1;
+	metrics.factoryLatency[0] = 1;
+	metrics.factoryLatency[2] = 1;
+
+	ostringstream out;
+	WriteCacheMetrics(out, "data", metrics);
+	auto text = out.str();
+	CHECK(text.find("cache_hits_total{cache=\"data\"} 3\n") != string::npos);
+	CHECK(text.find("cache_misses_total{cache=\"data\"} 2\n") != string::npos);
+	CHECK(text.find("cache_entries{cache=\"data\"} 1\n") != string::npos);
+	CHECK(text.find("cache_factory_latency_seconds_bucket{cache=\"data\",le=\"+Inf\"} 2\n") != string::npos);
+	CHECK(text.find("cache_factory_latency_seconds_count{cache=\"data\"} 2\n") != string::npos);
+}
@@ -0,0 +1,381 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// Converts keys and values of cache snapshots to bytes and back. Specialize it for other types,
+// or pass codecs of the same shape to the snapshot functions of the cache.
+// Numbers are stored in the native byte order, so snapshots are not portable between platforms
+template <typename T, typename = void>
+struct SnapshotCodec;
+
+template <typename T>
+struct SnapshotCodec<T, std::enable_if_t<std::is_arithmetic_v<T> || std::is_enum_v<T>>>
+{
+	static void Encode(const T& value, std::string& out)
+	{
+		out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+	}
+
+	static T Decode(std::string_view bytes)
+	{
+		if (bytes.size() != sizeof(T))
+		{
+			throw std::runtime_error("cache snapshot has a number of a wrong size");
+		}
+		T value;
+		std::memcpy(&value, bytes.data(), sizeof(T));
+		return value;
+	}
+};
+
+template <>
+struct SnapshotCodec<std::string>
+{
+	static void Encode(const std::string& value, std::string& out)
+	{
+		out += value;
+	}
+
+	static std::string Decode(std::string_view bytes)
+	{
+		return std::string(bytes);
+	}
+};
+
+namespace detail
+{
+
+// A read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	explicit MappedFile(const std::string& path)
+	{
+#ifdef _WIN32
+		m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, nullptr);
+		LARGE_INTEGER size;
+		if (m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx(m_file, &size))
+		{
+			Close();
+			throw std::runtime_error("can't open " + path);
+		}
+		m_size = static_cast<size_t>(size.QuadPart);
+		if (m_size != 0)
+		{
+			m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			m_data = m_mapping ? static_cast<const char*>(MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0)) : nullptr;
+		}
+#else
+		m_file = open(path.c_str(), O_RDONLY);
+		struct stat status;
+		if (m_file == -1 || fstat(m_file, &status) != 0)
+		{
+			Close();
+			throw std::runtime_error("can't open " + path);
+		}
+		m_size = static_cast<size_t>(status.st_size);
+		if (m_size != 0)
+		{
+			void* data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, m_file, 0);
+			m_data = data != MAP_FAILED ? static_cast<const char*>(data) : nullptr;
+		}
+#endif
+		if (m_size != 0 && !m_data)
+		{
+			Close();
+			throw std::runtime_error("can't map " + path);
+		}
+	}
+
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	~MappedFile()
+	{
+		Close();
+	}
+
+	std::string_view GetData() const noexcept
+	{
+		return { m_data, m_size };
+	}
+
+private:
+	void Close() noexcept
+	{
+#ifdef _WIN32
+		if (m_data)
+		{
+			UnmapViewOfFile(m_data);
+		}
+		if (m_mapping)
+		{
+			CloseHandle(m_mapping);
+		}
+		if (m_file != INVALID_HANDLE_VALUE)
+		{
+			CloseHandle(m_file);
+		}
+#else
+		if (m_data)
+		{
+			munmap(const_cast<char*>(m_data), m_size);
+		}
+		if (m_file != -1)
+		{
+			close(m_file);
+		}
+#endif
+	}
+
+	const char* m_data = nullptr;
+	size_t m_size = 0;
+#ifdef _WIN32
+	HANDLE m_file = INVALID_HANDLE_VALUE;
+	HANDLE m_mapping = nullptr;
+#else
+	int m_file = -1;
+#endif
+};
+
+// A snapshot file consists of a header, records of the encoded keys and values, and a hash index
+// of the records, which lets a key be found without reading the other records.
+// Everything is 8 byte aligned
+struct SnapshotHeader
+{
+	char magic[4];
+	uint32_t version;
+	uint64_t recordCount;
+	uint64_t indexOffset;
+	// A power of two
+	uint64_t indexCapacity;
+};
+
+struct SnapshotIndexEntry
+{
+	uint64_t hash;
+	// Zero marks an empty entry, since the header is at zero
+	uint64_t recordOffset;
+};
+
+struct SnapshotRecordHeader
+{
+	uint32_t keySize;
+	uint32_t valueSize;
+};
+
+constexpr char SNAPSHOT_MAGIC[4] = { 'C', 'S', 'N', 'P' };
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+
+// FNV-1a, which unlike std::hash is the same in every build
+inline uint64_t HashSnapshotKey(std::string_view key) noexcept
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (char c : key)
+	{
+		hash = (hash ^ static_cast<unsigned char>(c)) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+inline size_t AlignSnapshotOffset(size_t offset) noexcept
+{
+	return (offset + 7) & ~size_t(7);
+}
+
+// Collects encoded records and writes them to a snapshot file
+class SnapshotWriter
+{
+public:
+	SnapshotWriter()
+		: m_data(sizeof(SnapshotHeader), '\0')
+	{
+	}
+
+	// Keys must be distinct
+	void Add(std::string_view key, std::string_view value)
+	{
+		if (key.size() > UINT32_MAX || value.size() > UINT32_MAX)
+		{
+			throw std::length_error("cache snapshot records are limited to 4GB");
+		}
+		const SnapshotRecordHeader header{ static_cast<uint32_t>(key.size()), static_cast<uint32_t>(value.size()) };
+		m_index.push_back({ HashSnapshotKey(key), m_data.size() });
+		m_data.append(reinterpret_cast<const char*>(&header), sizeof(header));
+		m_data += key;
+		m_data += value;
+		m_data.resize(AlignSnapshotOffset(m_data.size()));
+	}
+
+	// Writes a temporary file first, so that a failure doesn't leave a truncated snapshot behind
+	void Write(const std::string& path)
+	{
+		uint64_t capacity = 16;
+		while (capacity < m_index.size() * 2)
+		{
+			capacity *= 2;
+		}
+		std::vector<SnapshotIndexEntry> index(capacity, SnapshotIndexEntry{ 0, 0 });
+		for (auto& entry : m_index)
+		{
+			size_t i = entry.hash & (capacity - 1);
+			while (index[i].recordOffset != 0)
+			{
+				i = (i + 1) & (capacity - 1);
+			}
+			index[i] = entry;
+		}
+
+		SnapshotHeader header{};
+		std::memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+		header.version = SNAPSHOT_VERSION;
+		header.recordCount = m_index.size();
+		header.indexOffset = m_data.size();
+		header.indexCapacity = capacity;
+		std::memcpy(m_data.data(), &header, sizeof(header));
+
+		const std::string tempPath = path + ".tmp";
+		{
+			std::ofstream out(tempPath, std::ios::binary | std::ios::trunc);
+			out.write(m_data.data(), static_cast<std::streamsize>(m_data.size()));
+			out.write(reinterpret_cast<const char*>(index.data()),
+				static_cast<std::streamsize>(index.size() * sizeof(SnapshotIndexEntry)));
+			out.close();
+			if (!out)
+			{
+				std::error_code error;
+				std::filesystem::remove(tempPath, error);
+				throw std::runtime_error("can't write " + tempPath);
+			}
+		}
+		std::filesystem::rename(tempPath, path);
+	}
+
+private:
+	std::string m_data;
+	std::vector<SnapshotIndexEntry> m_index;
+};
+
+// Looks records of a mapped snapshot file up. Every record may be taken once
+class SnapshotReader
+{
+public:
+	explicit SnapshotReader(const std::string& path)
+		: m_file(path)
+	{
+		const auto data = m_file.GetData();
+		SnapshotHeader header;
+		if (data.size() < sizeof(header))
+		{
+			throw std::runtime_error("cache snapshot is truncated");
+		}
+		std::memcpy(&header, data.data(), sizeof(header));
+		if (std::memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 || header.version != SNAPSHOT_VERSION)
+		{
+			throw std::runtime_error("not a cache snapshot of a supported version");
+		}
+		if (header.indexCapacity == 0 || (header.indexCapacity & (header.indexCapacity - 1)) != 0
+			|| header.indexCapacity < header.recordCount
+			|| header.indexOffset > data.size()
+			|| (data.size() - header.indexOffset) / sizeof(SnapshotIndexEntry) < header.indexCapacity)
+		{
+			throw std::runtime_error("cache snapshot has a corrupt index");
+		}
+		m_index = data.data() + header.indexOffset;
+		m_indexCapacity = static_cast<size_t>(header.indexCapacity);
+		m_recordCount = static_cast<size_t>(header.recordCount);
+		m_recordsEnd = static_cast<size_t>(header.indexOffset);
+		m_taken = std::make_unique<std::atomic<bool>[]>(m_indexCapacity);
+	}
+
+	size_t GetRecordCount() const noexcept
+	{
+		return m_recordCount;
+	}
+
+	// Returns the encoded value of the encoded key, unless the key is not in the snapshot
+	// or its value has been taken already. The bytes live as long as the reader
+	std::optional<std::string_view> Take(std::string_view key)
+	{
+		const uint64_t hash = HashSnapshotKey(key);
+		size_t i = hash & (m_indexCapacity - 1);
+		for (size_t probeCount = 0; probeCount < m_indexCapacity; ++probeCount, i = (i + 1) & (m_indexCapacity - 1))
+		{
+			SnapshotIndexEntry entry;
+			std::memcpy(&entry, m_index + i * sizeof(entry), sizeof(entry));
+			if (entry.recordOffset == 0)
+			{
+				return std::nullopt;
+			}
+			if (entry.hash != hash)
+			{
+				continue;
+			}
+			auto [recordKey, value] = GetRecord(entry.recordOffset);
+			if (recordKey == key)
+			{
+				if (m_taken[i].exchange(true))
+				{
+					return std::nullopt;
+				}
+				return value;
+			}
+		}
+		return std::nullopt;
+	}
+
+private:
+	std::pair<std::string_view, std::string_view> GetRecord(uint64_t offset) const
+	{
+		const auto data = m_file.GetData();
+		SnapshotRecordHeader header;
+		if (offset < sizeof(SnapshotHeader) || offset > m_recordsEnd || m_recordsEnd - offset < sizeof(header))
+		{
+			throw std::runtime_error("cache snapshot has a corrupt record");
+		}
+		std::memcpy(&header, data.data() + offset, sizeof(header));
+		const uint64_t keyOffset = offset + sizeof(header);
+		if (m_recordsEnd - keyOffset < uint64_t(header.keySize) + header.valueSize)
+		{
+			throw std::runtime_error("cache snapshot has a corrupt record");
+		}
+		return { data.substr(static_cast<size_t>(keyOffset), header.keySize),
+			data.substr(static_cast<size_t>(keyOffset + header.keySize), header.valueSize) };
+	}
+
+	MappedFile m_file;
+	const char* m_index = nullptr;
+	size_t m_indexCapacity = 0;
+	size_t m_recordCount = 0;
+	size_t m_recordsEnd = 0;
+	std::unique_ptr<std::atomic<bool>[]> m_taken;
+};
+
+} // namespace detail
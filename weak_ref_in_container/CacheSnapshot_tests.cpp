@@ -0,0 +1,184 @@
+#include "pch.h"
+#include "CacheSnapshot.h"
+#include "CacheT.h"
+#include <filesystem>
+#include <fstream>
+
+using namespace std;
+
+namespace
+{
+
+struct Point
+{
+	int x;
+	int y;
+};
+
+struct PointCodec
+{
+	static void Encode(const Point& point, string& out)
+	{
+		out += to_string(point.x) + "," + to_string(point.y);
+	}
+
+	static Point Decode(string_view bytes)
+	{
+		auto comma = bytes.find(',');
+		return { stoi(string(bytes.substr(0, comma))), stoi(string(bytes.substr(comma + 1))) };
+	}
+};
+
+using PointCache = CacheT<int, Point>;
+
+shared_ptr<PointCache> MakePointCache(vector<int>& createdKeys)
+{
+	auto makeValue = [&createdKeys](int key, function<void()> cleaner) {
+		createdKeys.push_back(key);
+		return shared_ptr<Point>(new Point{ key, key * key },
+			[cleaner = std::move(cleaner)](Point* point) {
+				cleaner();
+				delete point;
+			});
+	};
+	return make_shared<PointCache>(
+		[makeValue](const int& key, auto&& cleaner) {
+			return makeValue(key, std::move(cleaner));
+		},
+		[makeValue](const vector<int>& keys, vector<function<void()>> cleaners) {
+			vector<shared_ptr<Point>> values;
+			for (size_t i = 0; i < keys.size(); ++i)
+			{
+				values.push_back(makeValue(keys[i], std::move(cleaners[i])));
+			}
+			return values;
+		});
+}
+
+string GetSnapshotPath()
+{
+	return (filesystem::temp_directory_path() / "weak_ref_in_container_snapshot.bin").string();
+}
+
+} // namespace
+
+SCENARIO("Cache snapshots")
+{
+	const auto path = GetSnapshotPath();
+	vector<int> createdKeys;
+	auto cache = MakePointCache(createdKeys);
+	vector<shared_ptr<Point>> values;
+	for (int key = 0; key < 100; ++key)
+	{
+		values.push_back(cache->GetValue(key));
+	}
+	// Destroyed values are not saved
+	values[7].reset();
+	cache->SaveSnapshot<SnapshotCodec<int>, PointCodec>(path);
+
+	GIVEN("a cache restored from the snapshot")
+	{
+		createdKeys.clear();
+		auto restoredCache = MakePointCache(createdKeys);
+		restoredCache->LoadSnapshot<SnapshotCodec<int>, PointCodec>(path);
+
+		THEN("values are restored instead of being created")
+		{
+			auto value = restoredCache->GetValue(42);
+			CHECK(value->x == 42);
+			CHECK(value->y == 42 * 42);
+			CHECK(value != values[42]);
+			CHECK(restoredCache->GetValue(42) == value);
+			CHECK(createdKeys.empty());
+		}
+		THEN("keys which are not in the snapshot are created")
+		{
+			CHECK(restoredCache->GetValue(7)->y == 49);
+			CHECK(restoredCache->GetValue(100)->y == 10000);
+			CHECK(createdKeys == vector<int>{ 7, 100 });
+		}
+		THEN("a value is restored only once")
+		{
+			restoredCache->GetValue(42);
+			CHECK(restoredCache->GetSize() == 0);
+			CHECK(restoredCache->GetValue(42)->y == 42 * 42);
+			CHECK(createdKeys == vector<int>{ 42 });
+		}
+		THEN("the batch factory gets only the keys which are not in the snapshot")
+		{
+			auto batch = restoredCache->GetValues({ 1, 7, 2, 200 });
+			CHECK(batch[0]->y == 1);
+			CHECK(batch[1]->y == 49);
+			CHECK(batch[2]->y == 4);
+			CHECK(batch[3]->y == 40000);
+			CHECK(createdKeys == vector<int>{ 7, 200 });
+		}
+		THEN("restoring a used cache is an error")
+		{
+			auto value = restoredCache->GetValue(1);
+			CHECK_THROWS_AS((restoredCache->LoadSnapshot<SnapshotCodec<int>, PointCodec>(path)), logic_error);
+		}
+	}
+
+	GIVEN("a string cache")
+	{
+		auto stringCache = make_shared<CacheT<string, string>>([](const string& key, auto&&) {
+			return make_shared<string>(key + key);
+		});
+		auto value = stringCache->GetValue("abc");
+		stringCache->SaveSnapshot(path);
+		THEN("the default codecs are used")
+		{
+			auto restoredCache = make_shared<CacheT<string, string>>([](const string&, auto&&) {
+				return make_shared<string>();
+			});
+			restoredCache->LoadSnapshot(path);
+			CHECK(*restoredCache->GetValue("abc") == "abcabc");
+			CHECK(restoredCache->GetValue("xyz")->empty());
+		}
+	}
+
+	filesystem::remove(path);
+}
+
+TEST_CASE("Invalid cache snapshots are rejected")
+{
+	const auto path = GetSnapshotPath();
+	auto cache = make_shared<CacheT<int, int>>([](const int& key, auto&&) {
+		return make_shared<int>(key);
+	});
+	CHECK_THROWS_AS(cache->LoadSnapshot(path + ".missing"), runtime_error);
+
+	ofstream(path, ios::binary) << "not a snapshot, but long enough to have a header";
+	CHECK_THROWS_AS(cache->LoadSnapshot(path), runtime_error);
+
+	ofstream(path, ios::binary | ios::trunc);
+	CHECK_THROWS_AS(cache->LoadSnapshot(path), runtime_error);
+
+	filesystem::remove(path);
+}
+
+TEST_CASE("Snapshot records are found by their keys")
+{
+	const auto path = GetSnapshotPath();
+	detail::SnapshotWriter writer;
+	for (int i = 0; i < 1000; ++i)
+	{
+		writer.Add("key" + to_string(i), string(size_t(i % 13), 'v'));
+	}
+	writer.Write(path);
+
+	{
+		detail::SnapshotReader reader(path);
+		CHECK(reader.GetRecordCount() == 1000);
+		for (int i = 0; i < 1000; ++i)
+		{
+			auto value = reader.Take("key" + to_string(i));
+			REQUIRE(value);
+			CHECK(*value == string(size_t(i % 13), 'v'));
+		}
+		CHECK(!reader.Take("key1"));
+		CHECK(!reader.Take("key1000"));
+	}
+	filesystem::remove(path);
+}
@@ -0,0 +1,1512 @@
+#pragma once
+
+#include "CacheBudget.h"
+#include "CacheMetrics.h"
+#include "CacheSnapshot.h"
+#include "ExpiredKeyList.h"
+#include "MapStorage.h"
+#include "TimerWheel.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Defines when the item of a cached value is erased after the value is destroyed
+enum class EvictionMode
+{
+	// The cleaner of the value erases the item right away
+	Immediate,
+	// The cleaner only queues the key of the item. Queued items are erased in a batch
+	// by the next GetValue or Sweep call. The cleaner doesn't touch the cache itself,
+	// so values may be released by any thread
+	Deferred,
+};
+
+struct CacheShrinkResult
+{
+	// Items erased because their values had been destroyed or had expired. The weak_ptr of an item keeps
+	// the control block of its value allocated, and the value itself if it was made by make_shared
+	size_t erasedCount = 0;
+	// The memory the tables of the cache have freed
+	size_t reclaimedBytes = 0;
+};
+
+// What a lookup of a key has found out
+enum class CacheValueStatus
+{
+	Present,
+	// The factory has returned null
+	Absent,
+	// The factory has thrown
+	Failed,
+};
+
+// The cache may be used by several threads. Factories are called without the lock held,
+// so they may use the cache themselves. If two threads miss the same key at once, both call
+// the factory and the value which gets into the cache first wins. GetValueAsync requests
+// of a key share a single factory call instead.
+//
+// Values may also expire by time, see ExpiryPolicy. The cache forgets an expired value
+// and creates a fresh one on the next request, while holders of the old value keep it.
+//
+// An optional thread-local front cache serves repeated GetValue calls without the lock,
+// see EnableFrontCache. An optional CacheBudget keeps popular values alive while nobody
+// holds them, see SetBudget. Keys whose factory calls fail or return null may be remembered
+// for a while, see NegativeCachingPolicy
+template <typename Key, typename Val, typename Hasher = std::hash<Key>, typename KeyEq = std::equal_to<Key>,
+	typename Storage = NodeMapStorage>
+class CacheT : public std::enable_shared_from_this<CacheT<Key, Val, Hasher, KeyEq, Storage>>
+{
+public:
+	using MyType = CacheT<Key, Val, Hasher, KeyEq, Storage>;
+	using ValuePtr = std::shared_ptr<Val>;
+	using ValueWeakPtr = std::weak_ptr<Val>;
+	using CacheCleaner = std::function<void()>;
+	using ValueFactory = std::function<ValuePtr(const Key& key, CacheCleaner d)>;
+	// Creates values of several keys at once. Must return a value per key, in the order of keys
+	using BatchValueFactory = std::function<std::vector<ValuePtr>(
+		const std::vector<Key>& keys, std::vector<CacheCleaner> cleaners)>;
+	using Clock = std::chrono::steady_clock;
+	using TimePoint = Clock::time_point;
+	// Runs a task in the background
+	using Executor = std::function<void(std::function<void()> task)>;
+	// Returns the memory a value costs, in the units of the budget capacity
+	using Weigher = std::function<uint64_t(const Key& key, const Val& value)>;
+
+	// Background compaction waits for at least this many erasures
+	static constexpr size_t MIN_COMPACTION_ERASURE_COUNT = 1024;
+	static constexpr unsigned FRONT_CACHE_BITS = 6;
+	static constexpr size_t FRONT_CACHE_SIZE = size_t(1) << FRONT_CACHE_BITS;
+
+	struct ExpiryPolicy
+	{
+		// The time a value is served for after it has been created. Zero means forever
+		Clock::duration timeToLive{};
+		// Overrides timeToLive per value, if set
+		std::function<Clock::duration(const Key& key, const Val& value)> getTimeToLive;
+		// For this long after its expiry, a value is still served while the executor creates
+		// a fresh one. The fresh value is kept alive until it is requested or expires.
+		// Exceptions of the value factory propagate to the executor
+		Clock::duration staleWhileRevalidate{};
+		Executor executor;
+		// Expired items are erased in ticks of this duration. Each tick costs O(1) regardless of
+		// the number of items, apart from erasing the expired ones
+		Clock::duration tick = std::chrono::milliseconds(10);
+		// Called with the lock held, or without it by the front cache
+		std::function<TimePoint()> now = Clock::now;
+	};
+
+	// Lets the cache remember keys whose factory calls have failed or returned null, so that
+	// requests of such keys don't call the factory again for a while. Negative entries hold
+	// the time they expire at and the exception, if any, but no value or weak_ptr
+	struct NegativeCachingPolicy
+	{
+		// How long null is returned for a key the factory has returned null for. Zero means not at all
+		Clock::duration absentTimeToLive{};
+		// How long the exception of a failed factory call is rethrown. Zero means not at all
+		Clock::duration errorTimeToLive{};
+		// Called with the lock held
+		std::function<TimePoint()> now = Clock::now;
+	};
+
+	struct LookupResult
+	{
+		CacheValueStatus status;
+		ValuePtr value;
+		std::exception_ptr error;
+	};
+
+	CacheT(ValueFactory valueFactory, EvictionMode evictionMode = EvictionMode::Immediate)
+		: CacheT(std::move(valueFactory), nullptr, evictionMode)
+	{
+	}
+
+	// The batch factory is used by GetValues and TryGetValues. Without it, they call the value factory per miss
+	CacheT(ValueFactory valueFactory, BatchValueFactory batchValueFactory,
+		EvictionMode evictionMode = EvictionMode::Immediate)
+		: m_valueFactory(std::move(valueFactory))
+		, m_batchValueFactory(std::move(batchValueFactory))
+		, m_id(GenerateCacheId())
+	{
+		if (evictionMode == EvictionMode::Deferred)
+		{
+			m_expiredKeys = std::make_shared<detail::ExpiredKeyList<Key>>();
+		}
+	}
+
+	~CacheT()
+	{
+		if (m_budget)
+		{
+			uint64_t weight = 0;
+			for (auto&& item : m_items)
+			{
+				weight += item.second.weight;
+				// Released right away, since cleaners of values don't lock a cache being destroyed
+				m_budget->Forget(GetBudgetKey(item.first));
+			}
+			m_budget->AddLiveWeight(-static_cast<int64_t>(weight));
+		}
+	}
+
+	// Lets the budget keep values of the cache alive. Every GetValue call counts as an access
+	// of the budget, and created values are offered for retention. The weigher is called
+	// with the lock held. Front cache hits are not counted.
+	// Must be set before any value is requested, and only once
+	void SetBudget(std::shared_ptr<CacheBudget> budget, Weigher weigher)
+	{
+		std::lock_guard lock(m_mutex);
+		if (m_budget || !m_items.empty())
+		{
+			throw std::logic_error("budget must be set once, before the cache is used");
+		}
+		m_budget = std::move(budget);
+		m_weigher = std::move(weigher);
+	}
+
+	// Must be set before any value is requested, and only once
+	void SetExpiryPolicy(ExpiryPolicy policy)
+	{
+		std::lock_guard lock(m_mutex);
+		if (m_expiry || !m_items.empty())
+		{
+			throw std::logic_error("expiry policy must be set once, before the cache is used");
+		}
+		const auto now = policy.now();
+		m_expiry = std::make_unique<Expiry>(Expiry{ std::move(policy), now, TimerWheel<Key>() });
+	}
+
+	// Must be set before any value is requested, and only once
+	void SetNegativeCaching(NegativeCachingPolicy policy)
+	{
+		std::lock_guard lock(m_mutex);
+		if (m_negative || !m_items.empty())
+		{
+			throw std::logic_error("negative caching must be set once, before the cache is used");
+		}
+		m_negative = std::make_unique<Negative>();
+		m_negative->policy = std::move(policy);
+	}
+
+	// Lets the executor run ShrinkToFit whenever the cache has erased as many items as it holds
+	// since the last compaction, and at least MIN_COMPACTION_ERASURE_COUNT. The compaction is
+	// started by the next request, Sweep or Invalidate call, since cleaners must not call the executor.
+	// Must be called before any value is requested, and only once
+	void EnableBackgroundCompaction(Executor executor)
+	{
+		std::lock_guard lock(m_mutex);
+		if (m_compactionExecutor || !m_items.empty())
+		{
+			throw std::logic_error("background compaction must be enabled once, before the cache is used");
+		}
+		m_compactionExecutor = std::move(executor);
+	}
+
+	// Lets every thread keep the values it has got last in a small direct-mapped array of
+	// FRONT_CACHE_SIZE slots. A GetValue call of a key in the thread's array returns the value
+	// without locking the cache or looking its map up. Slots are checked against an epoch of the
+	// cache, which changes whenever an item is erased or replaced, and against the expiry time.
+	//
+	// Like the cache itself, the arrays hold values weakly, so a thread doesn't keep values alive
+	// however long it stays idle. Stale slots are emptied when they are looked up.
+	// Must be called before any value is requested
+	void EnableFrontCache()
+	{
+		std::lock_guard lock(m_mutex);
+		if (!m_items.empty())
+		{
+			throw std::logic_error("front cache must be enabled before the cache is used");
+		}
+		m_isFrontCacheEnabled = true;
+	}
+
+	// Empties the front cache of the calling thread for all caches of this type, releasing
+	// the keys and the control blocks of the values it refers to
+	static void ReleaseFrontCacheValues() noexcept
+	{
+		for (size_t i = 0; i < FRONT_CACHE_SIZE; ++i)
+		{
+			ClearFrontSlot(GetFrontSlots()[i]);
+		}
+	}
+
+	// With negative caching, rethrows the remembered exception of the key's failed factory call
+	ValuePtr GetValue(const Key& key) const
+	{
+		if (auto value = GetCachedValue(key, [] {}))
+		{
+			return *value;
+		}
+		return CreateValue(key);
+	}
+
+	// Tells a value from an absent key and from a failure, without throwing the exceptions
+	// of the factory
+	LookupResult TryGetValue(const Key& key) const
+	{
+		try
+		{
+			auto value = GetValue(key);
+			const auto status = value ? CacheValueStatus::Present : CacheValueStatus::Absent;
+			return { status, std::move(value), nullptr };
+		}
+		catch (...)
+		{
+			return { CacheValueStatus::Failed, nullptr, std::current_exception() };
+		}
+	}
+
+	// Returns a future of the value of the key. A cached value is returned in a ready future
+	// without calling the executor. On a miss, the executor runs the value factory in the
+	// background. Requests of the key made by GetValueAsync while its value is being created
+	// share the future instead of creating their own values, and count as hits.
+	// Exceptions of the factory and the executor are stored in the future. If the cache is
+	// destroyed before the executor runs the task, or the executor destroys the task without
+	// running it, the future gets std::future_error. In the latter case the next request
+	// of the key starts a new load
+	std::shared_future<ValuePtr> GetValueAsync(const Key& key, const Executor& executor) const
+	{
+		std::shared_future<ValuePtr> pendingValue;
+		std::shared_ptr<PendingLoad> load;
+		std::promise<ValuePtr> ready;
+		try
+		{
+			auto value = GetCachedValue(key, [&] {
+				if (auto it = m_pendingValues.find(key); it != m_pendingValues.end())
+				{
+					pendingValue = it->second;
+					return;
+				}
+				auto newLoad = std::make_shared<PendingLoad>(MyType::weak_from_this(), key);
+				pendingValue = newLoad->promise.get_future().share();
+				m_pendingValues.emplace(key, pendingValue);
+				newLoad->isPending = true;
+				load = std::move(newLoad);
+			});
+			if (value)
+			{
+				ready.set_value(std::move(*value));
+				return ready.get_future().share();
+			}
+		}
+		catch (...)
+		{
+			ready.set_exception(std::current_exception());
+			return ready.get_future().share();
+		}
+		if (!load)
+		{
+			m_metrics.RecordHit();
+			return pendingValue;
+		}
+
+		try
+		{
+			executor([load] {
+				if (auto self = load->cache.lock())
+				{
+					self->CompleteLoad(*load);
+				}
+			});
+		}
+		catch (...)
+		{
+			EndLoad(*load);
+			load->promise.set_exception(std::current_exception());
+		}
+		return pendingValue;
+	}
+
+	// Returns the values of count keys, in the order of keys. Rethrows the exception of the first
+	// key which has failed, after the values of the other keys are cached, see TryGetValues
+	std::vector<ValuePtr> GetValues(const Key* keys, size_t count) const
+	{
+		auto results = TryGetValues(keys, count);
+		std::vector<ValuePtr> values;
+		values.reserve(count);
+		for (auto& result : results)
+		{
+			if (result.error)
+			{
+				std::rethrow_exception(result.error);
+			}
+			values.push_back(std::move(result.value));
+		}
+		return values;
+	}
+
+	// Tells values from absent keys and from failures per key, in the order of keys, without
+	// throwing the exceptions of the factories.
+	// The lock is taken twice per batch: to look all keys up and to insert all misses.
+	// Misses are created by a single batch factory call if there is a batch factory. If it throws,
+	// all the misses fail, but negative caching doesn't remember them, since the exception
+	// isn't of a particular key. Without a batch factory, keys fail one by one
+	std::vector<LookupResult> TryGetValues(const Key* keys, size_t count) const
+	{
+		StartCompactionIfDue();
+		std::vector<LookupResult> results(count);
+		// Distinct missed keys and the positions of their first occurrence in keys
+		std::vector<Key> missedKeys;
+		std::vector<size_t> missPositions;
+		// The miss each position of keys gets its value from, if the position is a miss
+		std::vector<size_t> missIndices(count, SIZE_MAX);
+		std::vector<Key> staleKeys;
+		{
+			Released released;
+			std::lock_guard lock(m_mutex);
+			const auto now = GetNowLocked();
+			SweepLocked(now, released);
+			std::unordered_map<Key, size_t, Hasher, KeyEq> missIndexByKey;
+			LookUpLocked(keys, count, now, staleKeys, [&](size_t pos, ValuePtr value) {
+				if (value)
+				{
+					m_metrics.RecordHit();
+					results[pos] = { CacheValueStatus::Present, std::move(value), nullptr };
+					return;
+				}
+				if (const NegativeEntry* negative = FindNegativeLocked(keys[pos]))
+				{
+					m_metrics.RecordHit();
+					const auto status = negative->error ? CacheValueStatus::Failed : CacheValueStatus::Absent;
+					results[pos] = { status, nullptr, negative->error };
+					return;
+				}
+				auto [it, isNew] = missIndexByKey.try_emplace(keys[pos], missedKeys.size());
+				if (isNew)
+				{
+					missedKeys.push_back(keys[pos]);
+					missPositions.push_back(pos);
+				}
+				missIndices[pos] = it->second;
+			});
+		}
+		if (m_budget)
+		{
+			for (size_t pos = 0; pos < count; ++pos)
+			{
+				if (results[pos].value)
+				{
+					m_budget->RecordAccess(GetBudgetKey(keys[pos]));
+				}
+			}
+		}
+		for (auto& key : staleKeys)
+		{
+			StartRefresh(key);
+		}
+		if (missedKeys.empty())
+		{
+			return results;
+		}
+
+		std::vector<ValuePtr> newValues;
+		std::vector<std::exception_ptr> errors(missedKeys.size());
+		try
+		{
+			newValues = CreateValues(missedKeys, errors);
+		}
+		catch (...)
+		{
+			const auto error = std::current_exception();
+			for (size_t pos = 0; pos < count; ++pos)
+			{
+				if (missIndices[pos] != SIZE_MAX)
+				{
+					results[pos] = { CacheValueStatus::Failed, nullptr, error };
+				}
+			}
+			return results;
+		}
+
+		// Destroyed after the lock is released, since their cleaners lock the cache
+		std::vector<ValuePtr> losers(newValues.size());
+		std::vector<uint64_t> weights(m_budget ? newValues.size() : 0);
+		{
+			std::lock_guard lock(m_mutex);
+			const auto now = GetNowLocked();
+			for (size_t i = 0; i < newValues.size(); ++i)
+			{
+				LookupResult& result = results[missPositions[i]];
+				if (errors[i])
+				{
+					if (m_negative)
+					{
+						InsertNegativeLocked(missedKeys[i], errors[i]);
+					}
+					result = { CacheValueStatus::Failed, nullptr, errors[i] };
+					continue;
+				}
+				if (!newValues[i] && m_negative)
+				{
+					InsertNegativeLocked(missedKeys[i], nullptr);
+					result = { CacheValueStatus::Absent, nullptr, nullptr };
+					continue;
+				}
+				auto value = InsertLocked(missedKeys[i], std::move(newValues[i]), losers[i], now);
+				const auto status = value ? CacheValueStatus::Present : CacheValueStatus::Absent;
+				result = { status, std::move(value), nullptr };
+				if (m_budget)
+				{
+					weights[i] = m_items.find(missedKeys[i])->second.weight;
+				}
+			}
+		}
+		if (m_budget)
+		{
+			for (size_t i = 0; i < missedKeys.size(); ++i)
+			{
+				if (const auto& value = results[missPositions[i]].value)
+				{
+					m_budget->Admit(GetBudgetKey(missedKeys[i]), value, weights[i]);
+				}
+			}
+		}
+		for (size_t pos = 0; pos < count; ++pos)
+		{
+			if (missIndices[pos] != SIZE_MAX && pos != missPositions[missIndices[pos]])
+			{
+				results[pos] = results[missPositions[missIndices[pos]]];
+			}
+		}
+		return results;
+	}
+
+	std::vector<ValuePtr> GetValues(const std::vector<Key>& keys) const
+	{
+		return GetValues(keys.data(), keys.size());
+	}
+
+	std::vector<LookupResult> TryGetValues(const std::vector<Key>& keys) const
+	{
+		return TryGetValues(keys.data(), keys.size());
+	}
+
+	// Erases the items whose values have expired, or have been destroyed since the last sweep
+	// in the deferred eviction mode. Requests of values sweep the cache as well
+	void Sweep() const
+	{
+		{
+			Released released;
+			std::lock_guard lock(m_mutex);
+			SweepLocked(GetNowLocked(), released);
+		}
+		StartCompactionIfDue();
+	}
+
+	// Erases the items whose values have been destroyed but which are still in the cache, such as
+	// the ones the deferred eviction mode keeps until a sweep, and shrinks the tables of the items
+	// and of negative entries to fit. Unlike erasure, it moves the items of flat backing stores
+	CacheShrinkResult ShrinkToFit() const
+	{
+		CacheShrinkResult result;
+		Released released;
+		std::lock_guard lock(m_mutex);
+		const size_t itemCount = m_items.size();
+		const size_t allocatedBytes = GetAllocatedBytesLocked();
+		SweepLocked(GetNowLocked(), released);
+		size_t expiredCount = 0;
+		for (auto it = m_items.begin(); it != m_items.end();)
+		{
+			Entry& entry = it->second;
+			if (entry.refreshedValue || !entry.value.expired())
+			{
+				++it;
+				continue;
+			}
+			if (m_expiry)
+			{
+				m_expiry->timers.Cancel(entry.timer);
+			}
+			ForgetLocked(it->first, entry, released);
+			it = m_items.erase(it);
+			++expiredCount;
+		}
+		if (expiredCount)
+		{
+			InvalidateFrontCacheLocked();
+			m_metrics.RecordExpirations(expiredCount);
+		}
+		result.erasedCount = itemCount - m_items.size();
+		detail::ShrinkMapToFit(m_items);
+		if (m_negative)
+		{
+			detail::ShrinkMapToFit(m_negative->items);
+		}
+		result.reclaimedBytes = allocatedBytes - std::min(allocatedBytes, GetAllocatedBytesLocked());
+		return result;
+	}
+
+	// Erases the item of the key, whether it has a value or a negative entry, so that the next
+	// request of the key calls the factory. Holders of the value keep it
+	void Invalidate(const Key& key)
+	{
+		{
+			ValuePtr refreshedValue;
+			Released released;
+			std::lock_guard lock(m_mutex);
+			if (auto it = m_items.find(key); it != m_items.end())
+			{
+				if (m_expiry)
+				{
+					m_expiry->timers.Cancel(it->second.timer);
+				}
+				refreshedValue = std::move(it->second.refreshedValue);
+				ForgetLocked(key, it->second, released);
+				m_items.erase(it);
+				InvalidateFrontCacheLocked();
+				CountErasuresLocked(1);
+			}
+			if (m_negative)
+			{
+				m_negative->items.erase(key);
+			}
+		}
+		StartCompactionIfDue();
+	}
+
+	// Forgets all the keys negative caching remembers
+	void InvalidateNegativeEntries()
+	{
+		std::lock_guard lock(m_mutex);
+		if (m_negative)
+		{
+			m_negative->items.clear();
+			m_negative->absentQueue.clear();
+			m_negative->errorQueue.clear();
+		}
+	}
+
+	// The number of items, including the ones whose values are destroyed but not swept yet
+	size_t GetSize() const
+	{
+		std::lock_guard lock(m_mutex);
+		return m_items.size();
+	}
+
+	CacheMetricsSnapshot GetMetrics() const
+	{
+		auto metrics = m_metrics.GetSnapshot();
+		std::lock_guard lock(m_mutex);
+		metrics.entries = m_items.size();
+		return metrics;
+	}
+
+	// Writes the alive values which haven't expired to a snapshot file, which LoadSnapshot of
+	// another cache may restore them from. Values are encoded without the lock held
+	template <typename KeyCodec = SnapshotCodec<Key>, typename ValueCodec = SnapshotCodec<Val>>
+	void SaveSnapshot(const std::string& path) const
+	{
+		std::vector<std::pair<Key, ValuePtr>> items;
+		{
+			std::lock_guard lock(m_mutex);
+			const auto now = GetNowLocked();
+			items.reserve(m_items.size());
+			for (auto&& item : m_items)
+			{
+				Entry& entry = item.second;
+				if (!IsFreshLocked(entry, now))
+				{
+					continue;
+				}
+				if (auto value = entry.refreshedValue ? entry.refreshedValue : entry.value.lock())
+				{
+					items.emplace_back(item.first, std::move(value));
+				}
+			}
+		}
+
+		detail::SnapshotWriter writer;
+		std::string key;
+		std::string value;
+		for (auto& item : items)
+		{
+			key.clear();
+			value.clear();
+			KeyCodec::Encode(item.first, key);
+			ValueCodec::Encode(*item.second, value);
+			writer.Add(key, value);
+		}
+		writer.Write(path);
+	}
+
+	// Maps a snapshot file. A miss restores the value of its key from the snapshot instead of
+	// calling the value factory, so values are decoded only when they are requested. A value is
+	// restored once: after it is destroyed, the factory creates its key's values again.
+	// Must be called before any value is requested, and only once
+	template <typename KeyCodec = SnapshotCodec<Key>, typename ValueCodec = SnapshotCodec<Val>>
+	void LoadSnapshot(const std::string& path)
+	{
+		auto reader = std::make_shared<detail::SnapshotReader>(path);
+		std::lock_guard lock(m_mutex);
+		if (m_snapshotLoader || !m_items.empty())
+		{
+			throw std::logic_error("snapshot must be loaded once, before the cache is used");
+		}
+		m_snapshotLoader = [reader = std::move(reader)](const Key& key, const CacheCleaner& cleaner) -> ValuePtr {
+			std::string encodedKey;
+			KeyCodec::Encode(key, encodedKey);
+			auto bytes = reader->Take(encodedKey);
+			if (!bytes)
+			{
+				return nullptr;
+			}
+			return ValuePtr(new Val(ValueCodec::Decode(*bytes)), [cleaner](Val* value) {
+				cleaner();
+				delete value;
+			});
+		};
+	}
+
+private:
+	using TimerId = typename TimerWheel<Key>::TimerId;
+
+	struct Entry
+	{
+		ValueWeakPtr value;
+		// A value created by a refresh, which nobody has requested yet
+		ValuePtr refreshedValue;
+		TimePoint expiresAt = TimePoint::max();
+		TimerId timer;
+		// The weight of the value, if the cache has a budget
+		uint64_t weight = 0;
+		bool isRefreshing = false;
+	};
+
+	using Items = typename Storage::template Map<Key, Entry, Hasher, KeyEq>;
+	// Values which may be alive are released after the lock, since their cleaners lock the cache
+	using Released = std::vector<std::shared_ptr<const void>>;
+
+	// Lets a value get into the front cache, if the item of the value isn't stale
+	struct FrontTicket
+	{
+		uint64_t epoch;
+		TimePoint expiresAt;
+	};
+
+	struct FrontSlot
+	{
+		// Zero if the slot is empty
+		uint64_t cacheId = 0;
+		uint64_t epoch = 0;
+		std::optional<Key> key;
+		ValueWeakPtr value;
+		TimePoint expiresAt;
+	};
+
+	struct NegativeEntry
+	{
+		TimePoint expiresAt;
+		// Null for absent keys
+		std::exception_ptr error;
+	};
+
+	struct Negative
+	{
+		NegativeCachingPolicy policy;
+		typename Storage::template Map<Key, NegativeEntry, Hasher, KeyEq> items;
+		std::deque<std::pair<Key, TimePoint>> absentQueue;
+		std::deque<std::pair<Key, TimePoint>> errorQueue;
+	};
+
+	struct Expiry
+	{
+		ExpiryPolicy policy;
+		TimePoint start;
+		// Ticks since start. A timer fires when its item must no longer be served
+		TimerWheel<Key> timers;
+	};
+
+	// A load started by GetValueAsync, shared by the copies of its task. An executor may
+	// destroy the task without running it, for example when it shuts down. The load then
+	// stops being pending, so that its key doesn't stay bound to a broken future
+	struct PendingLoad
+	{
+		PendingLoad(std::weak_ptr<const MyType> cache, const Key& key)
+			: cache(std::move(cache))
+			, key(key)
+		{
+		}
+
+		PendingLoad(const PendingLoad&) = delete;
+		PendingLoad& operator=(const PendingLoad&) = delete;
+
+		~PendingLoad()
+		{
+			if (isPending)
+			{
+				if (auto self = cache.lock())
+				{
+					self->EndLoad(*this);
+				}
+			}
+		}
+
+		std::weak_ptr<const MyType> cache;
+		const Key key;
+		std::promise<ValuePtr> promise;
+		// Whether the future of the promise is in m_pendingValues
+		bool isPending = false;
+	};
+
+	// Returns the value of the key if it is cached, or null if the key is known to be absent.
+	// Rethrows the exception of a key known to fail. On a miss, returns nothing and calls
+	// onMissLocked with the lock held
+	template <typename OnMiss>
+	std::optional<ValuePtr> GetCachedValue(const Key& key, OnMiss&& onMissLocked) const
+	{
+		if (m_isFrontCacheEnabled)
+		{
+			if (auto value = GetFrontValue(key))
+			{
+				m_metrics.RecordHit();
+				return value;
+			}
+		}
+		StartCompactionIfDue();
+
+		ValuePtr value;
+		bool needsRefresh = false;
+		std::optional<FrontTicket> frontTicket;
+		std::exception_ptr error;
+		{
+			// Destroyed after the lock is released, since their cleaners lock the cache
+			Released released;
+			std::lock_guard lock(m_mutex);
+			const auto now = GetNowLocked();
+			SweepLocked(now, released);
+			if (auto it = m_items.find(key); it != m_items.end())
+			{
+				value = GetValueLocked(it->second, now, needsRefresh);
+				if (value)
+				{
+					frontTicket = GetFrontTicketLocked(it->second, now);
+				}
+			}
+			if (!value)
+			{
+				const NegativeEntry* negative = FindNegativeLocked(key);
+				if (!negative)
+				{
+					onMissLocked();
+					return std::nullopt;
+				}
+				error = negative->error;
+			}
+		}
+		m_metrics.RecordHit();
+		if (!value)
+		{
+			if (error)
+			{
+				std::rethrow_exception(error);
+			}
+			return value;
+		}
+		if (m_budget)
+		{
+			m_budget->RecordAccess(GetBudgetKey(key));
+		}
+		if (needsRefresh)
+		{
+			StartRefresh(key);
+		}
+		if (frontTicket)
+		{
+			PutFrontValue(key, value, *frontTicket);
+		}
+		return value;
+	}
+
+	// Creates the value of a missed key and inserts it
+	ValuePtr CreateValue(const Key& key) const
+	{
+		auto factoryCallStart = m_metrics.StartFactoryCall();
+		auto cleaner = MakeCleaner(key);
+		ValuePtr value;
+		try
+		{
+			if (m_snapshotLoader)
+			{
+				value = m_snapshotLoader(key, cleaner);
+			}
+			if (!value)
+			{
+				value = m_valueFactory(key, std::move(cleaner));
+			}
+		}
+		catch (...)
+		{
+			RememberFailure(key, std::current_exception());
+			throw;
+		}
+		m_metrics.RecordMiss(factoryCallStart);
+		if (!value && m_negative)
+		{
+			std::lock_guard lock(m_mutex);
+			InsertNegativeLocked(key, nullptr);
+			return value;
+		}
+
+		// Destroyed after the lock is released, since its cleaner locks the cache
+		ValuePtr loser;
+		uint64_t weight = 0;
+		std::optional<FrontTicket> frontTicket;
+		{
+			std::lock_guard lock(m_mutex);
+			const auto now = GetNowLocked();
+			value = InsertLocked(key, std::move(value), loser, now);
+			if (m_isFrontCacheEnabled || m_budget)
+			{
+				const Entry& entry = m_items.find(key)->second;
+				frontTicket = GetFrontTicketLocked(entry, now);
+				weight = entry.weight;
+			}
+		}
+		if (m_budget && value)
+		{
+			m_budget->Admit(GetBudgetKey(key), value, weight);
+		}
+		if (frontTicket)
+		{
+			PutFrontValue(key, value, *frontTicket);
+		}
+		return value;
+	}
+
+	// Remembers the failure of the factory for the key, if negative caching is on
+	void RememberFailure(const Key& key, std::exception_ptr error) const
+	{
+		if (!m_negative)
+		{
+			return;
+		}
+		std::lock_guard lock(m_mutex);
+		InsertNegativeLocked(key, error);
+	}
+
+	// The error is null for absent keys
+	void InsertNegativeLocked(const Key& key, std::exception_ptr error) const
+	{
+		auto& negative = *m_negative;
+		const auto timeToLive = error ? negative.policy.errorTimeToLive : negative.policy.absentTimeToLive;
+		if (timeToLive <= Clock::duration::zero())
+		{
+			return;
+		}
+		const auto expiresAt = negative.policy.now() + timeToLive;
+		(error ? negative.errorQueue : negative.absentQueue).emplace_back(key, expiresAt);
+		negative.items.try_emplace(key).first->second = NegativeEntry{ expiresAt, std::move(error) };
+	}
+
+	// Returns the negative entry of the key, unless there is none or it has expired
+	const NegativeEntry* FindNegativeLocked(const Key& key) const
+	{
+		if (!m_negative || m_negative->items.empty())
+		{
+			return nullptr;
+		}
+		auto it = m_negative->items.find(key);
+		if (it == m_negative->items.end())
+		{
+			return nullptr;
+		}
+		if (m_negative->policy.now() >= it->second.expiresAt)
+		{
+			m_negative->items.erase(it);
+			return nullptr;
+		}
+		return &it->second;
+	}
+
+	// Every time to live has a queue of its entries, in the order of their expiry
+	void SweepNegativeLocked() const
+	{
+		auto& negative = *m_negative;
+		if (negative.absentQueue.empty() && negative.errorQueue.empty())
+		{
+			return;
+		}
+		const auto now = negative.policy.now();
+		for (auto* queue : { &negative.absentQueue, &negative.errorQueue })
+		{
+			for (; !queue->empty() && queue->front().second <= now; queue->pop_front())
+			{
+				// The key may have got a newer entry, or a value
+				auto it = negative.items.find(queue->front().first);
+				if (it != negative.items.end() && it->second.expiresAt <= now)
+				{
+					negative.items.erase(it);
+				}
+			}
+		}
+	}
+
+	// Runs a load started by GetValueAsync. The value is inserted before the load stops being
+	// pending, so that requests never miss both
+	void CompleteLoad(PendingLoad& load) const
+	{
+		ValuePtr value;
+		std::exception_ptr error;
+		try
+		{
+			value = CreateValue(load.key);
+		}
+		catch (...)
+		{
+			error = std::current_exception();
+		}
+		EndLoad(load);
+		if (error)
+		{
+			load.promise.set_exception(error);
+		}
+		else
+		{
+			load.promise.set_value(std::move(value));
+		}
+	}
+
+	// Makes requests of the key start a new load instead of waiting for this one
+	void EndLoad(PendingLoad& load) const noexcept
+	{
+		std::lock_guard lock(m_mutex);
+		m_pendingValues.erase(load.key);
+		load.isPending = false;
+	}
+
+	// Calls fn(position, value) for every key, passing a null value for misses.
+	// Adds the keys whose stale values are returned to staleKeys
+	template <typename Fn>
+	void LookUpLocked(const Key* keys, size_t count, TimePoint now, std::vector<Key>& staleKeys, Fn&& fn) const
+	{
+		auto lookUp = [&](size_t i, typename Items::iterator it) {
+			bool needsRefresh = false;
+			fn(i, it != m_items.end() ? GetValueLocked(it->second, now, needsRefresh) : nullptr);
+			if (needsRefresh)
+			{
+				staleKeys.push_back(keys[i]);
+			}
+		};
+
+		if constexpr (detail::SupportsHashedLookup<Items>::value)
+		{
+			// Hash all keys and issue the loads of their slots first, so that the cache
+			// misses of the lookups overlap instead of being waited for one by one
+			auto hasher = m_items.hash_function();
+			std::vector<size_t> hashes(count);
+			for (size_t i = 0; i < count; ++i)
+			{
+				hashes[i] = hasher(keys[i]);
+				m_items.prefetch(hashes[i]);
+			}
+			for (size_t i = 0; i < count; ++i)
+			{
+				lookUp(i, m_items.find(keys[i], hashes[i]));
+			}
+		}
+		else
+		{
+			for (size_t i = 0; i < count; ++i)
+			{
+				lookUp(i, m_items.find(keys[i]));
+			}
+		}
+	}
+
+	// Exceptions of the factories for particular keys are stored in errors. An exception of the
+	// batch factory is thrown, since it fails the whole batch
+	std::vector<ValuePtr> CreateValues(const std::vector<Key>& keys, std::vector<std::exception_ptr>& errors) const
+	{
+		std::vector<CacheCleaner> cleaners;
+		cleaners.reserve(keys.size());
+		for (auto& key : keys)
+		{
+			cleaners.push_back(MakeCleaner(key));
+		}
+
+		auto factoryCallStart = m_metrics.StartFactoryCall();
+		std::vector<ValuePtr> values(keys.size());
+		// The positions of the keys which are not restored from the snapshot
+		std::vector<size_t> factoryPositions;
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			if (m_snapshotLoader)
+			{
+				try
+				{
+					values[i] = m_snapshotLoader(keys[i], cleaners[i]);
+				}
+				catch (...)
+				{
+					errors[i] = std::current_exception();
+					continue;
+				}
+			}
+			if (!values[i])
+			{
+				factoryPositions.push_back(i);
+			}
+		}
+		if (m_batchValueFactory && !factoryPositions.empty())
+		{
+			const bool isWholeBatch = factoryPositions.size() == keys.size();
+			std::vector<Key> factoryKeys;
+			std::vector<CacheCleaner> factoryCleaners;
+			if (!isWholeBatch)
+			{
+				for (size_t pos : factoryPositions)
+				{
+					factoryKeys.push_back(keys[pos]);
+					factoryCleaners.push_back(std::move(cleaners[pos]));
+				}
+			}
+			auto created = m_batchValueFactory(isWholeBatch ? keys : factoryKeys,
+				std::move(isWholeBatch ? cleaners : factoryCleaners));
+			if (created.size() != factoryPositions.size())
+			{
+				throw std::logic_error("batch value factory must return a value per key");
+			}
+			for (size_t i = 0; i < created.size(); ++i)
+			{
+				values[factoryPositions[i]] = std::move(created[i]);
+			}
+		}
+		else
+		{
+			for (size_t pos : factoryPositions)
+			{
+				try
+				{
+					values[pos] = m_valueFactory(keys[pos], std::move(cleaners[pos]));
+				}
+				catch (...)
+				{
+					errors[pos] = std::current_exception();
+				}
+			}
+		}
+		// Every miss has waited for the whole batch. Failures are not counted as misses
+		for (size_t i = 0; i < keys.size(); ++i)
+		{
+			if (!errors[i])
+			{
+				m_metrics.RecordMiss(factoryCallStart);
+			}
+		}
+		return values;
+	}
+
+	// Returns null if the item has no value to serve. A value which is past its expiry but within
+	// the stale period is returned, and needsRefresh is set unless it is being refreshed already
+	ValuePtr GetValueLocked(Entry& entry, TimePoint now, bool& needsRefresh) const
+	{
+		if (!IsFreshLocked(entry, now))
+		{
+			const auto& policy = m_expiry->policy;
+			// Checked before locking the value, which must not be released under the lock
+			if (!policy.executor || now >= entry.expiresAt + policy.staleWhileRevalidate)
+			{
+				return nullptr;
+			}
+			auto value = entry.value.lock();
+			if (value && !entry.isRefreshing)
+			{
+				entry.isRefreshing = true;
+				needsRefresh = true;
+			}
+			return value;
+		}
+		if (entry.refreshedValue)
+		{
+			return std::move(entry.refreshedValue);
+		}
+		return entry.value.lock();
+	}
+
+	bool IsFreshLocked(const Entry& entry, TimePoint now) const noexcept
+	{
+		return !m_expiry || now < entry.expiresAt;
+	}
+
+	void SetWeightLocked(Entry& entry, uint64_t weight) const noexcept
+	{
+		if (m_budget)
+		{
+			m_budget->AddLiveWeight(static_cast<int64_t>(weight) - static_cast<int64_t>(entry.weight));
+			entry.weight = weight;
+		}
+	}
+
+	// Called whenever an item is erased. The value the budget retains for the key is moved to released
+	void ForgetLocked(const Key& key, Entry& entry, Released& released) const
+	{
+		if (m_budget)
+		{
+			SetWeightLocked(entry, 0);
+			if (auto value = m_budget->Forget(GetBudgetKey(key)))
+			{
+				released.push_back(std::move(value));
+			}
+		}
+	}
+
+	// Identifies the key among the keys of all the caches of the budget
+	uint64_t GetBudgetKey(const Key& key) const
+	{
+		// The finalizer of SplitMix64
+		uint64_t h = static_cast<uint64_t>(Hasher()(key)) ^ (m_id * 0x9E3779B97F4A7C15ull);
+		h = (h ^ (h >> 30)) * 0xBF58476D1CE4E5B9ull;
+		h = (h ^ (h >> 27)) * 0x94D049BB133111EBull;
+		return h ^ (h >> 31);
+	}
+
+	static uint64_t GenerateCacheId() noexcept
+	{
+		static std::atomic<uint64_t> lastCacheId = 0;
+		return ++lastCacheId;
+	}
+
+	std::optional<FrontTicket> GetFrontTicketLocked(const Entry& entry, TimePoint now) const noexcept
+	{
+		if (!m_isFrontCacheEnabled || !IsFreshLocked(entry, now))
+		{
+			return std::nullopt;
+		}
+		return FrontTicket{ m_epoch.load(std::memory_order_relaxed), entry.expiresAt };
+	}
+
+	// Called whenever an item is erased or gets another value
+	void InvalidateFrontCacheLocked() const noexcept
+	{
+		m_epoch.store(m_epoch.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+	}
+
+	static FrontSlot* GetFrontSlots() noexcept
+	{
+		thread_local FrontSlot slots[FRONT_CACHE_SIZE];
+		return slots;
+	}
+
+	static FrontSlot& GetFrontSlot(const Key& key)
+	{
+		// Fibonacci hashing spreads identity hashes of integers over the slots
+		const uint64_t hash = static_cast<uint64_t>(Hasher()(key));
+		return GetFrontSlots()[(hash * 0x9E3779B97F4A7C15ull) >> (64 - FRONT_CACHE_BITS)];
+	}
+
+	static void ClearFrontSlot(FrontSlot& slot) noexcept
+	{
+		slot.cacheId = 0;
+		slot.key.reset();
+		slot.value.reset();
+	}
+
+	ValuePtr GetFrontValue(const Key& key) const
+	{
+		FrontSlot& slot = GetFrontSlot(key);
+		if (slot.cacheId != m_id || !KeyEq()(*slot.key, key))
+		{
+			return nullptr;
+		}
+		if (slot.epoch != m_epoch.load(std::memory_order_acquire)
+			|| (m_expiry && m_expiry->policy.now() >= slot.expiresAt))
+		{
+			ClearFrontSlot(slot);
+			return nullptr;
+		}
+		return slot.value.lock();
+	}
+
+	void PutFrontValue(const Key& key, const ValuePtr& value, const FrontTicket& ticket) const
+	{
+		FrontSlot& slot = GetFrontSlot(key);
+		slot.cacheId = 0;
+		slot.key = key;
+		slot.value = value;
+		slot.epoch = ticket.epoch;
+		slot.expiresAt = ticket.expiresAt;
+		slot.cacheId = m_id;
+	}
+
+	// Returns the value of the key which is in the cache after the insertion.
+	// If another thread has put a fresh alive value of the key in the meantime, that value is
+	// returned and the new one is moved to loser. Otherwise, the value replaced by the new one
+	// may be moved to loser
+	ValuePtr InsertLocked(const Key& key, ValuePtr value, ValuePtr& loser, TimePoint now) const
+	{
+		auto [it, inserted] = m_items.try_emplace(key);
+		Entry& entry = it->second;
+		if (!inserted && IsFreshLocked(entry, now))
+		{
+			if (auto existing = entry.refreshedValue ? std::move(entry.refreshedValue) : entry.value.lock())
+			{
+				loser = std::move(value);
+				return existing;
+			}
+		}
+		if (!inserted)
+		{
+			InvalidateFrontCacheLocked();
+		}
+		if (m_negative && value)
+		{
+			m_negative->items.erase(key);
+		}
+		loser = std::move(entry.refreshedValue);
+		entry.value = value;
+		entry.isRefreshing = false;
+		if (m_budget)
+		{
+			SetWeightLocked(entry, m_weigher && value ? m_weigher(key, *value) : 0);
+		}
+		ScheduleExpiryLocked(key, entry, value.get(), now);
+		return value;
+	}
+
+	void ScheduleExpiryLocked(const Key& key, Entry& entry, const Val* value, TimePoint now) const
+	{
+		if (!m_expiry)
+		{
+			return;
+		}
+		auto& expiry = *m_expiry;
+		expiry.timers.Cancel(std::exchange(entry.timer, TimerId()));
+		const auto& policy = expiry.policy;
+		const auto timeToLive = policy.getTimeToLive && value ? policy.getTimeToLive(key, *value) : policy.timeToLive;
+		if (timeToLive <= Clock::duration::zero())
+		{
+			entry.expiresAt = TimePoint::max();
+			return;
+		}
+		entry.expiresAt = now + timeToLive;
+		const auto deadline = policy.executor ? entry.expiresAt + policy.staleWhileRevalidate : entry.expiresAt;
+		entry.timer = expiry.timers.Schedule(GetTickLocked(deadline, true), key);
+	}
+
+	TimePoint GetNowLocked() const
+	{
+		return m_expiry ? m_expiry->policy.now() : TimePoint();
+	}
+
+	uint64_t GetTickLocked(TimePoint time, bool roundUp) const noexcept
+	{
+		const auto& expiry = *m_expiry;
+		if (time <= expiry.start)
+		{
+			return 0;
+		}
+		auto elapsed = time - expiry.start;
+		if (roundUp)
+		{
+			elapsed += expiry.policy.tick - Clock::duration(1);
+		}
+		return static_cast<uint64_t>(elapsed / expiry.policy.tick);
+	}
+
+	// Refreshed values of erased items and the values the budget retains for them are moved to released
+	void SweepLocked(TimePoint now, Released& released) const
+	{
+		size_t expiredCount = 0;
+		if (m_expiredKeys && !m_expiredKeys->IsEmpty())
+		{
+			m_expiredKeys->Consume([this, &expiredCount, &released](const Key& key) {
+				expiredCount += EraseExpiredLocked(key, released);
+			});
+		}
+		if (m_expiry)
+		{
+			m_expiry->timers.Advance(GetTickLocked(now, false), [&](Key&& key) {
+				if (auto it = m_items.find(key); it != m_items.end())
+				{
+					if (it->second.refreshedValue)
+					{
+						released.push_back(std::move(it->second.refreshedValue));
+					}
+					ForgetLocked(key, it->second, released);
+					m_items.erase(it);
+					InvalidateFrontCacheLocked();
+					CountErasuresLocked(1);
+					++expiredCount;
+				}
+			});
+		}
+		if (expiredCount)
+		{
+			m_metrics.RecordExpirations(expiredCount);
+		}
+		if (m_negative)
+		{
+			SweepNegativeLocked();
+		}
+	}
+
+	size_t EraseExpiredLocked(const Key& key, Released& released) const
+	{
+		// The key may have got a new value after its old value was destroyed
+		if (auto it = m_items.find(key); it != m_items.end() && it->second.value.expired())
+		{
+			if (m_expiry)
+			{
+				m_expiry->timers.Cancel(it->second.timer);
+			}
+			ForgetLocked(key, it->second, released);
+			m_items.erase(it);
+			InvalidateFrontCacheLocked();
+			CountErasuresLocked(1);
+			return 1;
+		}
+		return 0;
+	}
+
+	size_t GetAllocatedBytesLocked() const noexcept
+	{
+		size_t bytes = detail::GetMapAllocatedBytes(m_items);
+		if (m_negative)
+		{
+			bytes += detail::GetMapAllocatedBytes(m_negative->items);
+		}
+		return bytes;
+	}
+
+	void CountErasuresLocked(size_t count) const noexcept
+	{
+		if (!m_compactionExecutor)
+		{
+			return;
+		}
+		m_erasedCount += count;
+		if (m_erasedCount >= std::max(MIN_COMPACTION_ERASURE_COUNT, m_items.size()))
+		{
+			m_erasedCount = 0;
+			m_isCompactionDue.store(true, std::memory_order_relaxed);
+		}
+	}
+
+	// Called without the lock held
+	void StartCompactionIfDue() const
+	{
+		if (!m_isCompactionDue.load(std::memory_order_relaxed) || !m_isCompactionDue.exchange(false))
+		{
+			return;
+		}
+		try
+		{
+			m_compactionExecutor([weakSelf = MyType::weak_from_this()] {
+				if (auto self = weakSelf.lock())
+				{
+					self->ShrinkToFit();
+				}
+			});
+		}
+		catch (...)
+		{
+			m_isCompactionDue.store(true, std::memory_order_relaxed);
+			throw;
+		}
+	}
+
+	void StartRefresh(const Key& key) const
+	{
+		try
+		{
+			m_expiry->policy.executor([weakSelf = MyType::weak_from_this(), key] {
+				if (auto self = weakSelf.lock())
+				{
+					self->Refresh(key);
+				}
+			});
+		}
+		catch (...)
+		{
+			std::lock_guard lock(m_mutex);
+			if (auto it = m_items.find(key); it != m_items.end())
+			{
+				it->second.isRefreshing = false;
+			}
+			throw;
+		}
+	}
+
+	void Refresh(const Key& key) const
+	{
+		ValuePtr value;
+		try
+		{
+			auto factoryCallStart = m_metrics.StartFactoryCall();
+			value = m_valueFactory(key, MakeCleaner(key));
+			m_metrics.RecordMiss(factoryCallStart);
+		}
+		catch (...)
+		{
+			std::lock_guard lock(m_mutex);
+			if (auto it = m_items.find(key); it != m_items.end())
+			{
+				it->second.isRefreshing = false;
+			}
+			throw;
+		}
+
+		ValuePtr result;
+		ValuePtr loser;
+		std::lock_guard lock(m_mutex);
+		result = InsertLocked(key, value, loser, GetNowLocked());
+		if (result == value)
+		{
+			// Nobody holds the value yet
+			m_items.find(key)->second.refreshedValue = std::move(value);
+		}
+	}
+
+	CacheCleaner MakeCleaner(const Key& key) const
+	{
+		if (m_expiredKeys)
+		{
+			return typename detail::ExpiredKeyList<Key>::Pusher(m_expiredKeys, key);
+		}
+		return [weakSelf = MyType::weak_from_this(), key] {
+			if (auto self = weakSelf.lock())
+			{
+				Released released;
+				std::lock_guard lock(self->m_mutex);
+				self->m_metrics.RecordExpirations(self->EraseExpiredLocked(key, released));
+			}
+		};
+	}
+
+	// Guards m_items, m_expiry, m_negative, m_pendingValues and m_erasedCount. Values must never be released while it is held,
+	// since their cleaners lock it
+	mutable std::mutex m_mutex;
+	mutable Items m_items;
+	std::unique_ptr<Expiry> m_expiry;
+	std::unique_ptr<Negative> m_negative;
+	ValueFactory m_valueFactory;
+	BatchValueFactory m_batchValueFactory;
+	// Unique in the process, unlike addresses of caches
+	const uint64_t m_id;
+	bool m_isFrontCacheEnabled = false;
+	mutable std::atomic<uint64_t> m_epoch = 0;
+	std::shared_ptr<CacheBudget> m_budget;
+	Weigher m_weigher;
+	Executor m_compactionExecutor;
+	// Erasures since the last compaction was due
+	mutable size_t m_erasedCount = 0;
+	mutable std::atomic<bool> m_isCompactionDue = false;
+	// The futures of the values GetValueAsync is creating
+	mutable std::unordered_map<Key, std::shared_future<ValuePtr>, Hasher, KeyEq> m_pendingValues;
+	// Restores values from a snapshot, or returns null
+	std::function<ValuePtr(const Key& key, const CacheCleaner& cleaner)> m_snapshotLoader;
+	mutable detail::CacheMetricsRecorder m_metrics;
+	// Shared with cleaners, so that they may outlive the cache
+	std::shared_ptr<detail::ExpiredKeyList<Key>> m_expiredKeys;
+};
@@ -0,0 +1,266 @@
+#pragma once
+
+#include "MapStorage.h"
+#include "WeakMap.h"
+#include "WeakSlot.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace detail
+{
+
+// Counts the readers of one instance of a Left-Right structure. Threads are spread over
+// cache line sized stripes, so that readers don't contend for a single counter
+class ReadIndicator
+{
+public:
+	void Arrive() noexcept
+	{
+		GetStripe().count.fetch_add(1);
+	}
+
+	void Depart() noexcept
+	{
+		GetStripe().count.fetch_sub(1);
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		for (auto& stripe : m_stripes)
+		{
+			if (stripe.count.load() != 0)
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+private:
+	static constexpr size_t STRIPE_COUNT = 16;
+
+	struct alignas(64) Stripe
+	{
+		std::atomic<intptr_t> count = 0;
+	};
+
+	Stripe& GetStripe() noexcept
+	{
+		static std::atomic<size_t> nextStripe = 0;
+		thread_local const size_t stripeIndex = nextStripe.fetch_add(1, std::memory_order_relaxed) % STRIPE_COUNT;
+		return m_stripes[stripeIndex];
+	}
+
+	Stripe m_stripes[STRIPE_COUNT];
+};
+
+} // namespace detail
+
+// A WeakMap which may be read by many threads at once, while another thread writes it.
+//
+// The map follows the Left-Right technique: there are two copies of the items. Readers look
+// up the copy selected by m_readIndex, announcing themselves in a read indicator, and never
+// wait. A writer updates the copy nobody reads, switches readers to it, waits until the readers
+// of the other copy are gone and repeats the update there. Writers, including erasure of keys
+// being destroyed, are serialized. Values are stored twice and must be copyable. Copies of
+// a value must share the keys it owns, so that destroying one of them doesn't destroy the keys.
+//
+// A key is erased before its destructor returns, so its address can't be reused while
+// its stale item is still visible to readers
+template <typename Key, typename Val, typename Storage = NodeMapStorage>
+class ConcurrentWeakMap : private detail::WeakMapBase
+{
+	static_assert(detail::IsWeakMapKey<Key>::value,
+		"Keys must be DestructionObservable descendants or overload WeakMapGetDestructionObservable");
+
+public:
+	using KeyPtr = std::shared_ptr<const Key>;
+
+	ConcurrentWeakMap() = default;
+	ConcurrentWeakMap(const ConcurrentWeakMap&) = delete;
+	ConcurrentWeakMap& operator=(const ConcurrentWeakMap&) = delete;
+
+	~ConcurrentWeakMap()
+	{
+		// Keys may be destroyed by other threads meanwhile. An attached key is valid while the write
+		// lock is held, since its destruction erases its item under the lock. The lock of a key is
+		// taken before the write lock, so it is only tried here. If it is busy, the key may be being
+		// destroyed, which needs the write lock, and the walk starts over once it is done.
+		// A key whose lock is taken may have started its destruction. Its destruction handler is
+		// then either being called, and waits for the write lock to erase the key, or is removed
+		// by Detach, so that the key doesn't look this map up. Either way its WeakSlot outlives
+		// the lock. Detached keys may be destroyed without erasing their items, so the items are
+		// erased from the copy being walked. The other copy keeps the values, which may own keys
+		// still attached, until the map is destroyed after the lock is released
+		std::unique_lock lock(m_writeMutex);
+		Items& items = m_items[0];
+		for (auto it = items.begin(); it != items.end();)
+		{
+			const Key& key = *it->first.key;
+			if (auto keyLock = detail::WeakSlot::TryLock(key))
+			{
+				detail::WeakSlot::Detach(key, *this);
+				it = items.erase(it);
+				continue;
+			}
+			lock.unlock();
+			std::this_thread::yield();
+			lock.lock();
+			it = items.begin();
+		}
+	}
+
+	// Wait-free, apart from copying the value
+	std::optional<Val> TryGetValue(const KeyPtr& key) const
+	{
+		const int versionIndex = m_versionIndex.load();
+		m_readIndicators[versionIndex].Arrive();
+		const Items& items = m_items[m_readIndex.load()];
+		std::optional<Val> value;
+		if (auto it = items.find(key.get()); it != items.end())
+		{
+			value = it->second;
+		}
+		m_readIndicators[versionIndex].Depart();
+		return value;
+	}
+
+	void RemoveValue(const KeyPtr& key)
+	{
+		// Declared before the locks, so that old values are destroyed after they are released
+		Garbage garbage;
+		auto keyLock = detail::WeakSlot::Lock(*key);
+		std::lock_guard lock(m_writeMutex);
+		if (FindLocked(key.get()))
+		{
+			detail::WeakSlot::Detach(*key, *this);
+			EraseLocked(key.get(), garbage);
+		}
+	}
+
+	template <typename V>
+	void SetValue(const KeyPtr& key, V&& v)
+	{
+		Val value(std::forward<V>(v));
+		Garbage garbage;
+		{
+			std::lock_guard lock(m_writeMutex);
+			if (AssignLocked(key.get(), value, garbage))
+			{
+				return;
+			}
+		}
+
+		// A new key must be attached under its lock, which is taken before the write lock
+		auto keyLock = detail::WeakSlot::Lock(*key);
+		std::lock_guard lock(m_writeMutex);
+		if (AssignLocked(key.get(), value, garbage))
+		{
+			return;
+		}
+		detail::WeakSlot::Attach(*key, *this);
+		try
+		{
+			Write(
+				[&](Items& items, std::optional<Val>&) {
+					items.emplace(key.get(), value);
+				},
+				garbage);
+		}
+		catch (...)
+		{
+			detail::WeakSlot::Detach(*key, *this);
+			throw;
+		}
+	}
+
+private:
+	using WeakKey = detail::WeakKey<Key>;
+	using Items = typename Storage::template Map<WeakKey, Val, detail::WeakKeyHasher, std::equal_to<WeakKey>>;
+	// Values replaced in either copy
+	using Garbage = std::optional<Val>[2];
+
+	void EraseDestroyedKey(const void* key) noexcept override
+	{
+		Garbage garbage;
+		std::lock_guard lock(m_writeMutex);
+		EraseLocked(static_cast<const Key*>(key), garbage);
+	}
+
+	bool FindLocked(const Key* key) const
+	{
+		// Both copies are equal while the write lock is held
+		const auto& items = m_items[m_readIndex.load(std::memory_order_relaxed)];
+		return items.find(key) != items.end();
+	}
+
+	bool AssignLocked(const Key* key, const Val& value, Garbage& garbage)
+	{
+		if (!FindLocked(key))
+		{
+			return false;
+		}
+		Write(
+			[&](Items& items, std::optional<Val>& old) {
+				old = std::exchange(items.find(key)->second, value);
+			},
+			garbage);
+		return true;
+	}
+
+	void EraseLocked(const Key* key, Garbage& garbage) noexcept
+	{
+		Write(
+			[key](Items& items, std::optional<Val>& old) {
+				if (auto it = items.find(key); it != items.end())
+				{
+					old = std::move(it->second);
+					items.erase(it);
+				}
+			},
+			garbage);
+	}
+
+	// Applies the update to both copies. If the update of the first copy throws, nothing changes.
+	// The second update repeats the one which has succeeded, so it is not expected to throw.
+	// If it does, the process is terminated rather than left with different copies
+	template <typename Update>
+	void Write(Update&& update, Garbage& garbage)
+	{
+		const int readIndex = m_readIndex.load(std::memory_order_relaxed);
+		update(m_items[1 - readIndex], garbage[0]);
+
+		m_readIndex.store(1 - readIndex);
+		WaitForReaders();
+
+		[&]() noexcept {
+			update(m_items[readIndex], garbage[1]);
+		}();
+	}
+
+	// Waits until all the readers which might have seen the previous read index are gone
+	void WaitForReaders() noexcept
+	{
+		const int versionIndex = m_versionIndex.load();
+		const int nextVersionIndex = 1 - versionIndex;
+		while (!m_readIndicators[nextVersionIndex].IsEmpty())
+		{
+			std::this_thread::yield();
+		}
+		m_versionIndex.store(nextVersionIndex);
+		while (!m_readIndicators[versionIndex].IsEmpty())
+		{
+			std::this_thread::yield();
+		}
+	}
+
+	Items m_items[2];
+	std::atomic<int> m_readIndex = 0;
+	std::atomic<int> m_versionIndex = 0;
+	mutable detail::ReadIndicator m_readIndicators[2];
+	// Serializes writers. Taken after the locks of keys
+	std::mutex m_writeMutex;
+};
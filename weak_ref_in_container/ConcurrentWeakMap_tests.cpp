@@ -0,0 +1,140 @@
+#include "pch.h"
+#include "ConcurrentWeakMap.h"
+
+using namespace std;
+
+namespace
+{
+
+struct Key : DestructionObservable
+{
+	explicit Key(int id)
+		: id(id)
+	{
+	}
+	const int id;
+};
+
+} // namespace
+
+SCENARIO("Concurrent WeakMap")
+{
+	GIVEN("a map with a value")
+	{
+		auto map = make_shared<ConcurrentWeakMap<Key, string>>();
+		auto key = make_shared<Key>(1);
+		map->SetValue(key, "one");
+
+		THEN("the value can be read")
+		{
+			CHECK(map->TryGetValue(key).value_or("") == "one");
+			CHECK(!map->TryGetValue(make_shared<Key>(1)));
+		}
+
+		WHEN("the value is replaced")
+		{
+			map->SetValue(key, "uno");
+			THEN("the new value is read")
+			{
+				CHECK(map->TryGetValue(key).value_or("") == "uno");
+				CHECK(key->GetDestructionHandlerCount() == 1);
+			}
+		}
+
+		WHEN("the value is removed")
+		{
+			map->RemoveValue(key);
+			THEN("it can't be found")
+			{
+				CHECK(!map->TryGetValue(key));
+				CHECK(key->GetDestructionHandlerCount() == 0);
+			}
+		}
+
+		WHEN("the key is shared with a WeakMap and destroyed")
+		{
+			auto weakMap = make_shared<WeakMap<Key, int>>();
+			weakMap->SetValue(key, 1);
+			key.reset();
+			THEN("it is erased from both maps")
+			{
+				CHECK(weakMap->GetSize() == 0);
+				auto other = make_shared<Key>(2);
+				map->SetValue(other, "two");
+				weakMap->SetValue(other, 2);
+				CHECK(other->GetDestructionHandlerCount() == 1);
+			}
+		}
+	}
+}
+
+SCENARIO("Concurrent WeakMap is destroyed while its keys are destroyed")
+{
+	for (int round = 0; round < 100; ++round)
+	{
+		auto map = make_unique<ConcurrentWeakMap<Key, int>>();
+		vector<shared_ptr<const Key>> keys;
+		for (int i = 0; i < 100; ++i)
+		{
+			keys.push_back(make_shared<Key>(i));
+			map->SetValue(keys.back(), i);
+		}
+		thread keyReleaser([&keys] {
+			keys.clear();
+		});
+		map.reset();
+		keyReleaser.join();
+	}
+}
+
+SCENARIO("Concurrent WeakMap is read while keys are added and destroyed")
+{
+	auto map = make_shared<ConcurrentWeakMap<Key, int, FlatMapStorage>>();
+	vector<shared_ptr<const Key>> stableKeys;
+	for (int i = 0; i < 64; ++i)
+	{
+		stableKeys.push_back(make_shared<Key>(i));
+		map->SetValue(stableKeys.back(), i);
+	}
+
+	// Catch assertions may not be used in other threads
+	atomic<bool> stop = false;
+	atomic<bool> mismatch = false;
+	vector<thread> readers;
+	for (int t = 0; t < 3; ++t)
+	{
+		readers.emplace_back([&] {
+			while (!stop)
+			{
+				for (auto& key : stableKeys)
+				{
+					if (map->TryGetValue(key).value_or(-1) != key->id)
+					{
+						mismatch = true;
+					}
+				}
+			}
+		});
+	}
+
+	for (int i = 0; i < 2000; ++i)
+	{
+		auto key = make_shared<Key>(i);
+		map->SetValue(key, -i);
+		if (map->TryGetValue(key).value_or(0) != -i)
+		{
+			mismatch = true;
+		}
+		if (i % 2)
+		{
+			map->RemoveValue(key);
+		}
+		map->SetValue(stableKeys[i % 64], i % 64);
+	}
+	stop = true;
+	for (auto& t : readers)
+	{
+		t.join();
+	}
+	CHECK(!mismatch);
+}
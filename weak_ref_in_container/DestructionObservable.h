@@ -0,0 +1,354 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace detail
+{
+
+// Bookkeeping which a DestructionObservable keeps on behalf of others, see WeakSlot
+class ObservableExtension
+{
+public:
+	virtual ~ObservableExtension() = default;
+};
+
+} // namespace detail
+
+// A base class which runs handlers when the object is destroyed.
+//
+// Handlers are kept in slots, INLINE_SLOT_COUNT of which live in the object itself, and the rest
+// in an overflow vector. A handler whose state fits into a slot is stored in it, so observing an
+// object by one or two small handlers doesn't allocate. Removing a handler frees its slot in O(1).
+//
+// Handlers of an object may be added and removed by several threads at once, and while the object
+// is being destroyed. The slots are guarded by a spin lock of the object, which is held only to
+// update them: handlers are constructed, destroyed and called without it.
+class DestructionObservable
+{
+	class Handler;
+
+public:
+	static constexpr uint32_t INLINE_SLOT_COUNT = 2;
+
+	// Identifies an added handler. Removing a handler by a stale subscription does nothing
+	class Subscription
+	{
+	public:
+		Subscription() = default;
+
+		explicit operator bool() const noexcept
+		{
+			return m_generation != 0;
+		}
+
+	private:
+		friend class DestructionObservable;
+
+		Subscription(uint32_t index, uint32_t generation) noexcept
+			: m_index(index)
+			, m_generation(generation)
+		{
+		}
+
+		uint32_t m_index = 0;
+		uint32_t m_generation = 0;
+	};
+
+	DestructionObservable() = default;
+
+	// Handlers observe a particular object, so they are neither copied nor overwritten
+	DestructionObservable(const DestructionObservable&) noexcept
+	{
+	}
+
+	DestructionObservable& operator=(const DestructionObservable&) noexcept
+	{
+		return *this;
+	}
+
+	template <typename Fn>
+	Subscription AddDestructionHandler(Fn&& fn) const
+	{
+		Handler handler;
+		handler.Emplace(std::forward<Fn>(fn));
+		std::lock_guard lock(m_lock);
+		const uint32_t index = AllocateSlot();
+		Slot& slot = GetSlot(index);
+		slot.handler = std::move(handler);
+		++m_handlerCount;
+		return { index, slot.generation };
+	}
+
+	// Does nothing if the handler has been removed or called. It may be called while the object
+	// is being destroyed by another thread, as long as the object is known to be valid
+	void RemoveDestructionHandler(Subscription subscription) const noexcept
+	{
+		// Destroyed after the lock is released
+		Handler handler;
+		std::lock_guard lock(m_lock);
+		if (!subscription || subscription.m_index >= GetSlotCount())
+		{
+			return;
+		}
+		Slot& slot = GetSlot(subscription.m_index);
+		if (slot.generation == subscription.m_generation && slot.handler)
+		{
+			handler = std::move(slot.handler);
+			FreeSlot(subscription.m_index);
+			--m_handlerCount;
+		}
+	}
+
+	size_t GetDestructionHandlerCount() const noexcept
+	{
+		std::lock_guard lock(m_lock);
+		return m_handlerCount;
+	}
+
+	// Returns the extension of the object, which is created by make() on the first call.
+	// The extension is destroyed after the destruction handlers have run. If several threads
+	// create it at once, one of the extensions is kept and the others are destroyed
+	template <typename Make>
+	detail::ObservableExtension& GetOrCreateExtension(Make&& make) const
+	{
+		if (auto* extension = m_extension.load(std::memory_order_acquire))
+		{
+			return *extension;
+		}
+		std::unique_ptr<detail::ObservableExtension> extension = make();
+		detail::ObservableExtension* current = nullptr;
+		if (m_extension.compare_exchange_strong(current, extension.get(), std::memory_order_acq_rel))
+		{
+			return *extension.release();
+		}
+		return *current;
+	}
+
+protected:
+	~DestructionObservable() noexcept
+	{
+		for (uint32_t i = 0;; ++i)
+		{
+			// The handler is taken out of its slot, since handlers may add or remove other handlers
+			Handler handler;
+			{
+				std::lock_guard lock(m_lock);
+				if (i >= GetSlotCount())
+				{
+					break;
+				}
+				Slot& slot = GetSlot(i);
+				if (!slot.handler)
+				{
+					continue;
+				}
+				handler = std::move(slot.handler);
+				FreeSlot(i);
+				--m_handlerCount;
+			}
+			try
+			{
+				handler();
+			}
+			catch (...)
+			{
+			}
+		}
+		delete m_extension.load(std::memory_order_acquire);
+	}
+
+private:
+	// A move-only type-erased void() callable which is stored inline if it fits the buffer
+	class Handler
+	{
+	public:
+		static constexpr size_t BUFFER_SIZE = 3 * sizeof(void*);
+
+		Handler() = default;
+
+		Handler(Handler&& other) noexcept
+		{
+			MoveFrom(other);
+		}
+
+		Handler& operator=(Handler&& other) noexcept
+		{
+			if (this != &other)
+			{
+				Reset();
+				MoveFrom(other);
+			}
+			return *this;
+		}
+
+		~Handler()
+		{
+			Reset();
+		}
+
+		template <typename Fn>
+		void Emplace(Fn&& fn)
+		{
+			using Decayed = std::decay_t<Fn>;
+			Reset();
+			if constexpr (IsStoredInline<Decayed>())
+			{
+				new (m_buffer) Decayed(std::forward<Fn>(fn));
+				m_ops = &InlineOps<Decayed>;
+			}
+			else
+			{
+				*reinterpret_cast<Decayed**>(m_buffer) = new Decayed(std::forward<Fn>(fn));
+				m_ops = &HeapOps<Decayed>;
+			}
+		}
+
+		void Reset() noexcept
+		{
+			if (m_ops)
+			{
+				m_ops->destroy(m_buffer);
+				m_ops = nullptr;
+			}
+		}
+
+		void operator()()
+		{
+			m_ops->invoke(m_buffer);
+		}
+
+		explicit operator bool() const noexcept
+		{
+			return m_ops != nullptr;
+		}
+
+	private:
+		struct Ops
+		{
+			void (*invoke)(void* buffer);
+			void (*relocate)(void* dst, void* src) noexcept;
+			void (*destroy)(void* buffer) noexcept;
+		};
+
+		template <typename Fn>
+		static constexpr bool IsStoredInline()
+		{
+			return sizeof(Fn) <= BUFFER_SIZE && alignof(Fn) <= alignof(void*)
+				&& std::is_nothrow_move_constructible_v<Fn>;
+		}
+
+		template <typename Fn>
+		static constexpr Ops InlineOps = {
+			[](void* buffer) { (*static_cast<Fn*>(buffer))(); },
+			[](void* dst, void* src) noexcept {
+				new (dst) Fn(std::move(*static_cast<Fn*>(src)));
+				static_cast<Fn*>(src)->~Fn();
+			},
+			[](void* buffer) noexcept { static_cast<Fn*>(buffer)->~Fn(); },
+		};
+
+		template <typename Fn>
+		static constexpr Ops HeapOps = {
+			[](void* buffer) { (**static_cast<Fn**>(buffer))(); },
+			[](void* dst, void* src) noexcept { *static_cast<Fn**>(dst) = *static_cast<Fn**>(src); },
+			[](void* buffer) noexcept { delete *static_cast<Fn**>(buffer); },
+		};
+
+		void MoveFrom(Handler& other) noexcept
+		{
+			if (other.m_ops)
+			{
+				other.m_ops->relocate(m_buffer, other.m_buffer);
+				m_ops = std::exchange(other.m_ops, nullptr);
+			}
+		}
+
+		alignas(void*) unsigned char m_buffer[BUFFER_SIZE];
+		const Ops* m_ops = nullptr;
+	};
+
+	static constexpr uint32_t NO_SLOT = UINT32_MAX;
+
+	// Contention is rare, since an object is observed by few handlers and they are added
+	// and removed briefly
+	class SpinLock
+	{
+	public:
+		void lock() noexcept
+		{
+			while (m_isLocked.exchange(true, std::memory_order_acquire))
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		void unlock() noexcept
+		{
+			m_isLocked.store(false, std::memory_order_release);
+		}
+
+	private:
+		std::atomic<bool> m_isLocked = false;
+	};
+
+	struct Slot
+	{
+		Handler handler;
+		// Changes every time the slot is freed, which makes subscriptions to the slot stale
+		uint32_t generation = 1;
+		uint32_t nextFree = NO_SLOT;
+	};
+
+	uint32_t GetSlotCount() const noexcept
+	{
+		return m_usedInlineSlotCount + static_cast<uint32_t>(m_overflowSlots.size());
+	}
+
+	Slot& GetSlot(uint32_t index) const noexcept
+	{
+		return index < INLINE_SLOT_COUNT ? m_inlineSlots[index] : m_overflowSlots[index - INLINE_SLOT_COUNT];
+	}
+
+	uint32_t AllocateSlot() const
+	{
+		if (m_freeSlot != NO_SLOT)
+		{
+			return std::exchange(m_freeSlot, GetSlot(m_freeSlot).nextFree);
+		}
+		if (m_usedInlineSlotCount < INLINE_SLOT_COUNT)
+		{
+			return m_usedInlineSlotCount++;
+		}
+		m_overflowSlots.emplace_back();
+		return INLINE_SLOT_COUNT + static_cast<uint32_t>(m_overflowSlots.size() - 1);
+	}
+
+	void FreeSlot(uint32_t index) const noexcept
+	{
+		Slot& slot = GetSlot(index);
+		if (++slot.generation == 0)
+		{
+			slot.generation = 1;
+		}
+		slot.nextFree = m_freeSlot;
+		m_freeSlot = index;
+	}
+
+	mutable Slot m_inlineSlots[INLINE_SLOT_COUNT];
+	mutable std::vector<Slot> m_overflowSlots;
+	mutable uint32_t m_usedInlineSlotCount = 0;
+	mutable uint32_t m_freeSlot = NO_SLOT;
+	mutable size_t m_handlerCount = 0;
+	// Guards the slots and the handler count
+	mutable SpinLock m_lock;
+	// Not copied along with the object, like handlers
+	mutable std::atomic<detail::ObservableExtension*> m_extension = nullptr;
+};
@@ -0,0 +1,135 @@
+#include "pch.h"
+#include "DestructionObservable.h"
+
+using namespace std;
+
+namespace
+{
+
+struct Observable : DestructionObservable
+{
+};
+
+struct Extension : detail::ObservableExtension
+{
+	explicit Extension(vector<int>& calls)
+		: calls(calls)
+	{
+	}
+	~Extension()
+	{
+		calls.push_back(0);
+	}
+	vector<int>& calls;
+};
+
+} // namespace
+
+SCENARIO("Destruction handlers")
+{
+	vector<int> calls;
+	auto observable = make_unique<Observable>();
+
+	WHEN("handlers are added")
+	{
+		for (int i = 0; i < 5; ++i)
+		{
+			observable->AddDestructionHandler([&calls, i] {
+				calls.push_back(i);
+			});
+		}
+		THEN("they are all called on destruction")
+		{
+			CHECK(observable->GetDestructionHandlerCount() == 5);
+			observable.reset();
+			sort(calls.begin(), calls.end());
+			CHECK(calls == vector<int>{ 0, 1, 2, 3, 4 });
+		}
+	}
+
+	WHEN("handlers are removed")
+	{
+		auto inlineHandler = observable->AddDestructionHandler([&calls] { calls.push_back(1); });
+		observable->AddDestructionHandler([&calls] { calls.push_back(2); });
+		auto overflowHandler = observable->AddDestructionHandler([&calls] { calls.push_back(3); });
+		observable->RemoveDestructionHandler(inlineHandler);
+		observable->RemoveDestructionHandler(overflowHandler);
+		THEN("they are not called")
+		{
+			CHECK(observable->GetDestructionHandlerCount() == 1);
+			observable.reset();
+			CHECK(calls == vector<int>{ 2 });
+		}
+	}
+
+	WHEN("a slot of a removed handler is reused")
+	{
+		auto stale = observable->AddDestructionHandler([&calls] { calls.push_back(1); });
+		observable->RemoveDestructionHandler(stale);
+		observable->AddDestructionHandler([&calls] { calls.push_back(2); });
+		THEN("removing by a stale subscription does nothing")
+		{
+			observable->RemoveDestructionHandler(stale);
+			observable->RemoveDestructionHandler({});
+			observable.reset();
+			CHECK(calls == vector<int>{ 2 });
+		}
+	}
+
+	WHEN("a handler doesn't fit a slot")
+	{
+		array<int, 16> state{};
+		state.fill(7);
+		observable->AddDestructionHandler([&calls, state] { calls.push_back(state.back()); });
+		THEN("it is still called")
+		{
+			observable.reset();
+			CHECK(calls == vector<int>{ 7 });
+		}
+	}
+
+	WHEN("a handler removes another handler")
+	{
+		DestructionObservable::Subscription second;
+		observable->AddDestructionHandler([&calls, &second, o = observable.get()] {
+			calls.push_back(1);
+			o->RemoveDestructionHandler(second);
+		});
+		second = observable->AddDestructionHandler([&calls] { calls.push_back(2); });
+		THEN("the removed handler is not called")
+		{
+			observable.reset();
+			CHECK(calls == vector<int>{ 1 });
+		}
+	}
+
+	WHEN("an observable is copied")
+	{
+		observable->AddDestructionHandler([&calls] { calls.push_back(1); });
+		auto copy = make_unique<Observable>(*observable);
+		THEN("the copy has no handlers")
+		{
+			CHECK(copy->GetDestructionHandlerCount() == 0);
+			copy.reset();
+			CHECK(calls.empty());
+		}
+	}
+
+	WHEN("an observable has an extension")
+	{
+		int createdCount = 0;
+		auto makeExtension = [&] {
+			++createdCount;
+			return make_unique<Extension>(calls);
+		};
+		auto& extension = observable->GetOrCreateExtension(makeExtension);
+		observable->AddDestructionHandler([&calls] { calls.push_back(1); });
+		THEN("it is created once and destroyed after the handlers")
+		{
+			CHECK(&observable->GetOrCreateExtension(makeExtension) == &extension);
+			CHECK(createdCount == 1);
+			observable.reset();
+			CHECK(calls == vector<int>{ 1, 0 });
+		}
+	}
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <memory>
+
+namespace detail
+{
+
+// A lock-free list of keys whose cache items have expired. Keys may be pushed from any
+// thread, for instance from the deleter of a value released by another thread, while
+// the cache consumes them in batches
+template <typename Key>
+class ExpiredKeyList
+{
+	struct Node;
+
+public:
+	// Pushes its key to the list when it is called. The node of the key is allocated when the pusher
+	// is created or copied, so calling it from a deleter neither allocates nor throws.
+	// A pusher pushes its key once, later calls do nothing
+	class Pusher
+	{
+	public:
+		Pusher(std::shared_ptr<ExpiredKeyList> list, const Key& key)
+			: m_list(std::move(list))
+			, m_node(new Node{ key, nullptr })
+		{
+		}
+
+		Pusher(const Pusher& other)
+			: m_list(other.m_list)
+			, m_node(other.m_node ? new Node{ other.m_node->key, nullptr } : nullptr)
+		{
+		}
+
+		Pusher(Pusher&&) noexcept = default;
+		Pusher& operator=(const Pusher&) = delete;
+		Pusher& operator=(Pusher&&) = delete;
+
+		// Const, since cleaners are called through const std::function
+		void operator()() const noexcept
+		{
+			if (m_node)
+			{
+				m_list->Push(std::move(m_node));
+			}
+		}
+
+	private:
+		std::shared_ptr<ExpiredKeyList> m_list;
+		mutable std::unique_ptr<Node> m_node;
+	};
+
+	ExpiredKeyList() = default;
+	ExpiredKeyList(const ExpiredKeyList&) = delete;
+	ExpiredKeyList& operator=(const ExpiredKeyList&) = delete;
+
+	~ExpiredKeyList()
+	{
+		DeleteNodes(m_head.load(std::memory_order_acquire));
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		return m_head.load(std::memory_order_relaxed) == nullptr;
+	}
+
+	// Detaches all the keys pushed so far and passes them to fn one by one
+	template <typename Fn>
+	void Consume(Fn&& fn)
+	{
+		Node* node = m_head.exchange(nullptr, std::memory_order_acquire);
+		while (node)
+		{
+			std::unique_ptr<Node> current(node);
+			node = node->next;
+			try
+			{
+				fn(current->key);
+			}
+			catch (...)
+			{
+				DeleteNodes(node);
+				throw;
+			}
+		}
+	}
+
+private:
+	struct Node
+	{
+		Key key;
+		Node* next;
+	};
+
+	// Links a node allocated by a Pusher
+	void Push(std::unique_ptr<Node> ownedNode) noexcept
+	{
+		Node* node = ownedNode.release();
+		node->next = m_head.load(std::memory_order_relaxed);
+		while (!m_head.compare_exchange_weak(node->next, node,
+			std::memory_order_release, std::memory_order_relaxed))
+		{
+		}
+	}
+
+	static void DeleteNodes(Node* node) noexcept
+	{
+		while (node)
+		{
+			std::unique_ptr<Node> current(node);
+			node = node->next;
+		}
+	}
+
+	std::atomic<Node*> m_head = nullptr;
+};
+
+} // namespace detail
@@ -0,0 +1,211 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <vector>
+
+// A CacheT flavour which does not allocate anything but the cached value itself.
+//
+// The factory is a template parameter, so it is called directly instead of through
+// std::function. Everything the cache needs to know about a value (its key, hash,
+// hash chain link and owner) lives in the same block as the value and its control
+// block, which is obtained with a single std::allocate_shared call. The "cleaner" is
+// the destructor of that block: it unlinks the node from the cache it belongs to.
+//
+// The factory is called as factory(key) and must return Val (or something Val can be
+// constructed from).
+//
+// Unlike CacheT, FastCacheT is not thread-safe. Releasing the last reference to a value
+// unlinks its node from the cache without any locking, so the cache and every value it
+// has handed out must be used and released on one thread. Use CacheT to share a cache
+// between threads.
+template <typename Key, typename Val, typename Factory,
+	typename Hasher = std::hash<Key>, typename KeyEq = std::equal_to<Key>,
+	typename Alloc = std::allocator<Val>>
+class FastCacheT
+{
+	struct Node;
+
+public:
+	using ValuePtr = std::shared_ptr<Val>;
+
+	explicit FastCacheT(Factory factory = Factory(), const Alloc& alloc = Alloc())
+		: m_factory(std::move(factory))
+		, m_alloc(alloc)
+	{
+	}
+
+	FastCacheT(const FastCacheT&) = delete;
+	FastCacheT& operator=(const FastCacheT&) = delete;
+
+	~FastCacheT()
+	{
+		// Values may outlive the cache. Detach them, so that they don't try to unlink
+		// themselves from the destroyed cache
+		for (Node* node : m_buckets)
+		{
+			for (; node; node = node->next)
+			{
+				node->owner = nullptr;
+			}
+		}
+	}
+
+	ValuePtr GetValue(const Key& key) const
+	{
+		const size_t hash = m_hasher(key);
+		if (Node* node = Find(key, hash))
+		{
+			// A node is unlinked by its destructor, so a linked node is always alive
+			auto owner = node->weak_from_this().lock();
+			assert(owner);
+			return ValuePtr(std::move(owner), &node->value);
+		}
+
+		// Growing the buckets may throw, so it is done before there is a node whose destructor
+		// would unlink it
+		GrowIfFull();
+		auto node = std::allocate_shared<Node>(NodeAlloc(m_alloc), this, key, hash, m_factory);
+		Link(*node);
+		auto valuePtr = &node->value;
+		return ValuePtr(std::move(node), valuePtr);
+	}
+
+	// Preallocates hash buckets for the given number of values
+	void Reserve(size_t count)
+	{
+		size_t bucketCount = 8;
+		while (bucketCount < count)
+		{
+			bucketCount *= 2;
+		}
+		if (bucketCount > m_buckets.size())
+		{
+			Rehash(bucketCount);
+		}
+	}
+
+	size_t GetSize() const noexcept
+	{
+		return m_size;
+	}
+
+private:
+	using NodeAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Node>;
+	using BucketAlloc = typename std::allocator_traits<Alloc>::template rebind_alloc<Node*>;
+
+	struct Node : std::enable_shared_from_this<Node>
+	{
+		Node(const FastCacheT* owner, const Key& key, size_t hash, Factory& factory)
+			: owner(owner)
+			, hash(hash)
+			, key(key)
+			, value(factory(this->key))
+		{
+		}
+
+		Node(const Node&) = delete;
+		Node& operator=(const Node&) = delete;
+
+		~Node()
+		{
+			if (owner)
+			{
+				owner->Unlink(*this);
+			}
+		}
+
+		const FastCacheT* owner;
+		Node* next = nullptr;
+		const size_t hash;
+		const Key key;
+		Val value;
+	};
+
+	size_t GetBucketIndex(size_t hash) const noexcept
+	{
+		// Fibonacci hashing spreads identity hashes (integers, pointers) over
+		// power of two bucket counts
+		return static_cast<size_t>((uint64_t(hash) * 0x9E3779B97F4A7C15ull) >> (64 - m_bucketBits));
+	}
+
+	Node* Find(const Key& key, size_t hash) const
+	{
+		if (m_buckets.empty())
+		{
+			return nullptr;
+		}
+		for (Node* node = m_buckets[GetBucketIndex(hash)]; node; node = node->next)
+		{
+			if (node->hash == hash && m_keyEq(node->key, key))
+			{
+				return node;
+			}
+		}
+		return nullptr;
+	}
+
+	void GrowIfFull() const
+	{
+		if (m_size + 1 > m_buckets.size())
+		{
+			Rehash(m_buckets.empty() ? 8 : m_buckets.size() * 2);
+		}
+	}
+
+	// There must be a bucket for the node, see GrowIfFull
+	void Link(Node& node) const noexcept
+	{
+		assert(m_size < m_buckets.size());
+		auto& head = m_buckets[GetBucketIndex(node.hash)];
+		node.next = head;
+		head = &node;
+		++m_size;
+	}
+
+	void Unlink(Node& node) const noexcept
+	{
+		for (Node** link = &m_buckets[GetBucketIndex(node.hash)]; *link; link = &(*link)->next)
+		{
+			if (*link == &node)
+			{
+				*link = node.next;
+				--m_size;
+				return;
+			}
+		}
+		assert(!"node is not linked");
+	}
+
+	void Rehash(size_t bucketCount) const
+	{
+		std::vector<Node*, BucketAlloc> buckets(bucketCount, nullptr, BucketAlloc(m_alloc));
+		buckets.swap(m_buckets);
+		m_bucketBits = 0;
+		while ((size_t(1) << m_bucketBits) < bucketCount)
+		{
+			++m_bucketBits;
+		}
+		for (Node* node : buckets)
+		{
+			while (node)
+			{
+				Node* next = node->next;
+				auto& head = m_buckets[GetBucketIndex(node->hash)];
+				node->next = head;
+				head = node;
+				node = next;
+			}
+		}
+	}
+
+	mutable std::vector<Node*, BucketAlloc> m_buckets;
+	mutable unsigned m_bucketBits = 0;
+	mutable size_t m_size = 0;
+	mutable Factory m_factory;
+	Alloc m_alloc;
+	Hasher m_hasher;
+	KeyEq m_keyEq;
+};
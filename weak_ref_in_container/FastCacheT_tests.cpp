@@ -0,0 +1,205 @@
+#include "pch.h"
+#include "FastCacheT.h"
+
+using namespace std;
+
+namespace
+{
+
+size_t g_allocationCount = 0;
+bool g_isArrayAllocationFailing = false;
+
+// Counts the allocations made through the allocators of a cache. Allocations of more than one
+// object, which are the buckets, fail while g_isArrayAllocationFailing is set
+template <typename T>
+struct CountingAllocator
+{
+	using value_type = T;
+
+	CountingAllocator() = default;
+
+	template <typename U>
+	CountingAllocator(const CountingAllocator<U>&) noexcept
+	{
+	}
+
+	T* allocate(size_t count)
+	{
+		if (count > 1 && g_isArrayAllocationFailing)
+		{
+			throw bad_alloc();
+		}
+		++g_allocationCount;
+		return allocator<T>().allocate(count);
+	}
+
+	void deallocate(T* p, size_t count) noexcept
+	{
+		allocator<T>().deallocate(p, count);
+	}
+
+	template <typename U>
+	bool operator==(const CountingAllocator<U>&) const noexcept
+	{
+		return true;
+	}
+
+	template <typename U>
+	bool operator!=(const CountingAllocator<U>&) const noexcept
+	{
+		return false;
+	}
+};
+
+class AllocationCounter
+{
+public:
+	size_t GetCount() const
+	{
+		return g_allocationCount - m_start;
+	}
+
+private:
+	size_t m_start = g_allocationCount;
+};
+
+struct Payload
+{
+	explicit Payload(int value)
+		: value(value)
+	{
+	}
+	int value;
+};
+
+struct PayloadFactory
+{
+	Payload operator()(int key)
+	{
+		++callCount;
+		return Payload(key * 10);
+	}
+	int callCount = 0;
+};
+
+using PayloadCache = FastCacheT<int, Payload, PayloadFactory, hash<int>, equal_to<int>, CountingAllocator<Payload>>;
+
+} // namespace
+
+SCENARIO("FastCacheT makes a single allocation per miss")
+{
+	PayloadCache cache;
+	cache.Reserve(100);
+
+	vector<PayloadCache::ValuePtr> values;
+	values.reserve(100);
+
+	AllocationCounter counter;
+	for (int i = 0; i < 100; ++i)
+	{
+		values.push_back(cache.GetValue(i));
+	}
+	auto missAllocations = counter.GetCount();
+
+	AllocationCounter hitCounter;
+	auto hit = cache.GetValue(42);
+	auto hitAllocations = hitCounter.GetCount();
+
+	CHECK(missAllocations == 100);
+	CHECK(hitAllocations == 0);
+	CHECK(hit == values[42]);
+	CHECK(hit->value == 420);
+}
+
+SCENARIO("FastCacheT value lifetime")
+{
+	GIVEN("a cache")
+	{
+		PayloadCache cache;
+
+		WHEN("a value is requested twice while it is in use")
+		{
+			auto v1 = cache.GetValue(1);
+			auto v1_1 = cache.GetValue(1);
+			THEN("the same value is returned")
+			{
+				CHECK(v1 == v1_1);
+				CHECK(v1->value == 10);
+				CHECK(cache.GetSize() == 1);
+			}
+		}
+
+		WHEN("all holders of a value are gone")
+		{
+			auto v1 = cache.GetValue(1);
+			auto v2 = cache.GetValue(2);
+			v1.reset();
+			THEN("the value is removed from the cache")
+			{
+				CHECK(cache.GetSize() == 1);
+				CHECK(cache.GetValue(2) == v2);
+			}
+		}
+
+		WHEN("many values are added and released")
+		{
+			vector<PayloadCache::ValuePtr> values;
+			for (int i = 0; i < 1000; ++i)
+			{
+				values.push_back(cache.GetValue(i));
+			}
+			for (int i = 0; i < 1000; i += 2)
+			{
+				values[i].reset();
+			}
+			THEN("only the values in use remain in the cache")
+			{
+				CHECK(cache.GetSize() == 500);
+				for (int i = 1; i < 1000; i += 2)
+				{
+					REQUIRE(cache.GetValue(i) == values[i]);
+				}
+			}
+		}
+	}
+
+	GIVEN("a full cache whose buckets can't grow")
+	{
+		PayloadCache cache;
+		vector<PayloadCache::ValuePtr> values;
+		for (int i = 0; i < 8; ++i)
+		{
+			values.push_back(cache.GetValue(i));
+		}
+
+		WHEN("a value is requested")
+		{
+			g_isArrayAllocationFailing = true;
+			CHECK_THROWS_AS(cache.GetValue(8), bad_alloc);
+			g_isArrayAllocationFailing = false;
+
+			THEN("the cache is left unchanged and usable")
+			{
+				CHECK(cache.GetSize() == 8);
+				CHECK(cache.GetValue(3) == values[3]);
+				CHECK(cache.GetValue(8)->value == 80);
+				values.clear();
+				CHECK(cache.GetSize() == 0);
+			}
+		}
+	}
+
+	GIVEN("a value which outlives its cache")
+	{
+		PayloadCache::ValuePtr value;
+		{
+			PayloadCache cache;
+			value = cache.GetValue(5);
+		}
+		THEN("it can be safely used and destroyed")
+		{
+			CHECK(value->value == 50);
+			value.reset();
+		}
+	}
+}
@@ -0,0 +1,766 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <tuple>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define FLAT_HASH_MAP_USE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace detail
+{
+
+// Control bytes of FlatHashMap slots. Full slots store 7 low bits of the hash (H2),
+// so the top bit distinguishes them from the special values
+using CtrlByte = signed char;
+constexpr CtrlByte CTRL_EMPTY = -128; // 0b10000000
+constexpr CtrlByte CTRL_DELETED = -2; // 0b11111110
+constexpr CtrlByte CTRL_SENTINEL = -1; // 0b11111111
+
+constexpr size_t GROUP_WIDTH = 16;
+
+inline unsigned CountTrailingZeros(uint32_t mask) noexcept
+{
+	assert(mask != 0);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return index;
+#else
+	return static_cast<unsigned>(__builtin_ctz(mask));
+#endif
+}
+
+inline unsigned CountLeadingZeros16(uint32_t mask) noexcept
+{
+	assert(mask != 0 && mask <= 0xFFFF);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse(&index, mask);
+	return 15 - index;
+#else
+	return static_cast<unsigned>(__builtin_clz(mask)) - 16;
+#endif
+}
+
+// A set of slot positions within a group. Iterating over it yields the positions
+// in ascending order
+class GroupMask
+{
+public:
+	explicit GroupMask(uint32_t mask) noexcept
+		: m_mask(mask)
+	{
+	}
+
+	explicit operator bool() const noexcept
+	{
+		return m_mask != 0;
+	}
+
+	unsigned LowestBit() const noexcept
+	{
+		return CountTrailingZeros(m_mask);
+	}
+
+	unsigned TrailingZeros() const noexcept
+	{
+		return m_mask ? CountTrailingZeros(m_mask) : unsigned(GROUP_WIDTH);
+	}
+
+	unsigned LeadingZeros() const noexcept
+	{
+		return m_mask ? CountLeadingZeros16(m_mask) : unsigned(GROUP_WIDTH);
+	}
+
+	GroupMask& operator++() noexcept
+	{
+		m_mask &= m_mask - 1;
+		return *this;
+	}
+
+	unsigned operator*() const noexcept
+	{
+		return LowestBit();
+	}
+
+	GroupMask begin() const noexcept
+	{
+		return *this;
+	}
+
+	GroupMask end() const noexcept
+	{
+		return GroupMask(0);
+	}
+
+	bool operator!=(const GroupMask& rhs) const noexcept
+	{
+		return m_mask != rhs.m_mask;
+	}
+
+private:
+	uint32_t m_mask;
+};
+
+// GROUP_WIDTH control bytes which are matched at once
+class Group
+{
+public:
+#ifdef FLAT_HASH_MAP_USE_SSE2
+	explicit Group(const CtrlByte* pos) noexcept
+		: m_ctrl(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos)))
+	{
+	}
+
+	GroupMask Match(CtrlByte h2) const noexcept
+	{
+		return MaskOf(_mm_cmpeq_epi8(_mm_set1_epi8(h2), m_ctrl));
+	}
+
+	GroupMask MatchEmpty() const noexcept
+	{
+		return Match(CTRL_EMPTY);
+	}
+
+	GroupMask MatchEmptyOrDeleted() const noexcept
+	{
+		return MaskOf(_mm_cmpgt_epi8(_mm_set1_epi8(CTRL_SENTINEL), m_ctrl));
+	}
+
+private:
+	static GroupMask MaskOf(__m128i match) noexcept
+	{
+		return GroupMask(static_cast<uint32_t>(_mm_movemask_epi8(match)));
+	}
+
+	__m128i m_ctrl;
+#else
+	explicit Group(const CtrlByte* pos) noexcept
+		: m_pos(pos)
+	{
+	}
+
+	GroupMask Match(CtrlByte h2) const noexcept
+	{
+		uint32_t mask = 0;
+		for (size_t i = 0; i < GROUP_WIDTH; ++i)
+		{
+			mask |= uint32_t(m_pos[i] == h2) << i;
+		}
+		return GroupMask(mask);
+	}
+
+	GroupMask MatchEmpty() const noexcept
+	{
+		return Match(CTRL_EMPTY);
+	}
+
+	GroupMask MatchEmptyOrDeleted() const noexcept
+	{
+		uint32_t mask = 0;
+		for (size_t i = 0; i < GROUP_WIDTH; ++i)
+		{
+			mask |= uint32_t(m_pos[i] < CTRL_SENTINEL) << i;
+		}
+		return GroupMask(mask);
+	}
+
+private:
+	const CtrlByte* m_pos;
+#endif
+};
+
+inline size_t MixHash(size_t hash) noexcept
+{
+	// std::hash of integers and pointers is the identity. Spread the entropy over all bits,
+	// so that both the probe start (H1) and the control byte (H2) get their share
+	uint64_t h = uint64_t(hash) * 0x9E3779B97F4A7C15ull;
+	return static_cast<size_t>(h ^ (h >> 32));
+}
+
+// Asks the CPU to start loading the cache line at p. Has no observable effect
+inline void Prefetch(const void* p) noexcept
+{
+#if defined(FLAT_HASH_MAP_USE_SSE2)
+	_mm_prefetch(static_cast<const char*>(p), _MM_HINT_T0);
+#elif defined(__GNUC__)
+	__builtin_prefetch(p);
+#else
+	(void)p;
+#endif
+}
+
+} // namespace detail
+
+// An open addressing hash map with SIMD probing of slot metadata (the "Swiss table" layout).
+//
+// Every slot has a one-byte control code, and GROUP_WIDTH codes are matched against the hash
+// with a single SSE2 compare, so a typical miss touches a single cache line of metadata.
+// Elements are stored inline, without a per-element allocation.
+//
+// Erasure never moves other elements and never shrinks the table: iterators and references
+// to other elements stay valid, so erase may be safely called by cleaners which run in the
+// middle of another operation. Erased slots become tombstones when a probe sequence might
+// pass through them, and tombstones are purged on the next growth. Only shrink_to_fit
+// shrinks the table.
+template <typename Key, typename Val, typename Hasher = std::hash<Key>, typename KeyEq = std::equal_to<Key>>
+class FlatHashMap
+{
+	template <typename MapPtr, typename ValueType>
+	class Iterator;
+
+public:
+	using key_type = Key;
+	using mapped_type = Val;
+	using value_type = std::pair<const Key, Val>;
+	using size_type = size_t;
+	using hasher = Hasher;
+	using key_equal = KeyEq;
+	using iterator = Iterator<FlatHashMap*, value_type>;
+	using const_iterator = Iterator<const FlatHashMap*, const value_type>;
+
+	FlatHashMap() = default;
+
+	FlatHashMap(const FlatHashMap& other)
+		: m_hasher(other.m_hasher)
+		, m_keyEq(other.m_keyEq)
+	{
+		reserve(other.size());
+		for (auto& item : other)
+		{
+			InsertUnique(item.first, item.second);
+		}
+	}
+
+	FlatHashMap(FlatHashMap&& other) noexcept
+		: m_ctrl(std::exchange(other.m_ctrl, EmptyGroup()))
+		, m_slots(std::exchange(other.m_slots, nullptr))
+		, m_capacity(std::exchange(other.m_capacity, 0))
+		, m_size(std::exchange(other.m_size, 0))
+		, m_growthLeft(std::exchange(other.m_growthLeft, 0))
+		, m_hasher(other.m_hasher)
+		, m_keyEq(other.m_keyEq)
+	{
+	}
+
+	FlatHashMap& operator=(const FlatHashMap& rhs)
+	{
+		if (this != &rhs)
+		{
+			FlatHashMap(rhs).swap(*this);
+		}
+		return *this;
+	}
+
+	FlatHashMap& operator=(FlatHashMap&& rhs) noexcept
+	{
+		FlatHashMap(std::move(rhs)).swap(*this);
+		return *this;
+	}
+
+	~FlatHashMap()
+	{
+		DestroySlots();
+		Deallocate(m_ctrl, m_slots, m_capacity);
+	}
+
+	void swap(FlatHashMap& other) noexcept
+	{
+		std::swap(m_ctrl, other.m_ctrl);
+		std::swap(m_slots, other.m_slots);
+		std::swap(m_capacity, other.m_capacity);
+		std::swap(m_size, other.m_size);
+		std::swap(m_growthLeft, other.m_growthLeft);
+		std::swap(m_hasher, other.m_hasher);
+		std::swap(m_keyEq, other.m_keyEq);
+	}
+
+	iterator begin() noexcept
+	{
+		return { this, SkipEmpty(0) };
+	}
+
+	iterator end() noexcept
+	{
+		return { this, m_capacity };
+	}
+
+	const_iterator begin() const noexcept
+	{
+		return { this, SkipEmpty(0) };
+	}
+
+	const_iterator end() const noexcept
+	{
+		return { this, m_capacity };
+	}
+
+	size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+	bool empty() const noexcept
+	{
+		return m_size == 0;
+	}
+
+	// The number of slots
+	size_t capacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+	iterator find(const Key& key)
+	{
+		return { this, FindIndex(key, m_hasher(key)) };
+	}
+
+	const_iterator find(const Key& key) const
+	{
+		return { this, FindIndex(key, m_hasher(key)) };
+	}
+
+	// Lookups by a hash which has been computed with hash_function() beforehand
+	iterator find(const Key& key, size_t hash)
+	{
+		return { this, FindIndex(key, hash) };
+	}
+
+	const_iterator find(const Key& key, size_t hash) const
+	{
+		return { this, FindIndex(key, hash) };
+	}
+
+	// Starts loading the control bytes and slots a lookup of the hash starts from, so that
+	// lookups of a batch of keys may wait for their cache misses in parallel
+	void prefetch(size_t hash) const noexcept
+	{
+		if (m_capacity)
+		{
+			const size_t index = H1(detail::MixHash(hash)) & (m_capacity - 1);
+			detail::Prefetch(m_ctrl + index);
+			detail::Prefetch(m_slots + index);
+		}
+	}
+
+	hasher hash_function() const
+	{
+		return m_hasher;
+	}
+
+	size_t count(const Key& key) const
+	{
+		return find(key) != end() ? 1 : 0;
+	}
+
+	template <typename... Args>
+	std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args)
+	{
+		const size_t hash = m_hasher(key);
+		if (auto index = FindIndex(key, hash); index != m_capacity)
+		{
+			return { { this, index }, false };
+		}
+		auto index = PrepareInsert(hash);
+		new (m_slots + index) value_type(std::piecewise_construct,
+			std::forward_as_tuple(key), std::forward_as_tuple(std::forward<Args>(args)...));
+		CommitInsert(index, hash);
+		return { { this, index }, true };
+	}
+
+	template <typename V>
+	std::pair<iterator, bool> emplace(const Key& key, V&& value)
+	{
+		return try_emplace(key, std::forward<V>(value));
+	}
+
+	template <typename V>
+	std::pair<iterator, bool> insert_or_assign(const Key& key, V&& value)
+	{
+		auto result = try_emplace(key, std::forward<V>(value));
+		if (!result.second)
+		{
+			result.first->second = std::forward<V>(value);
+		}
+		return result;
+	}
+
+	Val& operator[](const Key& key)
+	{
+		return try_emplace(key).first->second;
+	}
+
+	size_t erase(const Key& key)
+	{
+		auto index = FindIndex(key, m_hasher(key));
+		if (index == m_capacity)
+		{
+			return 0;
+		}
+		EraseAt(index);
+		return 1;
+	}
+
+	iterator erase(const_iterator pos)
+	{
+		assert(pos.m_map == this && pos.m_index < m_capacity);
+		EraseAt(pos.m_index);
+		return { this, SkipEmpty(pos.m_index + 1) };
+	}
+
+	iterator erase(iterator pos)
+	{
+		return erase(const_iterator(pos));
+	}
+
+	void clear() noexcept
+	{
+		DestroySlots();
+		if (m_capacity)
+		{
+			std::fill_n(m_ctrl, m_capacity + detail::GROUP_WIDTH, detail::CTRL_EMPTY);
+		}
+		m_size = 0;
+		m_growthLeft = MaxLoad(m_capacity);
+	}
+
+	// Rehashes the elements into the smallest table which holds them, purging tombstones.
+	// Frees the table if there are no elements
+	void shrink_to_fit()
+	{
+		if (m_size == 0)
+		{
+			FlatHashMap().swap(*this);
+			return;
+		}
+		size_t capacity = detail::GROUP_WIDTH;
+		while (MaxLoad(capacity) < m_size)
+		{
+			capacity *= 2;
+		}
+		if (capacity < m_capacity || m_size + m_growthLeft < MaxLoad(m_capacity))
+		{
+			Rehash(capacity);
+		}
+	}
+
+	// The memory of the table, which holds the elements and their control bytes
+	size_t allocated_bytes() const noexcept
+	{
+		return m_capacity ? m_capacity * sizeof(value_type) + m_capacity + detail::GROUP_WIDTH : 0;
+	}
+
+	// Makes room for count elements without rehashing. It also purges tombstones
+	void reserve(size_t count)
+	{
+		size_t capacity = detail::GROUP_WIDTH;
+		while (MaxLoad(capacity) < count)
+		{
+			capacity *= 2;
+		}
+		if (capacity > m_capacity || m_size + m_growthLeft < MaxLoad(m_capacity))
+		{
+			Rehash(std::max(capacity, m_capacity));
+		}
+	}
+
+private:
+	template <typename MapPtr, typename ValueType>
+	class Iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = typename FlatHashMap::value_type;
+		using difference_type = ptrdiff_t;
+		using pointer = ValueType*;
+		using reference = ValueType&;
+
+		Iterator() = default;
+
+		template <typename OtherMapPtr, typename OtherValueType,
+			typename = std::enable_if_t<std::is_convertible_v<OtherMapPtr, MapPtr>>>
+		Iterator(const Iterator<OtherMapPtr, OtherValueType>& other) noexcept
+			: m_map(other.m_map)
+			, m_index(other.m_index)
+		{
+		}
+
+		reference operator*() const noexcept
+		{
+			return m_map->m_slots[m_index];
+		}
+
+		pointer operator->() const noexcept
+		{
+			return m_map->m_slots + m_index;
+		}
+
+		Iterator& operator++() noexcept
+		{
+			m_index = m_map->SkipEmpty(m_index + 1);
+			return *this;
+		}
+
+		Iterator operator++(int) noexcept
+		{
+			auto tmp = *this;
+			++*this;
+			return tmp;
+		}
+
+		bool operator==(const Iterator& rhs) const noexcept
+		{
+			return m_index == rhs.m_index;
+		}
+
+		bool operator!=(const Iterator& rhs) const noexcept
+		{
+			return m_index != rhs.m_index;
+		}
+
+	private:
+		friend class FlatHashMap;
+		template <typename, typename>
+		friend class Iterator;
+
+		Iterator(MapPtr map, size_t index) noexcept
+			: m_map(map)
+			, m_index(index)
+		{
+		}
+
+		MapPtr m_map = nullptr;
+		size_t m_index = 0;
+	};
+
+	static detail::CtrlByte* EmptyGroup() noexcept
+	{
+		// Lets lookups in a never allocated table run the regular probing code
+		alignas(16) static const detail::CtrlByte emptyGroup[detail::GROUP_WIDTH] = {
+			detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY,
+			detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY,
+			detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY,
+			detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY, detail::CTRL_EMPTY
+		};
+		return const_cast<detail::CtrlByte*>(emptyGroup);
+	}
+
+	static size_t MaxLoad(size_t capacity) noexcept
+	{
+		return capacity - capacity / 8;
+	}
+
+	static size_t H1(size_t hash) noexcept
+	{
+		return hash >> 7;
+	}
+
+	static detail::CtrlByte H2(size_t hash) noexcept
+	{
+		return static_cast<detail::CtrlByte>(hash & 0x7F);
+	}
+
+	size_t SkipEmpty(size_t index) const noexcept
+	{
+		while (index < m_capacity && m_ctrl[index] < 0)
+		{
+			++index;
+		}
+		return index;
+	}
+
+	// Visits group positions h1, h1 + 16, h1 + 16 + 32, ... (triangular numbers of groups),
+	// which covers every group of a power of two table
+	template <typename Fn>
+	size_t Probe(size_t hash, Fn&& fn) const
+	{
+		const size_t mask = m_capacity - 1;
+		size_t pos = H1(hash) & mask;
+		for (size_t step = detail::GROUP_WIDTH;; step += detail::GROUP_WIDTH)
+		{
+			if (auto index = fn(pos, detail::Group(m_ctrl + pos)); index != SIZE_MAX)
+			{
+				return index;
+			}
+			pos = (pos + step) & mask;
+		}
+	}
+
+	size_t FindIndex(const Key& key, size_t userHash) const
+	{
+		if (m_size == 0)
+		{
+			return m_capacity;
+		}
+		const size_t hash = detail::MixHash(userHash);
+		const size_t mask = m_capacity - 1;
+		return Probe(hash, [&](size_t pos, const detail::Group& group) {
+			for (auto i : group.Match(H2(hash)))
+			{
+				size_t index = (pos + i) & mask;
+				if (m_keyEq(m_slots[index].first, key))
+				{
+					return index;
+				}
+			}
+			return group.MatchEmpty() ? m_capacity : SIZE_MAX;
+		});
+	}
+
+	size_t FindFirstNonFull(size_t hash) const noexcept
+	{
+		const size_t mask = m_capacity - 1;
+		return Probe(hash, [&](size_t pos, const detail::Group& group) {
+			if (auto free = group.MatchEmptyOrDeleted())
+			{
+				return (pos + free.LowestBit()) & mask;
+			}
+			return SIZE_MAX;
+		});
+	}
+
+	void SetCtrl(size_t index, detail::CtrlByte ctrl) noexcept
+	{
+		m_ctrl[index] = ctrl;
+		// The first group is mirrored after the end, so that groups can be loaded at any position
+		if (index < detail::GROUP_WIDTH)
+		{
+			m_ctrl[m_capacity + index] = ctrl;
+		}
+	}
+
+	// Returns the index of a free slot for a new element with the given user hash. The slot is taken
+	// by CommitInsert after the element is constructed in it, so that the map is left without
+	// the element if its constructor throws
+	size_t PrepareInsert(size_t userHash)
+	{
+		const size_t hash = detail::MixHash(userHash);
+		if (m_capacity == 0)
+		{
+			Rehash(detail::GROUP_WIDTH);
+		}
+		size_t index = FindFirstNonFull(hash);
+		if (m_growthLeft == 0 && m_ctrl[index] != detail::CTRL_DELETED)
+		{
+			// Rehash in place if at least half of the load is occupied by tombstones
+			Rehash(m_size * 2 <= MaxLoad(m_capacity) ? m_capacity : m_capacity * 2);
+			index = FindFirstNonFull(hash);
+		}
+		return index;
+	}
+
+	void CommitInsert(size_t index, size_t userHash) noexcept
+	{
+		if (m_ctrl[index] == detail::CTRL_EMPTY)
+		{
+			--m_growthLeft;
+		}
+		SetCtrl(index, H2(detail::MixHash(userHash)));
+		++m_size;
+	}
+
+	void InsertUnique(const Key& key, const Val& value)
+	{
+		const size_t hash = m_hasher(key);
+		auto index = PrepareInsert(hash);
+		new (m_slots + index) value_type(key, value);
+		CommitInsert(index, hash);
+	}
+
+	void EraseAt(size_t index)
+	{
+		const size_t mask = m_capacity - 1;
+		// If every window of GROUP_WIDTH slots containing the index has an empty slot,
+		// no probe sequence could have passed through it, so it is safe to make it empty
+		auto emptyBefore = detail::Group(m_ctrl + ((index - detail::GROUP_WIDTH) & mask)).MatchEmpty();
+		auto emptyAfter = detail::Group(m_ctrl + index).MatchEmpty();
+		const bool wasNeverFull = emptyBefore && emptyAfter
+			&& emptyAfter.TrailingZeros() + emptyBefore.LeadingZeros() < detail::GROUP_WIDTH;
+		SetCtrl(index, wasNeverFull ? detail::CTRL_EMPTY : detail::CTRL_DELETED);
+		if (wasNeverFull)
+		{
+			++m_growthLeft;
+		}
+		--m_size;
+		// The element is destroyed after the slot is released, so its destructor may
+		// safely erase other elements
+		m_slots[index].~value_type();
+	}
+
+	void DestroySlots() noexcept
+	{
+		for (size_t i = 0; i < m_capacity; ++i)
+		{
+			if (m_ctrl[i] >= 0)
+			{
+				m_slots[i].~value_type();
+			}
+		}
+	}
+
+	void Rehash(size_t capacity)
+	{
+		assert(capacity >= detail::GROUP_WIDTH && (capacity & (capacity - 1)) == 0);
+		auto oldCtrl = m_ctrl;
+		auto oldSlots = m_slots;
+		auto oldCapacity = m_capacity;
+
+		m_slots = std::allocator<value_type>().allocate(capacity);
+		try
+		{
+			m_ctrl = new detail::CtrlByte[capacity + detail::GROUP_WIDTH];
+		}
+		catch (...)
+		{
+			std::allocator<value_type>().deallocate(m_slots, capacity);
+			m_slots = oldSlots;
+			throw;
+		}
+		std::fill_n(m_ctrl, capacity + detail::GROUP_WIDTH, detail::CTRL_EMPTY);
+		m_capacity = capacity;
+		m_growthLeft = MaxLoad(capacity) - m_size;
+
+		for (size_t i = 0; i < oldCapacity; ++i)
+		{
+			if (oldCtrl[i] >= 0)
+			{
+				const size_t hash = detail::MixHash(m_hasher(oldSlots[i].first));
+				const size_t index = FindFirstNonFull(hash);
+				SetCtrl(index, H2(hash));
+				new (m_slots + index) value_type(std::move(oldSlots[i]));
+				oldSlots[i].~value_type();
+			}
+		}
+		Deallocate(oldCtrl, oldSlots, oldCapacity);
+	}
+
+	static void Deallocate(detail::CtrlByte* ctrl, value_type* slots, size_t capacity) noexcept
+	{
+		if (capacity)
+		{
+			delete[] ctrl;
+			std::allocator<value_type>().deallocate(slots, capacity);
+		}
+	}
+
+	detail::CtrlByte* m_ctrl = EmptyGroup();
+	value_type* m_slots = nullptr;
+	size_t m_capacity = 0;
+	size_t m_size = 0;
+	size_t m_growthLeft = 0;
+	Hasher m_hasher;
+	KeyEq m_keyEq;
+};
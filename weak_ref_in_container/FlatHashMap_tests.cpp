@@ -0,0 +1,260 @@
+#include "pch.h"
+#include "FlatHashMap.h"
+
+using namespace std;
+
+namespace
+{
+
+// Makes every key collide, so that all of them share a single probe sequence
+struct CollidingHash
+{
+	size_t operator()(int) const
+	{
+		return 42;
+	}
+};
+
+} // namespace
+
+SCENARIO("FlatHashMap basic operations")
+{
+	FlatHashMap<string, int> map;
+	CHECK(map.empty());
+	CHECK(map.find("one") == map.end());
+
+	WHEN("items are inserted")
+	{
+		CHECK(map.emplace("one", 1).second);
+		CHECK(map.emplace("two", 2).second);
+		THEN("they can be found")
+		{
+			CHECK(map.size() == 2);
+			CHECK(map.find("one")->second == 1);
+			CHECK(map.find("two")->second == 2);
+			CHECK(map.find("three") == map.end());
+		}
+		AND_WHEN("an existing key is emplaced")
+		{
+			auto result = map.emplace("one", 100);
+			THEN("the existing item is kept")
+			{
+				CHECK(!result.second);
+				CHECK(result.first->second == 1);
+			}
+		}
+		AND_WHEN("an existing key is assigned")
+		{
+			map.insert_or_assign("one", 100);
+			THEN("the item is replaced")
+			{
+				CHECK(map.size() == 2);
+				CHECK(map.find("one")->second == 100);
+			}
+		}
+		AND_WHEN("an item is erased")
+		{
+			CHECK(map.erase("one") == 1);
+			CHECK(map.erase("one") == 0);
+			THEN("it can't be found")
+			{
+				CHECK(map.size() == 1);
+				CHECK(map.find("one") == map.end());
+				CHECK(map.find("two")->second == 2);
+			}
+		}
+	}
+}
+
+SCENARIO("FlatHashMap growth")
+{
+	FlatHashMap<int, int> map;
+	for (int i = 0; i < 10000; ++i)
+	{
+		map[i] = i * 2;
+	}
+	CHECK(map.size() == 10000);
+
+	size_t count = 0;
+	long long sum = 0;
+	for (auto& item : map)
+	{
+		++count;
+		sum += item.second - item.first * 2;
+	}
+	CHECK(count == 10000);
+	CHECK(sum == 0);
+
+	for (int i = 0; i < 10000; ++i)
+	{
+		REQUIRE(map.find(i)->second == i * 2);
+	}
+}
+
+SCENARIO("FlatHashMap tombstones")
+{
+	GIVEN("a map where all keys share a probe sequence")
+	{
+		FlatHashMap<int, int, CollidingHash> map;
+		for (int i = 0; i < 100; ++i)
+		{
+			map.emplace(i, i);
+		}
+
+		WHEN("items in the middle of the sequence are erased")
+		{
+			for (int i = 0; i < 100; i += 3)
+			{
+				map.erase(i);
+			}
+			THEN("items behind them are still found")
+			{
+				for (int i = 0; i < 100; ++i)
+				{
+					REQUIRE((map.find(i) != map.end()) == (i % 3 != 0));
+				}
+			}
+		}
+	}
+
+	GIVEN("a map with erasure and insertion churn")
+	{
+		FlatHashMap<int, int> map;
+		map.reserve(100);
+		auto capacity = map.capacity();
+		for (int i = 0; i < 100000; ++i)
+		{
+			map.emplace(i, i);
+			if (i >= 50)
+			{
+				REQUIRE(map.erase(i - 50) == 1);
+			}
+		}
+		THEN("tombstones are reclaimed without growing the table")
+		{
+			CHECK(map.size() == 50);
+			CHECK(map.capacity() == capacity);
+			for (int i = 100000 - 50; i < 100000; ++i)
+			{
+				REQUIRE(map.find(i)->second == i);
+			}
+		}
+	}
+}
+
+SCENARIO("FlatHashMap shrinking")
+{
+	FlatHashMap<int, int> map;
+	for (int i = 0; i < 10000; ++i)
+	{
+		map.emplace(i, i);
+	}
+	const auto bytes = map.allocated_bytes();
+
+	WHEN("most items are erased")
+	{
+		for (int i = 100; i < 10000; ++i)
+		{
+			map.erase(i);
+		}
+		map.shrink_to_fit();
+		THEN("the table shrinks to fit the rest")
+		{
+			CHECK(map.capacity() == 128);
+			CHECK(map.allocated_bytes() < bytes / 50);
+			for (int i = 0; i < 100; ++i)
+			{
+				REQUIRE(map.find(i)->second == i);
+			}
+			map.emplace(100, 100);
+			CHECK(map.size() == 101);
+		}
+	}
+
+	WHEN("all items are erased")
+	{
+		map.clear();
+		map.shrink_to_fit();
+		THEN("the table is freed")
+		{
+			CHECK(map.capacity() == 0);
+			CHECK(map.allocated_bytes() == 0);
+			CHECK(map.find(1) == map.end());
+			map.emplace(1, 1);
+			CHECK(map.find(1)->second == 1);
+		}
+	}
+}
+
+SCENARIO("FlatHashMap erasure from an item destructor")
+{
+	struct Item;
+	using Map = FlatHashMap<int, shared_ptr<Item>>;
+	struct Item
+	{
+		Item(Map& map, int victim)
+			: map(map)
+			, victim(victim)
+		{
+		}
+		~Item()
+		{
+			map.erase(victim);
+		}
+		Map& map;
+		int victim;
+	};
+
+	Map map;
+	for (int i = 0; i < 10; ++i)
+	{
+		// Every item erases the next one when destroyed
+		map.emplace(i, make_shared<Item>(map, i + 1));
+	}
+	map.erase(0);
+	CHECK(map.empty());
+}
+
+SCENARIO("FlatHashMap insertion of a value whose constructor throws")
+{
+	static int liveCount = 0;
+	struct Value
+	{
+		explicit Value(int value)
+			: value(value)
+		{
+			if (value < 0)
+			{
+				throw runtime_error("negative value");
+			}
+			++liveCount;
+		}
+		Value(const Value& other)
+			: value(other.value)
+		{
+			++liveCount;
+		}
+		~Value()
+		{
+			--liveCount;
+		}
+		int value;
+	};
+
+	{
+		FlatHashMap<int, Value> map;
+		for (int i = 0; i < 20; ++i)
+		{
+			map.try_emplace(i, i);
+		}
+		CHECK_THROWS_AS(map.try_emplace(100, -1), runtime_error);
+
+		CHECK(map.size() == 20);
+		CHECK(map.find(100) == map.end());
+		CHECK(distance(map.begin(), map.end()) == 20);
+		CHECK(map.try_emplace(100, 100).second);
+		CHECK(map.find(100)->second.value == 100);
+		CHECK(liveCount == 21);
+	}
+	CHECK(liveCount == 0);
+}
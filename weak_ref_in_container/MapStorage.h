@@ -0,0 +1,77 @@
+#pragma once
+
+#include "FlatHashMap.h"
+#include "PackedKeyMap.h"
+#include <type_traits>
+#include <unordered_map>
+
+// Backing stores for the items of CacheT and WeakMap
+
+// Node-based std::unordered_map: an allocation per item, stable item addresses
+struct NodeMapStorage
+{
+	template <typename Key, typename Val, typename Hasher, typename KeyEq>
+	using Map = std::unordered_map<Key, Val, Hasher, KeyEq>;
+};
+
+// Open addressing FlatHashMap: items are stored inline in a single array
+struct FlatMapStorage
+{
+	template <typename Key, typename Val, typename Hasher, typename KeyEq>
+	using Map = FlatHashMap<Key, Val, Hasher, KeyEq>;
+};
+
+// PackedKeyMap: keys are stored in an array of their own, apart from values.
+// Suits WeakMap, whose keys are single pointers
+struct PackedKeyStorage
+{
+	template <typename Key, typename Val, typename Hasher, typename KeyEq>
+	using Map = PackedKeyMap<Key, Val, Hasher, KeyEq>;
+};
+
+namespace detail
+{
+
+// Whether the map can look keys up by a precomputed hash and prefetch the memory a lookup touches
+template <typename Map, typename = void>
+struct SupportsHashedLookup : std::false_type
+{
+};
+
+template <typename Map>
+struct SupportsHashedLookup<Map, std::void_t<decltype(std::declval<const Map&>().prefetch(size_t()))>>
+	: std::true_type
+{
+};
+
+// Shrinks the table of the map to fit its elements
+template <typename Map>
+void ShrinkMapToFit(Map& map)
+{
+	map.shrink_to_fit();
+}
+
+template <typename Key, typename Val, typename Hasher, typename KeyEq>
+void ShrinkMapToFit(std::unordered_map<Key, Val, Hasher, KeyEq>& map)
+{
+	// Rehashing to zero buckets picks the smallest bucket count for the elements
+	map.rehash(0);
+}
+
+// The memory the map has allocated
+template <typename Map>
+size_t GetMapAllocatedBytes(const Map& map) noexcept
+{
+	return map.allocated_bytes();
+}
+
+// Estimated, since nodes differ between implementations: a node holds the element,
+// a link and maybe a cached hash
+template <typename Key, typename Val, typename Hasher, typename KeyEq>
+size_t GetMapAllocatedBytes(const std::unordered_map<Key, Val, Hasher, KeyEq>& map) noexcept
+{
+	using Map = std::unordered_map<Key, Val, Hasher, KeyEq>;
+	return map.size() * (sizeof(typename Map::value_type) + 2 * sizeof(void*)) + map.bucket_count() * sizeof(void*);
+}
+
+} // namespace detail
@@ -0,0 +1,446 @@
+#pragma once
+
+#include <cassert>
+#include <cstdint>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <type_traits>
+#include <utility>
+
+namespace detail
+{
+
+// Tells PackedKeyMap the two key values which mark its empty and erased slots.
+// Specialize it for key types which have spare values, like pointers
+template <typename Key>
+struct PackedKeyTraits;
+
+} // namespace detail
+
+// An open addressing hash map for small trivially copyable keys, which keeps keys in a packed
+// array of their own and values in a parallel array.
+//
+// A lookup probes the key array linearly and touches values only on a hit. The table is at most
+// half full, so a typical miss reads a single cache line of keys. Like FlatHashMap, erasure never
+// moves other elements: erased slots become tombstones, which are purged on the next growth.
+//
+// Elements are not stored as pairs, so iterators yield pairs of references
+template <typename Key, typename Val, typename Hasher = std::hash<Key>, typename KeyEq = std::equal_to<Key>>
+class PackedKeyMap
+{
+	static_assert(std::is_trivially_copyable_v<Key>, "keys are copied around as plain bytes");
+
+	using KeyTraits = detail::PackedKeyTraits<Key>;
+
+	template <typename MapPtr, typename V>
+	class Iterator;
+
+public:
+	using key_type = Key;
+	using mapped_type = Val;
+	using size_type = size_t;
+	using hasher = Hasher;
+	using key_equal = KeyEq;
+	using iterator = Iterator<PackedKeyMap*, Val>;
+	using const_iterator = Iterator<const PackedKeyMap*, const Val>;
+
+	PackedKeyMap() = default;
+	PackedKeyMap(const PackedKeyMap&) = delete;
+	PackedKeyMap& operator=(const PackedKeyMap&) = delete;
+
+	PackedKeyMap(PackedKeyMap&& other) noexcept
+		: m_keys(std::exchange(other.m_keys, nullptr))
+		, m_values(std::exchange(other.m_values, nullptr))
+		, m_capacity(std::exchange(other.m_capacity, 0))
+		, m_capacityBits(std::exchange(other.m_capacityBits, 0))
+		, m_size(std::exchange(other.m_size, 0))
+		, m_tombstoneCount(std::exchange(other.m_tombstoneCount, 0))
+		, m_hasher(other.m_hasher)
+		, m_keyEq(other.m_keyEq)
+	{
+	}
+
+	PackedKeyMap& operator=(PackedKeyMap&& rhs) noexcept
+	{
+		PackedKeyMap(std::move(rhs)).swap(*this);
+		return *this;
+	}
+
+	~PackedKeyMap()
+	{
+		clear();
+		Deallocate(m_keys, m_values, m_capacity);
+	}
+
+	void swap(PackedKeyMap& other) noexcept
+	{
+		std::swap(m_keys, other.m_keys);
+		std::swap(m_values, other.m_values);
+		std::swap(m_capacity, other.m_capacity);
+		std::swap(m_capacityBits, other.m_capacityBits);
+		std::swap(m_size, other.m_size);
+		std::swap(m_tombstoneCount, other.m_tombstoneCount);
+		std::swap(m_hasher, other.m_hasher);
+		std::swap(m_keyEq, other.m_keyEq);
+	}
+
+	iterator begin() noexcept
+	{
+		return { this, SkipFree(0) };
+	}
+
+	iterator end() noexcept
+	{
+		return { this, m_capacity };
+	}
+
+	const_iterator begin() const noexcept
+	{
+		return { this, SkipFree(0) };
+	}
+
+	const_iterator end() const noexcept
+	{
+		return { this, m_capacity };
+	}
+
+	size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+	bool empty() const noexcept
+	{
+		return m_size == 0;
+	}
+
+	// The number of slots
+	size_t capacity() const noexcept
+	{
+		return m_capacity;
+	}
+
+	iterator find(const Key& key)
+	{
+		return { this, FindIndex(key) };
+	}
+
+	const_iterator find(const Key& key) const
+	{
+		return { this, FindIndex(key) };
+	}
+
+	size_t count(const Key& key) const
+	{
+		return FindIndex(key) != m_capacity ? 1 : 0;
+	}
+
+	template <typename... Args>
+	std::pair<iterator, bool> try_emplace(const Key& key, Args&&... args)
+	{
+		assert(!IsFree(key));
+		if (auto index = FindIndex(key); index != m_capacity)
+		{
+			return { { this, index }, false };
+		}
+		if ((m_size + m_tombstoneCount + 1) * 2 > m_capacity)
+		{
+			// Purges tombstones in place unless the table needs to grow
+			Rehash(m_capacity && (m_size + 1) * 4 <= m_capacity ? m_capacity : std::max<size_t>(m_capacity * 2, MIN_CAPACITY));
+		}
+		const size_t index = FindFreeIndex(key);
+		new (m_values + index) Val(std::forward<Args>(args)...);
+		if (m_keyEq(m_keys[index], KeyTraits::Deleted()))
+		{
+			--m_tombstoneCount;
+		}
+		m_keys[index] = key;
+		++m_size;
+		return { { this, index }, true };
+	}
+
+	template <typename V>
+	std::pair<iterator, bool> emplace(const Key& key, V&& value)
+	{
+		return try_emplace(key, std::forward<V>(value));
+	}
+
+	size_t erase(const Key& key)
+	{
+		if (auto index = FindIndex(key); index != m_capacity)
+		{
+			EraseAt(index);
+			return 1;
+		}
+		return 0;
+	}
+
+	iterator erase(const_iterator pos)
+	{
+		assert(pos.m_map == this && pos.m_index < m_capacity);
+		EraseAt(pos.m_index);
+		return { this, SkipFree(pos.m_index + 1) };
+	}
+
+	iterator erase(iterator pos)
+	{
+		return erase(const_iterator(pos));
+	}
+
+	void clear() noexcept
+	{
+		for (size_t i = 0; i < m_capacity; ++i)
+		{
+			if (!IsFree(m_keys[i]))
+			{
+				m_values[i].~Val();
+			}
+			m_keys[i] = KeyTraits::Empty();
+		}
+		m_size = 0;
+		m_tombstoneCount = 0;
+	}
+
+	// Rehashes the elements into the smallest table which holds them, purging tombstones.
+	// Frees the table if there are no elements
+	void shrink_to_fit()
+	{
+		if (m_size == 0)
+		{
+			PackedKeyMap().swap(*this);
+			return;
+		}
+		size_t capacity = MIN_CAPACITY;
+		while ((m_size + 1) * 2 > capacity)
+		{
+			capacity *= 2;
+		}
+		if (capacity < m_capacity || m_tombstoneCount)
+		{
+			Rehash(capacity);
+		}
+	}
+
+	// The memory of the key and value arrays
+	size_t allocated_bytes() const noexcept
+	{
+		return m_capacity * (sizeof(Key) + sizeof(Val));
+	}
+
+private:
+	static constexpr size_t MIN_CAPACITY = 16;
+
+	template <typename MapPtr, typename V>
+	class Iterator
+	{
+	public:
+		using iterator_category = std::forward_iterator_tag;
+		using value_type = std::pair<const Key, Val>;
+		using difference_type = ptrdiff_t;
+		using reference = std::pair<const Key&, V&>;
+
+		// Lets it->second work, although there is no pair in memory to point to
+		class pointer
+		{
+		public:
+			const reference* operator->() const noexcept
+			{
+				return &m_ref;
+			}
+
+		private:
+			friend class Iterator;
+
+			explicit pointer(reference ref) noexcept
+				: m_ref(ref)
+			{
+			}
+
+			reference m_ref;
+		};
+
+		Iterator() = default;
+
+		template <typename OtherMapPtr, typename OtherV,
+			typename = std::enable_if_t<std::is_convertible_v<OtherMapPtr, MapPtr>>>
+		Iterator(const Iterator<OtherMapPtr, OtherV>& other) noexcept
+			: m_map(other.m_map)
+			, m_index(other.m_index)
+		{
+		}
+
+		reference operator*() const noexcept
+		{
+			return { m_map->m_keys[m_index], m_map->m_values[m_index] };
+		}
+
+		pointer operator->() const noexcept
+		{
+			return pointer(**this);
+		}
+
+		Iterator& operator++() noexcept
+		{
+			m_index = m_map->SkipFree(m_index + 1);
+			return *this;
+		}
+
+		Iterator operator++(int) noexcept
+		{
+			auto tmp = *this;
+			++*this;
+			return tmp;
+		}
+
+		bool operator==(const Iterator& rhs) const noexcept
+		{
+			return m_index == rhs.m_index;
+		}
+
+		bool operator!=(const Iterator& rhs) const noexcept
+		{
+			return m_index != rhs.m_index;
+		}
+
+	private:
+		friend class PackedKeyMap;
+		template <typename, typename>
+		friend class Iterator;
+
+		Iterator(MapPtr map, size_t index) noexcept
+			: m_map(map)
+			, m_index(index)
+		{
+		}
+
+		MapPtr m_map = nullptr;
+		size_t m_index = 0;
+	};
+
+	bool IsFree(const Key& key) const noexcept
+	{
+		return m_keyEq(key, KeyTraits::Empty()) || m_keyEq(key, KeyTraits::Deleted());
+	}
+
+	size_t GetStartIndex(const Key& key) const noexcept
+	{
+		// Fibonacci hashing mixes weak hashes like aligned addresses and takes the high bits,
+		// which get the most of the hash entropy
+		return static_cast<size_t>((uint64_t(m_hasher(key)) * 0x9E3779B97F4A7C15ull) >> (64 - m_capacityBits));
+	}
+
+	size_t SkipFree(size_t index) const noexcept
+	{
+		while (index < m_capacity && IsFree(m_keys[index]))
+		{
+			++index;
+		}
+		return index;
+	}
+
+	size_t FindIndex(const Key& key) const
+	{
+		if (m_size == 0)
+		{
+			return m_capacity;
+		}
+		const size_t mask = m_capacity - 1;
+		for (size_t index = GetStartIndex(key);; index = (index + 1) & mask)
+		{
+			const Key& slotKey = m_keys[index];
+			if (m_keyEq(slotKey, key))
+			{
+				return index;
+			}
+			if (m_keyEq(slotKey, KeyTraits::Empty()))
+			{
+				return m_capacity;
+			}
+		}
+	}
+
+	size_t FindFreeIndex(const Key& key) const noexcept
+	{
+		const size_t mask = m_capacity - 1;
+		size_t index = GetStartIndex(key);
+		while (!IsFree(m_keys[index]))
+		{
+			index = (index + 1) & mask;
+		}
+		return index;
+	}
+
+	void EraseAt(size_t index)
+	{
+		// The value is taken out first, so its destructor may safely modify the map
+		[[maybe_unused]] Val value(std::move(m_values[index]));
+		m_values[index].~Val();
+		// A following empty slot ends every probe sequence passing through this one
+		const bool endsProbes = m_keyEq(m_keys[(index + 1) & (m_capacity - 1)], KeyTraits::Empty());
+		m_keys[index] = endsProbes ? KeyTraits::Empty() : KeyTraits::Deleted();
+		if (!endsProbes)
+		{
+			++m_tombstoneCount;
+		}
+		--m_size;
+	}
+
+	void Rehash(size_t capacity)
+	{
+		assert(capacity >= MIN_CAPACITY && (capacity & (capacity - 1)) == 0);
+		auto oldKeys = m_keys;
+		auto oldValues = m_values;
+		auto oldCapacity = m_capacity;
+
+		m_values = std::allocator<Val>().allocate(capacity);
+		try
+		{
+			m_keys = std::allocator<Key>().allocate(capacity);
+		}
+		catch (...)
+		{
+			std::allocator<Val>().deallocate(m_values, capacity);
+			m_values = oldValues;
+			throw;
+		}
+		std::uninitialized_fill_n(m_keys, capacity, KeyTraits::Empty());
+		m_capacity = capacity;
+		m_capacityBits = 0;
+		while ((size_t(1) << m_capacityBits) < capacity)
+		{
+			++m_capacityBits;
+		}
+		m_tombstoneCount = 0;
+
+		for (size_t i = 0; i < oldCapacity; ++i)
+		{
+			if (!IsFree(oldKeys[i]))
+			{
+				const size_t index = FindFreeIndex(oldKeys[i]);
+				m_keys[index] = oldKeys[i];
+				new (m_values + index) Val(std::move(oldValues[i]));
+				oldValues[i].~Val();
+			}
+		}
+		Deallocate(oldKeys, oldValues, oldCapacity);
+	}
+
+	static void Deallocate(Key* keys, Val* values, size_t capacity) noexcept
+	{
+		if (capacity)
+		{
+			std::allocator<Key>().deallocate(keys, capacity);
+			std::allocator<Val>().deallocate(values, capacity);
+		}
+	}
+
+	Key* m_keys = nullptr;
+	Val* m_values = nullptr;
+	size_t m_capacity = 0;
+	unsigned m_capacityBits = 0;
+	size_t m_size = 0;
+	size_t m_tombstoneCount = 0;
+	Hasher m_hasher;
+	KeyEq m_keyEq;
+};
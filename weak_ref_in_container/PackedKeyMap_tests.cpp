@@ -0,0 +1,249 @@
+#include "pch.h"
+#include "PackedKeyMap.h"
+#include "WeakMap.h"
+
+using namespace std;
+
+namespace
+{
+
+struct Id
+{
+	int value;
+	bool operator==(const Id& rhs) const
+	{
+		return value == rhs.value;
+	}
+};
+
+struct IdHash
+{
+	size_t operator()(const Id& id) const
+	{
+		return hash<int>()(id.value);
+	}
+};
+
+// Makes every key collide, so that all of them share a single probe sequence
+struct CollidingHash
+{
+	size_t operator()(const Id&) const
+	{
+		return 42;
+	}
+};
+
+struct FooObservable : DestructionObservable
+{
+};
+
+} // namespace
+
+template <>
+struct detail::PackedKeyTraits<Id>
+{
+	static Id Empty() noexcept
+	{
+		return { -1 };
+	}
+	static Id Deleted() noexcept
+	{
+		return { -2 };
+	}
+};
+
+SCENARIO("PackedKeyMap basic operations")
+{
+	PackedKeyMap<Id, string, IdHash> map;
+	CHECK(map.empty());
+	CHECK(map.find({ 1 }) == map.end());
+
+	WHEN("items are inserted")
+	{
+		CHECK(map.emplace({ 1 }, "one").second);
+		CHECK(map.emplace({ 2 }, "two").second);
+		THEN("they can be found")
+		{
+			CHECK(map.size() == 2);
+			CHECK(map.find({ 1 })->second == "one");
+			CHECK((*map.find({ 2 })).second == "two");
+			CHECK(map.find({ 3 }) == map.end());
+		}
+		AND_WHEN("an existing key is emplaced")
+		{
+			auto result = map.emplace({ 1 }, "uno");
+			THEN("the existing item is kept")
+			{
+				CHECK(!result.second);
+				CHECK(result.first->second == "one");
+			}
+		}
+		AND_WHEN("an item is erased")
+		{
+			CHECK(map.erase({ 1 }) == 1);
+			CHECK(map.erase({ 1 }) == 0);
+			THEN("it can't be found")
+			{
+				CHECK(map.size() == 1);
+				CHECK(map.find({ 1 }) == map.end());
+				CHECK(map.find({ 2 })->second == "two");
+			}
+		}
+	}
+}
+
+SCENARIO("PackedKeyMap growth and tombstones")
+{
+	GIVEN("a map with many items")
+	{
+		PackedKeyMap<Id, int, IdHash> map;
+		for (int i = 0; i < 10000; ++i)
+		{
+			map.emplace({ i }, i * 2);
+		}
+		THEN("all of them can be iterated over and found")
+		{
+			size_t count = 0;
+			long long sum = 0;
+			for (const auto& item : map)
+			{
+				++count;
+				sum += item.second - item.first.value * 2;
+			}
+			CHECK(count == 10000);
+			CHECK(sum == 0);
+			for (int i = 0; i < 10000; ++i)
+			{
+				REQUIRE(map.find({ i })->second == i * 2);
+			}
+		}
+	}
+
+	GIVEN("a map where all keys share a probe sequence")
+	{
+		PackedKeyMap<Id, int, CollidingHash> map;
+		for (int i = 0; i < 100; ++i)
+		{
+			map.emplace({ i }, i);
+		}
+		for (int i = 0; i < 100; i += 3)
+		{
+			map.erase({ i });
+		}
+		THEN("items behind erased ones are still found")
+		{
+			for (int i = 0; i < 100; ++i)
+			{
+				REQUIRE((map.find({ i }) != map.end()) == (i % 3 != 0));
+			}
+		}
+	}
+
+	GIVEN("a map with erasure and insertion churn")
+	{
+		PackedKeyMap<Id, int, IdHash> map;
+		size_t maxCapacity = 0;
+		for (int i = 0; i < 100000; ++i)
+		{
+			map.emplace({ i }, i);
+			if (i >= 50)
+			{
+				REQUIRE(map.erase({ i - 50 }) == 1);
+			}
+			maxCapacity = max(maxCapacity, map.capacity());
+		}
+		THEN("tombstones are reclaimed without growing the table")
+		{
+			CHECK(map.size() == 50);
+			CHECK(maxCapacity <= 256);
+			for (int i = 100000 - 50; i < 100000; ++i)
+			{
+				REQUIRE(map.find({ i })->second == i);
+			}
+		}
+	}
+}
+
+SCENARIO("PackedKeyMap shrinking")
+{
+	PackedKeyMap<Id, int, IdHash> map;
+	for (int i = 0; i < 10000; ++i)
+	{
+		map.emplace({ i }, i);
+	}
+	for (int i = 100; i < 10000; ++i)
+	{
+		map.erase({ i });
+	}
+	map.shrink_to_fit();
+	THEN("the table shrinks to fit the rest")
+	{
+		CHECK(map.capacity() == 256);
+		CHECK(map.allocated_bytes() == 256 * (sizeof(Id) + sizeof(int)));
+		for (int i = 0; i < 100; ++i)
+		{
+			REQUIRE(map.find({ i })->second == i);
+		}
+	}
+	THEN("an empty map frees the table")
+	{
+		map.clear();
+		map.shrink_to_fit();
+		CHECK(map.capacity() == 0);
+		map.emplace({ 1 }, 1);
+		CHECK(map.find({ 1 })->second == 1);
+	}
+}
+
+SCENARIO("PackedKeyMap erasure from an item destructor")
+{
+	struct Item;
+	using Map = PackedKeyMap<Id, shared_ptr<Item>, IdHash>;
+	struct Item
+	{
+		Item(Map& map, int victim)
+			: map(map)
+			, victim(victim)
+		{
+		}
+		~Item()
+		{
+			map.erase({ victim });
+		}
+		Map& map;
+		int victim;
+	};
+
+	Map map;
+	for (int i = 0; i < 10; ++i)
+	{
+		// Every item erases the next one when destroyed
+		map.emplace({ i }, make_shared<Item>(map, i + 1));
+	}
+	map.erase({ 0 });
+	CHECK(map.empty());
+}
+
+SCENARIO("WeakMap with packed keys")
+{
+	auto wm = make_shared<WeakMap<FooObservable, int, PackedKeyStorage>>(WeakMapMode::Ephemeron);
+
+	vector<shared_ptr<FooObservable>> keys;
+	for (int i = 0; i < 100; ++i)
+	{
+		keys.push_back(make_shared<FooObservable>());
+		wm->SetValue(keys.back(), i);
+	}
+	for (size_t i = 0; i < keys.size(); i += 2)
+	{
+		keys[i].reset();
+	}
+	wm->RemoveValue(keys[1]);
+
+	CHECK(wm->GetSize() == 49);
+	CHECK(!wm->TryGetValue(keys[1]));
+	for (size_t i = 3; i < keys.size(); i += 2)
+	{
+		REQUIRE(wm->TryGetValue(keys[i]).value_or(-1) == int(i));
+	}
+}
@@ -0,0 +1,306 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace detail
+{
+
+inline unsigned CountTrailingZeros64(uint64_t mask) noexcept
+{
+	assert(mask != 0);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return index;
+#else
+	return static_cast<unsigned>(__builtin_ctzll(mask));
+#endif
+}
+
+inline unsigned FindHighestBit64(uint64_t mask) noexcept
+{
+	assert(mask != 0);
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanReverse64(&index, mask);
+	return index;
+#else
+	return 63 - static_cast<unsigned>(__builtin_clzll(mask));
+#endif
+}
+
+} // namespace detail
+
+// A hierarchical timing wheel: timers which carry a Payload and expire at a given tick.
+//
+// There are LEVEL_COUNT wheels of SLOT_COUNT slots. A slot of level N spans SLOT_COUNT^N ticks.
+// A timer is kept in the lowest level whose slot doesn't contain the current tick, and is moved
+// one level down when the wheel reaches its slot. Scheduling and cancelling are O(1), and so is
+// every tick apart from firing the expired timers. Slots which have no timers are skipped when
+// the wheel is advanced by many ticks at once.
+//
+// Timers which expire later than a rotation of the top level (2^24 ticks) wait in its last slot
+// and are rescheduled when the wheel reaches it
+template <typename Payload>
+class TimerWheel
+{
+public:
+	static constexpr unsigned SLOT_BITS = 6;
+	static constexpr size_t SLOT_COUNT = size_t(1) << SLOT_BITS;
+	static constexpr unsigned LEVEL_COUNT = 4;
+
+	// Identifies a scheduled timer. Cancelling a timer by a stale id does nothing
+	class TimerId
+	{
+	public:
+		TimerId() = default;
+
+		explicit operator bool() const noexcept
+		{
+			return m_generation != 0;
+		}
+
+	private:
+		friend class TimerWheel;
+
+		TimerId(uint32_t index, uint32_t generation) noexcept
+			: m_index(index)
+			, m_generation(generation)
+		{
+		}
+
+		uint32_t m_index = 0;
+		uint32_t m_generation = 0;
+	};
+
+	explicit TimerWheel(uint64_t now = 0)
+		: m_now(now)
+	{
+		for (auto& level : m_slots)
+		{
+			std::fill(std::begin(level), std::end(level), NO_NODE);
+		}
+	}
+
+	uint64_t GetNow() const noexcept
+	{
+		return m_now;
+	}
+
+	// The number of scheduled timers
+	size_t GetSize() const noexcept
+	{
+		return m_size;
+	}
+
+	// A timer which expires at the current tick or earlier fires on the next tick
+	TimerId Schedule(uint64_t expiry, Payload payload)
+	{
+		uint32_t index;
+		if (m_freeNode != NO_NODE)
+		{
+			index = m_freeNode;
+			m_freeNode = m_nodes[index].next;
+			m_nodes[index].payload.emplace(std::move(payload));
+		}
+		else
+		{
+			index = static_cast<uint32_t>(m_nodes.size());
+			m_nodes.push_back({ std::move(payload) });
+		}
+		Node& node = m_nodes[index];
+		// The slot of the current tick has fired already
+		node.expiry = std::max(expiry, m_now + 1);
+		node.isScheduled = true;
+		Link(index);
+		++m_size;
+		return { index, node.generation };
+	}
+
+	void Cancel(TimerId id) noexcept
+	{
+		if (!id || id.m_index >= m_nodes.size())
+		{
+			return;
+		}
+		Node& node = m_nodes[id.m_index];
+		if (node.generation == id.m_generation && node.isScheduled)
+		{
+			Unlink(id.m_index);
+			Free(id.m_index);
+		}
+	}
+
+	// Advances the wheel to the given tick, calling onExpired(Payload&&) for every expired timer.
+	// The handler may schedule and cancel timers
+	template <typename Fn>
+	void Advance(uint64_t now, Fn&& onExpired)
+	{
+		while (m_now < now)
+		{
+			if (m_size == 0)
+			{
+				m_now = now;
+				return;
+			}
+			// Until the next boundary of a level 0 rotation only level 0 slots fire,
+			// so the ticks of empty slots may be skipped
+			const uint64_t boundary = (m_now | (SLOT_COUNT - 1)) + 1;
+			const uint64_t last = std::min(now, boundary);
+			uint64_t next = last;
+			if (uint64_t occupied = m_occupied[0] >> GetSlotIndex(m_now + 1, 0))
+			{
+				next = std::min(last, m_now + 1 + detail::CountTrailingZeros64(occupied));
+			}
+			m_now = next - 1;
+			Tick(onExpired);
+		}
+	}
+
+private:
+	static constexpr uint32_t NO_NODE = UINT32_MAX;
+
+	struct Node
+	{
+		std::optional<Payload> payload;
+		uint64_t expiry = 0;
+		uint32_t prev = NO_NODE;
+		uint32_t next = NO_NODE;
+		// Changes every time the node is freed, which makes ids of the node stale
+		uint32_t generation = 1;
+		uint8_t level = 0;
+		uint8_t slot = 0;
+		bool isScheduled = false;
+	};
+
+	template <typename Fn>
+	void Tick(Fn& onExpired)
+	{
+		++m_now;
+		// Higher levels whose slot boundary is reached are moved down, the highest one first
+		unsigned cascadeLevel = 0;
+		while (cascadeLevel + 1 < LEVEL_COUNT
+			&& (m_now & ((uint64_t(1) << (SLOT_BITS * (cascadeLevel + 1))) - 1)) == 0)
+		{
+			++cascadeLevel;
+		}
+		for (unsigned level = cascadeLevel; level > 0; --level)
+		{
+			const unsigned slot = GetSlotIndex(m_now, level);
+			uint32_t index = std::exchange(m_slots[level][slot], NO_NODE);
+			m_occupied[level] &= ~(uint64_t(1) << slot);
+			while (index != NO_NODE)
+			{
+				const uint32_t next = m_nodes[index].next;
+				Link(index);
+				index = next;
+			}
+		}
+
+		const unsigned slot = GetSlotIndex(m_now, 0);
+		while (m_slots[0][slot] != NO_NODE)
+		{
+			const uint32_t index = m_slots[0][slot];
+			Unlink(index);
+			// The node is freed before the handler runs, so that the handler may reuse it
+			Payload payload = std::move(*m_nodes[index].payload);
+			Free(index);
+			onExpired(std::move(payload));
+		}
+	}
+
+	static unsigned GetSlotIndex(uint64_t tick, unsigned level) noexcept
+	{
+		return static_cast<unsigned>((tick >> (SLOT_BITS * level)) & (SLOT_COUNT - 1));
+	}
+
+	void Link(uint32_t index) noexcept
+	{
+		Node& node = m_nodes[index];
+		unsigned level = 0;
+		unsigned slot;
+		if (node.expiry <= m_now)
+		{
+			// Moved down to the slot of the current tick, which is about to fire
+			slot = GetSlotIndex(m_now, 0);
+		}
+		else
+		{
+			// The level of the highest group of bits in which the expiry differs from the current tick
+			level = std::min(detail::FindHighestBit64(node.expiry ^ m_now) / SLOT_BITS, LEVEL_COUNT - 1);
+			constexpr unsigned topShift = SLOT_BITS * (LEVEL_COUNT - 1);
+			if (level < LEVEL_COUNT - 1 || (node.expiry >> topShift) - (m_now >> topShift) < SLOT_COUNT)
+			{
+				slot = GetSlotIndex(node.expiry, level);
+			}
+			else
+			{
+				// Waits for the last slot the top level reaches in its rotation
+				slot = GetSlotIndex(GetSlotIndex(m_now, level) + SLOT_COUNT - 1, 0);
+			}
+		}
+
+		node.level = static_cast<uint8_t>(level);
+		node.slot = static_cast<uint8_t>(slot);
+		node.prev = NO_NODE;
+		node.next = m_slots[level][slot];
+		if (node.next != NO_NODE)
+		{
+			m_nodes[node.next].prev = index;
+		}
+		m_slots[level][slot] = index;
+		m_occupied[level] |= uint64_t(1) << slot;
+	}
+
+	void Unlink(uint32_t index) noexcept
+	{
+		Node& node = m_nodes[index];
+		if (node.prev != NO_NODE)
+		{
+			m_nodes[node.prev].next = node.next;
+		}
+		else
+		{
+			m_slots[node.level][node.slot] = node.next;
+			if (node.next == NO_NODE)
+			{
+				m_occupied[node.level] &= ~(uint64_t(1) << node.slot);
+			}
+		}
+		if (node.next != NO_NODE)
+		{
+			m_nodes[node.next].prev = node.prev;
+		}
+	}
+
+	void Free(uint32_t index) noexcept
+	{
+		Node& node = m_nodes[index];
+		node.isScheduled = false;
+		if (++node.generation == 0)
+		{
+			node.generation = 1;
+		}
+		node.payload.reset();
+		node.next = m_freeNode;
+		m_freeNode = index;
+		--m_size;
+	}
+
+	uint64_t m_now;
+	std::vector<Node> m_nodes;
+	uint32_t m_freeNode = NO_NODE;
+	size_t m_size = 0;
+	uint32_t m_slots[LEVEL_COUNT][SLOT_COUNT];
+	// Bit N is set if slot N of the level has timers
+	uint64_t m_occupied[LEVEL_COUNT] = {};
+};
@@ -0,0 +1,116 @@
+#include "pch.h"
+#include "TimerWheel.h"
+#include <random>
+
+using namespace std;
+
+SCENARIO("Timer wheel")
+{
+	TimerWheel<int> wheel;
+	vector<int> fired;
+	auto onExpired = [&fired](int&& payload) {
+		fired.push_back(payload);
+	};
+
+	WHEN("timers are scheduled")
+	{
+		wheel.Schedule(5, 1);
+		wheel.Schedule(5, 2);
+		wheel.Schedule(70, 3);
+		THEN("they fire when the wheel reaches their tick")
+		{
+			wheel.Advance(4, onExpired);
+			CHECK(fired.empty());
+			wheel.Advance(5, onExpired);
+			sort(fired.begin(), fired.end());
+			CHECK(fired == vector<int>{ 1, 2 });
+			wheel.Advance(69, onExpired);
+			CHECK(fired.size() == 2);
+			wheel.Advance(70, onExpired);
+			CHECK(fired.size() == 3);
+			CHECK(wheel.GetSize() == 0);
+		}
+	}
+
+	WHEN("a timer is cancelled")
+	{
+		auto id = wheel.Schedule(10, 1);
+		wheel.Schedule(10, 2);
+		wheel.Cancel(id);
+		THEN("it doesn't fire")
+		{
+			wheel.Advance(100, onExpired);
+			CHECK(fired == vector<int>{ 2 });
+		}
+		THEN("cancelling it again doesn't affect a timer reusing its node")
+		{
+			wheel.Schedule(20, 3);
+			wheel.Cancel(id);
+			wheel.Advance(100, onExpired);
+			sort(fired.begin(), fired.end());
+			CHECK(fired == vector<int>{ 2, 3 });
+		}
+	}
+
+	WHEN("a timer expires in the past")
+	{
+		wheel.Advance(1000, onExpired);
+		wheel.Schedule(10, 1);
+		THEN("it fires on the next tick")
+		{
+			wheel.Advance(1001, onExpired);
+			CHECK(fired == vector<int>{ 1 });
+		}
+	}
+
+	WHEN("an expiry handler schedules timers")
+	{
+		wheel.Schedule(3, 1);
+		wheel.Advance(10, [&](int&& payload) {
+			fired.push_back(payload);
+			if (payload < 3)
+			{
+				wheel.Schedule(wheel.GetNow() + 2, payload + 1);
+			}
+		});
+		THEN("they fire as usual")
+		{
+			CHECK(fired == vector<int>{ 1, 2, 3 });
+		}
+	}
+}
+
+TEST_CASE("Timer wheel fires timers of every level at their ticks")
+{
+	mt19937_64 random(42);
+	TimerWheel<uint64_t> wheel;
+	// Expiries are stored as payloads, so every timer can check when it fires
+	auto scheduleRandom = [&]() {
+		const unsigned bits = uniform_int_distribution<unsigned>(0, 27)(random);
+		const uint64_t delay = uniform_int_distribution<uint64_t>(0, (uint64_t(1) << bits) - 1)(random);
+		wheel.Schedule(wheel.GetNow() + 1 + delay, wheel.GetNow() + 1 + delay);
+	};
+	for (int i = 0; i < 2000; ++i)
+	{
+		scheduleRandom();
+	}
+
+	size_t firedCount = 0;
+	size_t mistimedCount = 0;
+	while (wheel.GetSize() != 0)
+	{
+		const unsigned bits = uniform_int_distribution<unsigned>(0, 22)(random);
+		const uint64_t now = wheel.GetNow() + uniform_int_distribution<uint64_t>(1, uint64_t(1) << bits)(random);
+		wheel.Advance(now, [&](uint64_t&& expiry) {
+			++firedCount;
+			mistimedCount += expiry != wheel.GetNow();
+			if (firedCount % 4 == 0 && firedCount < 2000)
+			{
+				scheduleRandom();
+			}
+		});
+		CHECK(wheel.GetNow() == now);
+	}
+	CHECK(firedCount == 2499);
+	CHECK(mistimedCount == 0);
+}
@@ -0,0 +1,225 @@
+#pragma once
+
+#include "CacheMetrics.h"
+#include "MapStorage.h"
+#include "WeakMap.h"
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+namespace detail
+{
+
+// Items of keys whose destruction can't be observed have nothing to unsubscribe from
+struct NoSubscription
+{
+};
+
+} // namespace detail
+
+// A cache of values keyed by the identity of shared objects, which doesn't keep the objects alive.
+//
+// Like in WeakMap, items are looked up by the address of the key object. Besides the value, an item
+// keeps a weak pointer to the key, which tells the key object from a new object allocated at the
+// same address after the key is destroyed.
+//
+// An item is purged when either its value or its key is destroyed. Destruction of keys that can be
+// observed like keys of WeakMap (see WeakMapGetDestructionObservable) purges their
+// items right away. Items of other keys are purged when their values are destroyed or by Purge.
+// An item observes its key only while it is in the cache, so a key which outlives its items
+// doesn't collect handlers. Caches used on different threads may share keys, since a
+// DestructionObservable guards its handlers with a lock of its own.
+template <typename Key, typename Val, typename Storage = NodeMapStorage>
+class WeakKeyCacheT : public std::enable_shared_from_this<WeakKeyCacheT<Key, Val, Storage>>
+{
+public:
+	using MyType = WeakKeyCacheT<Key, Val, Storage>;
+	using KeyPtr = std::shared_ptr<Key>;
+	using ValuePtr = std::shared_ptr<Val>;
+	using ValueWeakPtr = std::weak_ptr<Val>;
+	using CacheCleaner = std::function<void()>;
+	using ValueFactory = std::function<ValuePtr(const KeyPtr& key, CacheCleaner d)>;
+
+	explicit WeakKeyCacheT(ValueFactory valueFactory)
+		: m_valueFactory(std::move(valueFactory))
+	{
+	}
+
+	~WeakKeyCacheT()
+	{
+		for (auto& item : m_items)
+		{
+			[[maybe_unused]] auto key = StopObservingKey(item.second);
+		}
+	}
+
+	ValuePtr GetValue(const KeyPtr& key) const
+	{
+		{
+			std::lock_guard lock(m_mutex);
+			if (auto it = m_items.find(key.get()); it != m_items.end() && IsSameObject(it->second.key, key))
+			{
+				if (auto value = it->second.value.lock())
+				{
+					m_metrics.RecordHit();
+					return value;
+				}
+			}
+		}
+
+		auto factoryCallStart = m_metrics.StartFactoryCall();
+		auto value = m_valueFactory(key, MakeValueCleaner(key.get()));
+		m_metrics.RecordMiss(factoryCallStart);
+
+		// Destroyed after the lock is released, since its cleaner locks the cache
+		ValuePtr loser;
+		std::lock_guard lock(m_mutex);
+		return InsertLocked(key, std::move(value), loser);
+	}
+
+	// Erases the items whose keys or values have been destroyed
+	void Purge() const
+	{
+		// Released after the lock, see StopObservingKey
+		std::vector<KeyPtr> observedKeys;
+		std::lock_guard lock(m_mutex);
+		size_t expiredCount = 0;
+		for (auto it = m_items.begin(); it != m_items.end();)
+		{
+			if (it->second.key.expired() || it->second.value.expired())
+			{
+				if constexpr (detail::IsWeakMapKey<Key>::value)
+				{
+					observedKeys.emplace_back();
+					observedKeys.back() = StopObservingKey(it->second);
+				}
+				it = m_items.erase(it);
+				++expiredCount;
+			}
+			else
+			{
+				++it;
+			}
+		}
+		m_metrics.RecordExpirations(expiredCount);
+	}
+
+	// The number of items, including the ones whose keys are destroyed but not purged yet
+	size_t GetSize() const
+	{
+		std::lock_guard lock(m_mutex);
+		return m_items.size();
+	}
+
+	CacheMetricsSnapshot GetMetrics() const
+	{
+		auto metrics = m_metrics.GetSnapshot();
+		std::lock_guard lock(m_mutex);
+		metrics.entries = m_items.size();
+		return metrics;
+	}
+
+private:
+	struct Item
+	{
+		std::weak_ptr<Key> key;
+		ValueWeakPtr value;
+		std::conditional_t<detail::IsWeakMapKey<Key>::value, DestructionObservable::Subscription, detail::NoSubscription>
+			subscription;
+	};
+	using Items = typename Storage::template Map<const Key*, Item, std::hash<const Key*>, std::equal_to<const Key*>>;
+
+	static bool IsSameObject(const std::weak_ptr<Key>& itemKey, const KeyPtr& key) noexcept
+	{
+		return !itemKey.owner_before(key) && !key.owner_before(itemKey);
+	}
+
+	ValuePtr InsertLocked(const KeyPtr& key, ValuePtr value, ValuePtr& loser) const
+	{
+		auto [it, inserted] = m_items.try_emplace(key.get(), Item{ key, value, {} });
+		if (!inserted)
+		{
+			if (IsSameObject(it->second.key, key))
+			{
+				if (auto existing = it->second.value.lock())
+				{
+					loser = std::move(value);
+					return existing;
+				}
+				it->second.value = value;
+				return value;
+			}
+			// The item belongs to a destroyed object which used to live at the same address
+			it->second = Item{ key, value, {} };
+		}
+		ObserveKeyDestruction(*key, it->second);
+		return value;
+	}
+
+	void ObserveKeyDestruction(const Key& key, Item& item) const
+	{
+		if constexpr (detail::IsWeakMapKey<Key>::value)
+		{
+			item.subscription = WeakMapGetDestructionObservable(key).AddDestructionHandler([weakSelf = MyType::weak_from_this(), keyAddr = &key] {
+				if (auto self = weakSelf.lock())
+				{
+					// The key is being destroyed, so its weak pointers have already expired
+					self->EraseItem(keyAddr, [](const Item& item) {
+						return item.key.expired();
+					});
+				}
+			});
+		}
+	}
+
+	// Removes the destruction handler of a live key. The key is returned to be released after
+	// the lock, since its destruction erases items of the cache. The handler of a destroyed key
+	// has been removed by its destruction
+	KeyPtr StopObservingKey(Item& item) const noexcept
+	{
+		if constexpr (detail::IsWeakMapKey<Key>::value)
+		{
+			if (auto key = item.key.lock())
+			{
+				WeakMapGetDestructionObservable(*key).RemoveDestructionHandler(item.subscription);
+				return key;
+			}
+		}
+		return nullptr;
+	}
+
+	CacheCleaner MakeValueCleaner(const Key* keyAddr) const
+	{
+		return [weakSelf = MyType::weak_from_this(), keyAddr] {
+			if (auto self = weakSelf.lock())
+			{
+				self->EraseItem(keyAddr, [](const Item& item) {
+					return item.value.expired();
+				});
+			}
+		};
+	}
+
+	template <typename Pred>
+	void EraseItem(const Key* keyAddr, Pred&& isExpired) const
+	{
+		// Released after the lock, see StopObservingKey
+		KeyPtr observedKey;
+		std::lock_guard lock(m_mutex);
+		if (auto it = m_items.find(keyAddr); it != m_items.end() && isExpired(it->second))
+		{
+			observedKey = StopObservingKey(it->second);
+			m_items.erase(it);
+			m_metrics.RecordExpirations(1);
+		}
+	}
+
+	// Guards m_items. Values must never be released while it is held, since their cleaners lock it
+	mutable std::mutex m_mutex;
+	mutable Items m_items;
+	ValueFactory m_valueFactory;
+	mutable detail::CacheMetricsRecorder m_metrics;
+};
@@ -0,0 +1,198 @@
+#include "pch.h"
+#include "Cache.h"
+#include "WeakKeyCacheT.h"
+
+using namespace std;
+
+namespace
+{
+
+struct Source
+{
+	int id = 0;
+};
+
+struct ObservableSource : DestructionObservable
+{
+	int id = 0;
+};
+
+template <typename Key>
+auto MakeIdCache(size_t& factoryCalls)
+{
+	return make_shared<WeakKeyCacheT<Key, string>>([&factoryCalls](const shared_ptr<Key>& key, auto&& cleaner) {
+		++factoryCalls;
+		return shared_ptr<string>(new string(to_string(key->id)),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	});
+}
+
+} // namespace
+
+SCENARIO("Weak key cache")
+{
+	size_t factoryCalls = 0;
+
+	GIVEN("a cache and a key")
+	{
+		auto cache = MakeIdCache<Source>(factoryCalls);
+		auto key = make_shared<Source>();
+		key->id = 42;
+		auto value = cache->GetValue(key);
+
+		THEN("values are looked up by the identity of the key")
+		{
+			CHECK(*value == "42");
+			CHECK(cache->GetValue(key) == value);
+			CHECK(factoryCalls == 1);
+
+			auto equalKey = make_shared<Source>(*key);
+			CHECK(cache->GetValue(equalKey) != value);
+			CHECK(factoryCalls == 2);
+		}
+
+		THEN("the cache doesn't keep the key alive")
+		{
+			weak_ptr<Source> weakKey = key;
+			key.reset();
+			CHECK(weakKey.expired());
+		}
+
+		WHEN("the value is destroyed")
+		{
+			value.reset();
+			THEN("its item is purged")
+			{
+				CHECK(cache->GetSize() == 0);
+			}
+		}
+
+		WHEN("the key is destroyed while the value is alive")
+		{
+			key.reset();
+			THEN("the item is purged by Purge")
+			{
+				CHECK(cache->GetSize() == 1);
+				cache->Purge();
+				CHECK(cache->GetSize() == 0);
+				CHECK(*value == "42");
+			}
+		}
+	}
+
+	GIVEN("a key whose destruction can be observed")
+	{
+		auto cache = MakeIdCache<ObservableSource>(factoryCalls);
+		auto key = make_shared<ObservableSource>();
+		auto value = cache->GetValue(key);
+
+		WHEN("the key is destroyed while the value is alive")
+		{
+			key.reset();
+			THEN("the item is purged right away")
+			{
+				CHECK(cache->GetSize() == 0);
+			}
+		}
+
+		WHEN("the cache is destroyed before the key and the value")
+		{
+			cache.reset();
+			THEN("they can still be destroyed")
+			{
+				key.reset();
+				value.reset();
+			}
+		}
+
+		WHEN("values of the key are repeatedly created and released")
+		{
+			value.reset();
+			for (int i = 0; i < 1000; ++i)
+			{
+				value = cache->GetValue(key);
+				value.reset();
+			}
+			THEN("the key doesn't collect destruction handlers")
+			{
+				CHECK(key->GetDestructionHandlerCount() == 0);
+				value = cache->GetValue(key);
+				CHECK(key->GetDestructionHandlerCount() == 1);
+				CHECK(factoryCalls == 1002);
+			}
+		}
+
+		WHEN("the cache is destroyed before the key")
+		{
+			cache.reset();
+			THEN("its handler is removed from the key")
+			{
+				CHECK(key->GetDestructionHandlerCount() == 0);
+			}
+		}
+	}
+}
+
+SCENARIO("Weak key caches on different threads share keys")
+{
+	vector<shared_ptr<ObservableSource>> keys(1000);
+	for (auto& key : keys)
+	{
+		key = make_shared<ObservableSource>();
+	}
+	size_t factoryCalls[2] = {};
+	shared_ptr<WeakKeyCacheT<ObservableSource, string>> caches[2] = {
+		MakeIdCache<ObservableSource>(factoryCalls[0]),
+		MakeIdCache<ObservableSource>(factoryCalls[1]),
+	};
+	vector<shared_ptr<string>> values[2];
+
+	vector<thread> threads;
+	for (size_t t = 0; t < 2; ++t)
+	{
+		threads.emplace_back([&, t] {
+			// Every other value is released right away, which stops observing its key
+			for (size_t i = 0; i < keys.size(); ++i)
+			{
+				auto value = caches[t]->GetValue(keys[i]);
+				if (i % 2 == 0)
+				{
+					values[t].push_back(std::move(value));
+				}
+			}
+		});
+	}
+	for (auto& thread : threads)
+	{
+		thread.join();
+	}
+
+	THEN("every cache observes the keys of its items")
+	{
+		CHECK(keys[0]->GetDestructionHandlerCount() == 2);
+		CHECK(keys[1]->GetDestructionHandlerCount() == 0);
+		keys.clear();
+		CHECK(caches[0]->GetSize() == 0);
+		CHECK(caches[1]->GetSize() == 0);
+	}
+}
+
+SCENARIO("Data cache doesn't keep data sources alive")
+{
+	auto cache = make_shared<DataCache>();
+	auto src = make_shared<DataSource>();
+	weak_ptr<DataSource> weakSrc = src;
+
+	auto data = cache->GetValue(src);
+	CHECK(cache->GetValue(src) == data);
+
+	src.reset();
+	CHECK(!weakSrc.expired());
+
+	data.reset();
+	CHECK(weakSrc.expired());
+	CHECK(cache->GetSize() == 0);
+}
@@ -0,0 +1,275 @@
+#pragma once
+
+#include "DestructionObservable.h"
+#include "MapStorage.h"
+#include "WeakSlot.h"
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+namespace detail
+{
+
+// Identifies a key of a weak map by its address. The hash is not cached,
+// since computing it is cheaper than loading it from memory
+template <typename Key>
+struct WeakKey
+{
+	WeakKey(const Key* key)
+		: key(key)
+	{
+	}
+	bool operator==(const WeakKey& rhs) const
+	{
+		return key == rhs.key;
+	}
+	const Key* key;
+};
+
+// The address itself on common implementations. Power of two tables (FlatHashMap, PackedKeyMap)
+// mix hashes themselves, while mixing them here would cost std::unordered_map the locality
+// of ascending heap addresses (see WeakKeyBenchmark)
+struct WeakKeyHasher
+{
+	template <typename Key>
+	size_t operator()(const WeakKey<Key>& key) const noexcept
+	{
+		return std::hash<const Key*>()(key.key);
+	}
+};
+
+// No object lives at null or at the address of one, so they mark free slots of PackedKeyMap
+template <typename Key>
+struct PackedKeyTraits<WeakKey<Key>>
+{
+	static WeakKey<Key> Empty() noexcept
+	{
+		return nullptr;
+	}
+	static WeakKey<Key> Deleted() noexcept
+	{
+		return reinterpret_cast<const Key*>(uintptr_t(1));
+	}
+};
+
+} // namespace detail
+
+enum class WeakMapMode
+{
+	// Values are strongly reachable from the map. A value which owns its key keeps the key,
+	// and thus the item, alive forever
+	Regular,
+	// Values are reachable only through their keys, like in ephemeron tables. Items whose keys
+	// are owned by nothing but their own values are dropped by SweepStep
+	Ephemeron,
+};
+
+// Tells how many strong references to the key a value of a WeakMap holds. Specialize it
+// for values which may own their keys to let ephemeron maps collect such items
+template <typename Val>
+struct EphemeronTraits
+{
+	template <typename Key>
+	static long CountKeyRefs(const Val& /*value*/, const std::shared_ptr<const Key>& /*key*/) noexcept
+	{
+		return 0;
+	}
+};
+
+template <typename T>
+struct EphemeronTraits<std::shared_ptr<T>>
+{
+	template <typename Key>
+	static long CountKeyRefs(const std::shared_ptr<T>& value, const std::shared_ptr<const Key>& key) noexcept
+	{
+		return !value.owner_before(key) && !key.owner_before(value) ? 1 : 0;
+	}
+};
+
+// Keys are registered in their WeakSlots, which erase them from every map
+// when they are destroyed
+template <typename Key, typename Val, typename Storage = NodeMapStorage>
+class WeakMap : private detail::WeakMapBase
+{
+	static_assert(detail::IsWeakMapKey<Key>::value,
+		"Keys must be DestructionObservable descendants or overload WeakMapGetDestructionObservable");
+
+public:
+	using MyType = WeakMap<Key, Val, Storage>;
+	using KeyPtr = std::shared_ptr<const Key>;
+
+	// The number of items SetValue sweeps in the ephemeron mode
+	static constexpr size_t EPHEMERON_SWEEP_STEP = 2;
+
+	explicit WeakMap(WeakMapMode mode = WeakMapMode::Regular)
+		: m_mode(mode)
+	{
+	}
+
+	// Keys are attached to a particular map
+	WeakMap(const WeakMap&) = delete;
+	WeakMap& operator=(const WeakMap&) = delete;
+
+	~WeakMap()
+	{
+		// Items of destroyed keys have been erased, so all the keys are alive
+		for (const auto& item : m_items)
+		{
+			detail::WeakSlot::Detach(*item.first.key, *this);
+		}
+	}
+
+	std::optional<Val> TryGetValue(const KeyPtr& key) const
+	{
+		if (auto it = m_items.find(key.get()); it != m_items.end())
+		{
+			return it->second.value;
+		}
+		return std::nullopt;
+	}
+
+	void RemoveValue(const KeyPtr& key)
+	{
+		if (auto it = m_items.find(key.get()); it != m_items.end())
+		{
+			detail::WeakSlot::Detach(*key, *this);
+			// Destroyed after the item is erased, since it may own other keys of the map
+			[[maybe_unused]] auto value = std::move(it->second.value);
+			EraseItem(it);
+		}
+	}
+
+	template <typename V>
+	void SetValue(const KeyPtr& key, V&& value)
+	{
+		if (m_mode == WeakMapMode::Ephemeron)
+		{
+			SweepStep(EPHEMERON_SWEEP_STEP);
+		}
+
+		WeakKey wkey{ key.get() };
+		if (auto it = m_items.find(wkey); it != m_items.end())
+		{
+			it->second.value = value;
+		}
+		else
+		{
+			detail::WeakSlot::Attach(*key, *this);
+			try
+			{
+				Item item{ std::forward<V>(value) };
+				if (m_mode == WeakMapMode::Ephemeron)
+				{
+					// Grown ahead of the insertion, so that push_back below doesn't throw
+					if (m_ephemeronKeys.size() == m_ephemeronKeys.capacity())
+					{
+						m_ephemeronKeys.reserve(std::max<size_t>(8, m_ephemeronKeys.capacity() * 2));
+					}
+					item.ephemeronIndex = m_ephemeronKeys.size();
+				}
+				m_items.emplace(wkey, std::move(item));
+				if (m_mode == WeakMapMode::Ephemeron)
+				{
+					m_ephemeronKeys.push_back({ key.get(), key });
+				}
+			}
+			catch (...)
+			{
+				detail::WeakSlot::Detach(*key, *this);
+				throw;
+			}
+		}
+	}
+
+	// Checks up to budget items of an ephemeron map and drops the ones whose keys are owned only
+	// by their values, which may destroy the keys and values. Successive calls walk over all
+	// the items, so the cost of a full sweep is spread over many short slices.
+	// Returns the number of dropped items
+	size_t SweepStep(size_t budget)
+	{
+		size_t droppedCount = 0;
+		for (; budget > 0 && !m_ephemeronKeys.empty(); --budget)
+		{
+			if (m_sweepCursor >= m_ephemeronKeys.size())
+			{
+				m_sweepCursor = 0;
+			}
+			auto& ephemeronKey = m_ephemeronKeys[m_sweepCursor];
+			auto it = m_items.find(ephemeronKey.key);
+			assert(it != m_items.end());
+			// The key may be in the middle of its destruction, which erases its item
+			KeyPtr key = ephemeronKey.weakKey.lock();
+
+			// The reference held by the sweeper doesn't count
+			if (!key || key.use_count() - 1 > EphemeronTraits<Val>::CountKeyRefs(it->second.value, key))
+			{
+				++m_sweepCursor;
+				continue;
+			}
+			detail::WeakSlot::Detach(*key, *this);
+			[[maybe_unused]] auto value = std::move(it->second.value);
+			// Moves the last key to the cursor, which is checked next
+			EraseItem(it);
+			++droppedCount;
+			// The key is destroyed along with its value. Both may own keys of this map, whose
+			// items are erased in the meantime
+			key.reset();
+		}
+		return droppedCount;
+	}
+
+	size_t GetSize() const noexcept
+	{
+		return m_items.size();
+	}
+
+private:
+	using WeakKey = detail::WeakKey<Key>;
+
+	static constexpr size_t NO_INDEX = SIZE_MAX;
+
+	struct Item
+	{
+		Val value;
+		// The index of the key in m_ephemeronKeys
+		size_t ephemeronIndex = NO_INDEX;
+	};
+	using Items = typename Storage::template Map<WeakKey, Item, detail::WeakKeyHasher, std::equal_to<WeakKey>>;
+
+	void EraseDestroyedKey(const void* key) noexcept override
+	{
+		if (auto it = m_items.find(WeakKey(static_cast<const Key*>(key))); it != m_items.end())
+		{
+			EraseItem(it);
+		}
+	}
+
+	void EraseItem(typename Items::iterator it) noexcept
+	{
+		if (const size_t index = it->second.ephemeronIndex; index != NO_INDEX)
+		{
+			if (index + 1 != m_ephemeronKeys.size())
+			{
+				m_ephemeronKeys[index] = std::move(m_ephemeronKeys.back());
+				m_items.find(m_ephemeronKeys[index].key)->second.ephemeronIndex = index;
+			}
+			m_ephemeronKeys.pop_back();
+		}
+		m_items.erase(it);
+	}
+
+	struct EphemeronKey
+	{
+		const Key* key;
+		std::weak_ptr<const Key> weakKey;
+	};
+
+	mutable Items m_items;
+	WeakMapMode m_mode;
+	// Keys of an ephemeron map in no particular order, walked over by SweepStep
+	std::vector<EphemeronKey> m_ephemeronKeys;
+	size_t m_sweepCursor = 0;
+};
@@ -0,0 +1,267 @@
+#include "pch.h"
+#include "WeakMap.h"
+
+using namespace std;
+
+namespace
+{
+
+struct FooObservable : DestructionObservable
+{
+};
+
+struct BarDestruction : DestructionObservable
+{
+};
+
+// Reports its destruction through a member rather than a base
+struct Bar
+{
+	BarDestruction destruction;
+};
+
+const DestructionObservable& WeakMapGetDestructionObservable(const Bar& bar) noexcept
+{
+	return bar.destruction;
+}
+
+static_assert(!detail::IsWeakMapKey<int>::value);
+
+} // namespace
+
+SCENARIO("Weak key in a map")
+{
+	GIVEN("a WeakMap")
+	{
+		auto wm = make_shared<WeakMap<FooObservable, int>>();
+
+		auto k = make_shared<FooObservable>();
+		WHEN("trying to get a value for a missing key")
+		{
+			auto v = wm->TryGetValue(k);
+			THEN("empty value is returned")
+			{
+				CHECK(!v);
+			}
+		}
+
+		WHEN("value is set for the key")
+		{
+			wm->SetValue(k, 42);
+			THEN("value")
+			{
+				CHECK(wm->TryGetValue(k).value_or(0) == 42);
+			}
+		}
+	}
+}
+
+SCENARIO("Weak key in a flat WeakMap")
+{
+	auto wm = make_shared<WeakMap<FooObservable, int, FlatMapStorage>>();
+
+	vector<shared_ptr<FooObservable>> keys;
+	for (int i = 0; i < 100; ++i)
+	{
+		keys.push_back(make_shared<FooObservable>());
+		wm->SetValue(keys.back(), i);
+	}
+
+	WHEN("keys are destroyed")
+	{
+		for (size_t i = 0; i < keys.size(); i += 2)
+		{
+			keys[i].reset();
+		}
+		THEN("values of the remaining keys are kept")
+		{
+			for (size_t i = 1; i < keys.size(); i += 2)
+			{
+				REQUIRE(wm->TryGetValue(keys[i]).value_or(-1) == int(i));
+			}
+		}
+	}
+
+	WHEN("a value is removed")
+	{
+		wm->RemoveValue(keys[10]);
+		THEN("it can't be found")
+		{
+			CHECK(!wm->TryGetValue(keys[10]));
+			CHECK(wm->TryGetValue(keys[11]).value_or(-1) == 11);
+		}
+	}
+}
+
+SCENARIO("Keys which overload WeakMapGetDestructionObservable")
+{
+	WeakMap<Bar, int> wm;
+	auto k = make_shared<Bar>();
+	wm.SetValue(k, 42);
+	CHECK(wm.TryGetValue(k).value_or(0) == 42);
+	CHECK(k->destruction.GetDestructionHandlerCount() == 1);
+
+	WHEN("the key is destroyed")
+	{
+		k.reset();
+		THEN("its item is erased")
+		{
+			CHECK(wm.GetSize() == 0);
+		}
+	}
+}
+
+SCENARIO("WeakMap unsubscribes from keys it no longer needs")
+{
+	auto k = make_shared<FooObservable>();
+	auto wm = make_shared<WeakMap<FooObservable, int>>();
+	wm->SetValue(k, 1);
+	wm->SetValue(k, 2);
+	CHECK(k->GetDestructionHandlerCount() == 1);
+
+	WHEN("the value is removed")
+	{
+		wm->RemoveValue(k);
+		THEN("the handler of the key is removed")
+		{
+			CHECK(k->GetDestructionHandlerCount() == 0);
+		}
+	}
+
+	WHEN("the map is destroyed")
+	{
+		auto other = make_shared<WeakMap<FooObservable, int>>();
+		other->SetValue(k, 3);
+		wm.reset();
+		THEN("only the handlers of other maps are kept")
+		{
+			CHECK(k->GetDestructionHandlerCount() == 1);
+			CHECK(other->TryGetValue(k).value_or(0) == 3);
+		}
+	}
+}
+
+SCENARIO("Keys shared by many WeakMaps")
+{
+	auto k = make_shared<FooObservable>();
+	vector<shared_ptr<WeakMap<FooObservable, int>>> maps;
+	for (int i = 0; i < 20; ++i)
+	{
+		maps.push_back(make_shared<WeakMap<FooObservable, int>>());
+		maps.back()->SetValue(k, i);
+	}
+
+	THEN("the key has a single destruction handler")
+	{
+		CHECK(k->GetDestructionHandlerCount() == 1);
+	}
+
+	WHEN("the key is destroyed")
+	{
+		k.reset();
+		THEN("it is erased from all the maps")
+		{
+			auto other = make_shared<FooObservable>();
+			for (auto& map : maps)
+			{
+				CHECK(map->GetSize() == 0);
+				map->SetValue(other, 0);
+			}
+			CHECK(other->GetDestructionHandlerCount() == 1);
+			maps.clear();
+			CHECK(other->GetDestructionHandlerCount() == 0);
+		}
+	}
+
+	WHEN("a value owns another map with the same key")
+	{
+		using MapPtr = shared_ptr<WeakMap<FooObservable, int>>;
+		auto owner = make_shared<WeakMap<FooObservable, MapPtr>>();
+		auto owned = make_shared<WeakMap<FooObservable, int>>();
+		owned->SetValue(k, 1);
+		owner->SetValue(k, owned);
+		weak_ptr<WeakMap<FooObservable, int>> weakOwned = owned;
+		owned.reset();
+		THEN("the key can be destroyed")
+		{
+			k.reset();
+			CHECK(weakOwned.expired());
+		}
+	}
+}
+
+SCENARIO("Ephemeron WeakMap")
+{
+	using KeyPtr = shared_ptr<const FooObservable>;
+	auto wm = make_shared<WeakMap<FooObservable, KeyPtr>>(WeakMapMode::Ephemeron);
+
+	GIVEN("values which own their own keys")
+	{
+		KeyPtr kept;
+		vector<weak_ptr<const FooObservable>> weakKeys;
+		for (int i = 0; i < 10; ++i)
+		{
+			auto k = make_shared<FooObservable>();
+			weakKeys.push_back(k);
+			wm->SetValue(k, k);
+			if (i == 5)
+			{
+				kept = k;
+			}
+		}
+
+		WHEN("the map is swept in bounded steps")
+		{
+			// SetValue has swept a few items already
+			CHECK(wm->GetSize() < 10);
+			CHECK(wm->SweepStep(3) <= 3);
+			while (wm->SweepStep(3) > 0)
+			{
+			}
+			THEN("only the items whose keys are owned by someone else are kept")
+			{
+				CHECK(wm->GetSize() == 1);
+				CHECK(wm->TryGetValue(kept).value_or(nullptr) == kept);
+				for (size_t i = 0; i < weakKeys.size(); ++i)
+				{
+					CHECK(weakKeys[i].expired() == (i != 5));
+				}
+			}
+		}
+	}
+
+	GIVEN("a value which owns another key of the map")
+	{
+		auto k1 = make_shared<FooObservable>();
+		weak_ptr<const FooObservable> weakK2;
+		{
+			auto k2 = make_shared<FooObservable>();
+			weakK2 = k2;
+			wm->SetValue(k2, k2);
+			wm->SetValue(k1, k2);
+		}
+		THEN("the other key is kept while the value is alive")
+		{
+			wm->SweepStep(10);
+			CHECK(!weakK2.expired());
+			CHECK(wm->GetSize() == 2);
+			wm->RemoveValue(k1);
+			wm->SweepStep(10);
+			CHECK(weakK2.expired());
+			CHECK(wm->GetSize() == 0);
+		}
+	}
+
+	GIVEN("a regular map")
+	{
+		auto regular = make_shared<WeakMap<FooObservable, KeyPtr>>();
+		auto k = make_shared<FooObservable>();
+		regular->SetValue(k, k);
+		THEN("it doesn't sweep its items")
+		{
+			CHECK(regular->SweepStep(10) == 0);
+			CHECK(regular->GetSize() == 1);
+			regular->RemoveValue(k);
+		}
+	}
+}
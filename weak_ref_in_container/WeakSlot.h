@@ -0,0 +1,201 @@
+#pragma once
+
+#include "DestructionObservable.h"
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Tells which DestructionObservable reports destruction of a key of weak maps. Keys which aren't
+// DestructionObservable descendants may overload it to be found by argument dependent lookup.
+// The overload is called for keys being destroyed, so it must only locate the observable
+inline const DestructionObservable& WeakMapGetDestructionObservable(const DestructionObservable& key) noexcept
+{
+	return key;
+}
+
+namespace detail
+{
+
+template <typename Key, typename = void>
+struct IsWeakMapKey : std::false_type
+{
+};
+
+template <typename Key>
+struct IsWeakMapKey<Key,
+	std::enable_if_t<std::is_same_v<decltype(WeakMapGetDestructionObservable(std::declval<const Key&>())),
+		const DestructionObservable&>>> : std::true_type
+{
+};
+
+// A map which is told by WeakSlot about destruction of its keys
+class WeakMapBase
+{
+public:
+	// Erases the item of the key, which is being destroyed. Must not throw
+	virtual void EraseDestroyedKey(const void* key) noexcept = 0;
+
+protected:
+	~WeakMapBase() = default;
+};
+
+// The record of the weak maps a key is a key of (its "weak slot"). It is created when the key
+// is added to its first map and lives as long as the key, being the extension of its
+// DestructionObservable. Every slot is guarded by a lock of its own, so maps of unrelated keys
+// never contend.
+//
+// Only the first map a key is added to subscribes to the key's destruction, so a key pays for a
+// single handler no matter how many maps it is a key of. The handler erases the key from every
+// map of its slot.
+class WeakSlot final : public ObservableExtension
+{
+public:
+	// A map may detach a key which has started its destruction, removing the handler before it
+	// is called (see ~ConcurrentWeakMap). Then the slot is destroyed once the map releases the lock
+	~WeakSlot()
+	{
+		std::lock_guard lock(m_mutex);
+	}
+
+	// The map is told the address of the key object, which may differ from the address
+	// of its DestructionObservable
+	template <typename Key>
+	static void Attach(const Key& key, WeakMapBase& map)
+	{
+		const DestructionObservable& observable = WeakMapGetDestructionObservable(key);
+		auto& slot = Of(observable);
+		std::lock_guard lock(slot.m_mutex);
+		if (slot.IsEmpty())
+		{
+			slot.m_subscription = observable.AddDestructionHandler([&slot] {
+				slot.OnDestroyed();
+			});
+		}
+		try
+		{
+			slot.AddMap({ &map, &key });
+		}
+		catch (...)
+		{
+			if (slot.IsEmpty())
+			{
+				observable.RemoveDestructionHandler(slot.m_subscription);
+			}
+			throw;
+		}
+	}
+
+	template <typename Key>
+	static void Detach(const Key& key, WeakMapBase& map) noexcept
+	{
+		const DestructionObservable& observable = WeakMapGetDestructionObservable(key);
+		auto& slot = Of(observable);
+		std::lock_guard lock(slot.m_mutex);
+		if (slot.RemoveMap(map) && slot.IsEmpty())
+		{
+			observable.RemoveDestructionHandler(slot.m_subscription);
+		}
+	}
+
+	// Destruction of a key erases it from its maps under the lock of the key. Maps guarded by locks
+	// of their own take the lock of a key before theirs whenever they attach or detach the key
+	template <typename Key>
+	static std::unique_lock<std::recursive_mutex> Lock(const Key& key)
+	{
+		return std::unique_lock(Of(WeakMapGetDestructionObservable(key)).m_mutex);
+	}
+
+	// Doesn't wait for the lock, so it may be tried while the lock of a map is held
+	template <typename Key>
+	static std::unique_lock<std::recursive_mutex> TryLock(const Key& key)
+	{
+		return std::unique_lock(Of(WeakMapGetDestructionObservable(key)).m_mutex, std::try_to_lock);
+	}
+
+private:
+	struct MapKey
+	{
+		WeakMapBase* map = nullptr;
+		const void* key = nullptr;
+	};
+
+	// Allocating the slot may throw, so it is created by Attach before anything is changed.
+	// A slot which has been created already is never freed before its key
+	static WeakSlot& Of(const DestructionObservable& observable)
+	{
+		return static_cast<WeakSlot&>(observable.GetOrCreateExtension([] {
+			return std::make_unique<WeakSlot>();
+		}));
+	}
+
+	bool IsEmpty() const noexcept
+	{
+		return !m_firstMap.map;
+	}
+
+	void AddMap(const MapKey& mapKey)
+	{
+		if (IsEmpty())
+		{
+			m_firstMap = mapKey;
+		}
+		else
+		{
+			m_otherMaps.push_back(mapKey);
+		}
+	}
+
+	bool RemoveMap(const WeakMapBase& map) noexcept
+	{
+		if (m_firstMap.map == &map)
+		{
+			m_firstMap = m_otherMaps.empty() ? MapKey() : TakeLastMap();
+			return true;
+		}
+		auto it = std::find_if(m_otherMaps.begin(), m_otherMaps.end(), [&map](const MapKey& mapKey) {
+			return mapKey.map == &map;
+		});
+		if (it == m_otherMaps.end())
+		{
+			return false;
+		}
+		*it = m_otherMaps.back();
+		m_otherMaps.pop_back();
+		return true;
+	}
+
+	MapKey TakeLastMap() noexcept
+	{
+		if (m_otherMaps.empty())
+		{
+			return std::exchange(m_firstMap, MapKey());
+		}
+		auto mapKey = m_otherMaps.back();
+		m_otherMaps.pop_back();
+		return mapKey;
+	}
+
+	void OnDestroyed() noexcept
+	{
+		// The lock is held while maps erase their items, so that they can't be destroyed meanwhile.
+		// It is recursive, since erased values may own maps of the same key. Maps are taken out of
+		// the slot one by one, so that maps destroyed by erased values detach from the slot as usual
+		std::lock_guard lock(m_mutex);
+		while (!IsEmpty())
+		{
+			auto mapKey = TakeLastMap();
+			mapKey.map->EraseDestroyedKey(mapKey.key);
+		}
+	}
+
+	std::recursive_mutex m_mutex;
+	DestructionObservable::Subscription m_subscription;
+	// Most keys belong to a single map, which is kept in the slot itself
+	MapKey m_firstMap;
+	std::vector<MapKey> m_otherMaps;
+};
+
+} // namespace detail
@@ -1,61 +1,9 @@
 #include "pch.h"
+#include "Cache.h"
+#include "WeakMap.h"
 
 using namespace std;
 
-class Obj
-{
-};
-using ObjWeakPtr = weak_ptr<Obj>;
-using ObjPtr = shared_ptr<Obj>;
-
-class Cache : public enable_shared_from_this<Cache>
-{
-public:
-	ObjPtr GetObjectById(const string& key) const
-	{
-		ObjPtr obj;
-		if (auto item = m_items.find(key);
-			item != m_items.end())
-		{
-			obj = item->second.lock();
-		}
-
-		if (!obj)
-		{
-			obj.reset(new Obj(), [key, weakSelf = weak_from_this()](Obj* p) {
-				if (auto self = weakSelf.lock())
-				{
-					self->m_items.erase(key);
-				}
-				delete p;
-			});
-			m_items.insert_or_assign(key, obj);
-		}
-
-		return obj;
-	}
-
-private:
-	mutable unordered_map<string, ObjWeakPtr> m_items;
-};
-
-struct DataSource
-{
-};
-using DataSourcePtr = shared_ptr<DataSource>;
-
-struct Data
-{
-	explicit Data(DataSourcePtr dataSrc)
-		: m_dataSrc(move(dataSrc))
-	{
-	}
-
-private:
-	DataSourcePtr m_dataSrc;
-};
-using DataPtr = shared_ptr<Data>;
-
 /*
 class WeakCache : public enable_shared_from_this<WeakCache>
 {
@@ -90,96 +38,11 @@ private:
 };
 */
 
-template <typename Key, typename Val, typename Hasher = hash<Key>, typename KeyEq = equal_to<Key>>
-class CacheT : public enable_shared_from_this<CacheT<Key, Val>>
-{
-public:
-	using MyType = CacheT<Key, Val, Hasher, KeyEq>;
-	using ValuePtr = shared_ptr<Val>;
-	using ValueWeakPtr = weak_ptr<Val>;
-	using CacheCleaner = function<void()>;
-	using ValueFactory = function<ValuePtr(const Key& key, CacheCleaner d)>;
-
-	CacheT(ValueFactory valueFactory)
-		: m_valueFactory(move(valueFactory))
-	{
-	}
-
-	ValuePtr GetValue(const Key& key) const
-	{
-		ValuePtr value;
-		if (auto it = m_items.find(key); it != m_items.end())
-		{
-			value = it->second.lock();
-		}
-
-		if (!value)
-		{
-			value = m_valueFactory(key, [weakSelf = MyType::weak_from_this(), key] {
-				if (auto self = weakSelf.lock())
-					self->m_items.erase(key);
-			});
-			m_items.emplace(key, value);
-		}
-		return value;
-	}
-
-private:
-	mutable std::unordered_map<Key, ValueWeakPtr> m_items;
-	ValueFactory m_valueFactory;
-};
-
-class DataCache : public CacheT<DataSourcePtr, Data>
-{
-public:
-	DataCache()
-		: CacheT(DataCache::DataFactory)
-	{
-	}
-
-private:
-	static DataPtr DataFactory(const DataSourcePtr& key, CacheCleaner cleaner)
-	{
-		return DataPtr(new Data(key), [cleaner = move(cleaner)](Data* d) {
-			cleaner();
-			delete d;
-		});
-	}
-};
-
 namespace detail
 {
 
 } // namespace detail
 
-class DestructionObservable
-{
-public:
-	template <typename Handler>
-	void AddDestructionHandler(Handler&& handler) const
-	{
-		m_destructionObservers.emplace_back(forward<Handler>(handler));
-	}
-
-protected:
-	~DestructionObservable() noexcept
-	{
-		for (auto&& handler : m_destructionObservers)
-		{
-			try
-			{
-				handler();
-			}
-			catch (...)
-			{
-			}
-		}
-	}
-
-private:
-	mutable vector<function<void()>> m_destructionObservers;
-};
-
 /*
 template <typename T>
 class SharedPtr
@@ -253,121 +116,927 @@ SharedPtr<T> MakeShared(Args&&... args)
 }
 */
 
-template <typename Key, typename Val>
-class WeakMap : public enable_shared_from_this<WeakMap<Key, Val>>
+SCENARIO("Template cache test")
 {
-public:
-	using MyType = WeakMap<Key, Val>;
-	using KeyPtr = shared_ptr<const Key>;
+	CacheT<string, string> cache([](const string& key, auto&& cleaner) {
+		return shared_ptr<string>(new string("value for:" + key),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	});
+	CHECK(*cache.GetValue("one") == "value for:one");
+}
 
-	optional<Val> TryGetValue(const KeyPtr& key) const
+SCENARIO("Template cache with a flat backing store")
+{
+	using FlatCache = CacheT<int, string, hash<int>, equal_to<int>, FlatMapStorage>;
+	auto cache = make_shared<FlatCache>([](const int& key, auto&& cleaner) {
+		return shared_ptr<string>(new string(to_string(key)),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	});
+
+	vector<FlatCache::ValuePtr> values;
+	for (int i = 0; i < 1000; ++i)
 	{
-		if (auto it = m_items.find(key.get()); it != m_items.end())
-		{
-			return it->second;
-		}
-		return nullopt;
+		values.push_back(cache->GetValue(i));
 	}
+	CHECK(cache->GetValue(500) == values[500]);
+
+	weak_ptr<string> weakValue = values[500];
+	values.clear();
+	CHECK(weakValue.expired());
+	CHECK(*cache->GetValue(500) == "500");
+}
+
+SCENARIO("Deferred eviction of cache items")
+{
+	auto cache = make_shared<CacheT<int, string>>([](const int& key, auto&& cleaner) {
+		return shared_ptr<string>(new string(to_string(key)),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	},
+		EvictionMode::Deferred);
 
-	void RemoveValue(const KeyPtr& key)
+	vector<shared_ptr<string>> values;
+	for (int i = 0; i < 100; ++i)
 	{
-		m_items.erase(WeakKey(key.get()));
+		values.push_back(cache->GetValue(i));
 	}
 
-	template <typename V>
-	void SetValue(const KeyPtr& key, V&& value)
+	WHEN("values are released")
 	{
-		WeakKey wkey{ key.get() };
-		if (auto it = m_items.find(wkey); it != m_items.end())
+		values.resize(50);
+		THEN("their items are kept until the next sweep")
 		{
-			it->second = value;
+			CHECK(cache->GetSize() == 100);
+			cache->Sweep();
+			CHECK(cache->GetSize() == 50);
 		}
-		else
+		THEN("their items are swept by the next GetValue")
 		{
-			WeakMapAddDestructionHandler(*key,
-				[weakSelf = MyType::weak_from_this(), wkey]() mutable {
-					if (auto self = weakSelf.lock())
-						self->m_items.erase(wkey);
-					weakSelf.reset();
-				});
-
-			m_items.emplace(wkey, forward<V>(value));
+			CHECK(*cache->GetValue(0) == "0");
+			CHECK(cache->GetSize() == 50);
 		}
 	}
 
-private:
-	struct WeakKey
+	WHEN("values are released by other threads")
 	{
-		WeakKey(const Key* key)
-			: key(key)
-			, hash(std::hash<const Key*>()(key))
+		vector<thread> threads;
+		for (size_t i = 0; i < 4; ++i)
 		{
+			vector<shared_ptr<string>> part(values.begin() + i * 25, values.begin() + (i + 1) * 25);
+			threads.emplace_back([part = move(part)]() mutable {
+				part.clear();
+			});
 		}
-		bool operator==(const WeakKey& rhs) const
+		values.clear();
+		for (auto& t : threads)
 		{
-			return key == rhs.key;
+			t.join();
 		}
-		const Key* key;
-		size_t hash;
-	};
+		THEN("all the items are swept")
+		{
+			cache->Sweep();
+			CHECK(cache->GetSize() == 0);
+		}
+	}
 
-	struct Hasher
+	WHEN("the cache is destroyed before its values")
 	{
-		size_t operator()(const WeakKey& key) const
+		cache.reset();
+		THEN("the values can still be released")
 		{
-			return key.hash;
+			values.clear();
 		}
+	}
+}
+
+SCENARIO("Batch access to cache values")
+{
+	auto makeValue = [](int key, function<void()> cleaner) {
+		return shared_ptr<string>(new string(to_string(key)),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
 	};
-	mutable unordered_map<WeakKey, Val, Hasher> m_items;
-};
+	size_t factoryCalls = 0;
+	vector<vector<int>> batches;
+	auto makeCaches = [&]() {
+		auto valueFactory = [&](const int& key, auto&& cleaner) {
+			++factoryCalls;
+			return makeValue(key, std::move(cleaner));
+		};
+		auto batchFactory = [&](const vector<int>& keys, vector<function<void()>> cleaners) {
+			batches.push_back(keys);
+			vector<shared_ptr<string>> values;
+			for (size_t i = 0; i < keys.size(); ++i)
+			{
+				values.push_back(makeValue(keys[i], std::move(cleaners[i])));
+			}
+			return values;
+		};
+		using FlatCache = CacheT<int, string, hash<int>, equal_to<int>, FlatMapStorage>;
+		return make_pair(make_shared<CacheT<int, string>>(valueFactory, batchFactory),
+			make_shared<FlatCache>(valueFactory, batchFactory));
+	};
+	auto [nodeCache, flatCache] = makeCaches();
+
+	auto checkBatch = [&](auto& cache) {
+		auto cached = cache->GetValue(2);
+		batches.clear();
+		factoryCalls = 0;
 
-struct FooObservable : DestructionObservable
+		auto values = cache->GetValues({ 1, 2, 3, 1, 4 });
+
+		REQUIRE(values.size() == 5);
+		CHECK(*values[0] == "1");
+		CHECK(values[1] == cached);
+		CHECK(*values[2] == "3");
+		CHECK(values[3] == values[0]);
+		CHECK(*values[4] == "4");
+		// Only the distinct misses are passed to the batch factory, in a single call
+		REQUIRE(batches.size() == 1);
+		CHECK(batches[0] == vector<int>{ 1, 3, 4 });
+		CHECK(factoryCalls == 0);
+		CHECK(cache->GetSize() == 4);
+
+		auto hits = cache->GetValues({ 4, 3 });
+		CHECK(hits[0] == values[4]);
+		CHECK(hits[1] == values[2]);
+		CHECK(batches.size() == 1);
+
+		auto metrics = cache->GetMetrics();
+		CHECK(metrics.hits == 3);
+		CHECK(metrics.misses == 4);
+
+		values.clear();
+		hits.clear();
+		CHECK(cache->GetSize() == 1);
+	};
+
+	WHEN("values are requested in a batch from a node-based cache")
+	{
+		checkBatch(nodeCache);
+	}
+
+	WHEN("values are requested in a batch from a flat cache")
+	{
+		checkBatch(flatCache);
+	}
+
+	WHEN("there is no batch factory")
+	{
+		auto cache = make_shared<CacheT<int, string>>([&](const int& key, auto&& cleaner) {
+			++factoryCalls;
+			return makeValue(key, std::move(cleaner));
+		});
+		auto values = cache->GetValues({ 5, 6, 5 });
+		THEN("the value factory is called per distinct miss")
+		{
+			CHECK(factoryCalls == 2);
+			CHECK(*values[0] == "5");
+			CHECK(*values[1] == "6");
+			CHECK(values[2] == values[0]);
+		}
+	}
+}
+
+SCENARIO("Concurrent access to a cache")
 {
-};
+	auto cache = make_shared<CacheT<int, string>>([](const int& key, auto&& cleaner) {
+		return shared_ptr<string>(new string(to_string(key)),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	});
 
-template <typename Handler>
-void WeakMapAddDestructionHandler(const DestructionObservable& d, Handler&& h)
+	// Catch assertions may not be used in other threads
+	atomic<bool> mismatch = false;
+	vector<thread> threads;
+	for (int t = 0; t < 4; ++t)
+	{
+		threads.emplace_back([cache, t, &mismatch] {
+			vector<int> keys(16);
+			for (int i = 0; i < 1000; ++i)
+			{
+				iota(keys.begin(), keys.end(), (i + t) % 64);
+				auto values = cache->GetValues(keys);
+				auto value = cache->GetValue(keys[0]);
+				if (*values[0] != *value)
+				{
+					mismatch = true;
+				}
+			}
+		});
+	}
+	for (auto& t : threads)
+	{
+		t.join();
+	}
+	CHECK(!mismatch);
+	CHECK(cache->GetSize() == 0);
+}
+
+SCENARIO("Time-based expiry of cache values")
 {
-	d.AddDestructionHandler(forward<Handler>(h));
+	using StringCache = CacheT<int, string>;
+	using namespace std::chrono_literals;
+	auto now = StringCache::TimePoint();
+	int version = 0;
+	auto cache = make_shared<StringCache>([&version](const int& key, auto&& cleaner) {
+		return shared_ptr<string>(new string(to_string(key) + "." + to_string(++version)),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	});
+	vector<function<void()>> tasks;
+	StringCache::ExpiryPolicy policy;
+	policy.timeToLive = 100ms;
+	policy.tick = 1ms;
+	policy.now = [&now] { return now; };
+
+	WHEN("values outlive their time to live")
+	{
+		cache->SetExpiryPolicy(policy);
+		auto value = cache->GetValue(1);
+		now += 99ms;
+		CHECK(cache->GetValue(1) == value);
+		now += 1ms;
+		THEN("fresh values are created, and old values are kept by their holders")
+		{
+			auto freshValue = cache->GetValue(1);
+			CHECK(*freshValue == "1.2");
+			CHECK(*value == "1.1");
+			CHECK(cache->GetValue(1) == freshValue);
+			value.reset();
+			CHECK(cache->GetValue(1) == freshValue);
+		}
+		THEN("the expired items are erased by a sweep")
+		{
+			CHECK(cache->GetSize() == 1);
+			cache->Sweep();
+			CHECK(cache->GetSize() == 0);
+			CHECK(cache->GetMetrics().expirations == 1);
+			value.reset();
+			CHECK(cache->GetMetrics().expirations == 1);
+		}
+		THEN("batches get fresh values as well")
+		{
+			auto values = cache->GetValues({ 1, 2 });
+			CHECK(*values[0] == "1.2");
+			CHECK(*values[1] == "2.3");
+		}
+	}
+
+	WHEN("values have time to live of their own")
+	{
+		policy.getTimeToLive = [](const int& key, const string&) {
+			return key * 10ms;
+		};
+		cache->SetExpiryPolicy(policy);
+		auto values = cache->GetValues({ 1, 5, 0 });
+		now += 20ms;
+		THEN("they expire at different times")
+		{
+			CHECK(cache->GetValue(1) != values[0]);
+			CHECK(cache->GetValue(5) == values[1]);
+			// Zero time to live means forever
+			now += 1h;
+			CHECK(cache->GetValue(0) == values[2]);
+		}
+	}
+
+	WHEN("stale values may be served while they are revalidated")
+	{
+		policy.staleWhileRevalidate = 50ms;
+		policy.executor = [&tasks](function<void()> task) {
+			tasks.push_back(std::move(task));
+		};
+		cache->SetExpiryPolicy(policy);
+		auto value = cache->GetValue(1);
+		now += 120ms;
+		THEN("the stale value is returned until the refresh completes")
+		{
+			CHECK(cache->GetValue(1) == value);
+			CHECK(cache->GetValue(1) == value);
+			REQUIRE(tasks.size() == 1);
+			tasks[0]();
+			// The refreshed value is kept alive until it is requested
+			auto freshValue = cache->GetValue(1);
+			CHECK(*freshValue == "1.2");
+			CHECK(*value == "1.1");
+			CHECK(cache->GetValue(1) == freshValue);
+			CHECK(tasks.size() == 1);
+		}
+		THEN("values past the stale period are created anew")
+		{
+			now += 30ms;
+			CHECK(*cache->GetValue(1) == "1.2");
+			CHECK(tasks.empty());
+		}
+		THEN("refreshed values which nobody requests are released on expiry")
+		{
+			CHECK(cache->GetValue(1) == value);
+			tasks[0]();
+			value.reset();
+			CHECK(cache->GetSize() == 1);
+			now += 150ms;
+			cache->Sweep();
+			CHECK(cache->GetSize() == 0);
+		}
+		THEN("a refresh of a destroyed cache does nothing")
+		{
+			CHECK(cache->GetValue(1) == value);
+			cache.reset();
+			tasks[0]();
+			CHECK(version == 1);
+		}
+	}
+
+	WHEN("the policy is set after the cache is used")
+	{
+		auto value = cache->GetValue(1);
+		THEN("it is an error")
+		{
+			CHECK_THROWS_AS(cache->SetExpiryPolicy(policy), logic_error);
+		}
+	}
 }
 
-SCENARIO("Weak key in a map")
+SCENARIO("Thread-local front cache")
 {
-	GIVEN("a WeakMap")
+	using StringCache = CacheT<int, string>;
+	atomic<int> factoryCalls = 0;
+	auto cache = make_shared<StringCache>([&factoryCalls](const int& key, auto&& cleaner) {
+		++factoryCalls;
+		return shared_ptr<string>(new string(to_string(key)),
+			[cleaner = std::move(cleaner)](string* s) {
+				cleaner();
+				delete s;
+			});
+	});
+	cache->EnableFrontCache();
+	StringCache::ReleaseFrontCacheValues();
+
+	WHEN("a value is requested again")
 	{
-		auto wm = make_shared<WeakMap<FooObservable, int>>();
+		auto value = cache->GetValue(1);
+		THEN("it is served by the front cache")
+		{
+			CHECK(cache->GetValue(1) == value);
+			auto metrics = cache->GetMetrics();
+			CHECK(metrics.hits == 1);
+			CHECK(metrics.misses == 1);
+		}
+	}
 
-		auto k = make_shared<FooObservable>();
-		WHEN("trying to get a value for a missing key")
+	WHEN("the value is released by its holders")
+	{
+		weak_ptr<string> weakValue = cache->GetValue(1);
+		THEN("the front cache doesn't keep it alive")
 		{
-			auto v = wm->TryGetValue(k);
-			THEN("empty value is returned")
-			{
-				CHECK(!v);
-			}
+			CHECK(weakValue.expired());
+			CHECK(cache->GetSize() == 0);
+			CHECK(*cache->GetValue(1) == "1");
+			CHECK(factoryCalls == 2);
 		}
+	}
 
-		WHEN("value is set for the key")
+	WHEN("a value in the front cache is replaced")
+	{
+		auto value = cache->GetValue(1);
+		CHECK(cache->GetValue(1) == value);
+		weak_ptr<string> weakValue = value;
+		value.reset();
+		value = cache->GetValue(1);
+		THEN("the thread gets the new value")
 		{
-			wm->SetValue(k, 42);
-			THEN("value")
-			{
-				CHECK(wm->TryGetValue(k).value_or(0) == 42);
-			}
+			CHECK(weakValue.expired());
+			CHECK(cache->GetValue(1) == value);
+			CHECK(factoryCalls == 2);
+		}
+	}
+
+	WHEN("another cache of the same type uses the front cache")
+	{
+		auto otherCache = make_shared<StringCache>([](const int& key, auto&&) {
+			return make_shared<string>("other " + to_string(key));
+		});
+		otherCache->EnableFrontCache();
+		auto value = cache->GetValue(1);
+		auto otherValue = otherCache->GetValue(1);
+		THEN("the caches don't get each other's values")
+		{
+			CHECK(cache->GetValue(1) == value);
+			CHECK(otherCache->GetValue(1) == otherValue);
+			CHECK(*otherValue == "other 1");
 		}
 	}
+
+	WHEN("values expire")
+	{
+		using namespace std::chrono_literals;
+		auto now = StringCache::TimePoint();
+		auto expiringCache = make_shared<StringCache>([](const int& key, auto&&) {
+			return make_shared<string>(to_string(key));
+		});
+		StringCache::ExpiryPolicy policy;
+		policy.timeToLive = 10ms;
+		policy.now = [&now] { return now; };
+		expiringCache->SetExpiryPolicy(policy);
+		expiringCache->EnableFrontCache();
+		auto value = expiringCache->GetValue(1);
+		CHECK(expiringCache->GetValue(1) == value);
+		now += 10ms;
+		THEN("the front cache doesn't serve them")
+		{
+			CHECK(expiringCache->GetValue(1) != value);
+		}
+	}
+
+	WHEN("many threads request the same keys")
+	{
+		atomic<bool> mismatch = false;
+		vector<thread> threads;
+		for (int t = 0; t < 4; ++t)
+		{
+			threads.emplace_back([cache, &mismatch] {
+				for (int i = 0; i < 10000; ++i)
+				{
+					const int key = i % 8;
+					if (*cache->GetValue(key) != to_string(key))
+					{
+						mismatch = true;
+					}
+				}
+				StringCache::ReleaseFrontCacheValues();
+			});
+		}
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+		THEN("they get the right values")
+		{
+			CHECK(!mismatch);
+			CHECK(cache->GetSize() == 0);
+		}
+	}
+
+	StringCache::ReleaseFrontCacheValues();
 }
 
-SCENARIO("Template cache test")
+SCENARIO("Asynchronous access to cache values")
 {
-	CacheT<string, string> cache([](const string& key, auto&& cleaner) {
-		return shared_ptr<string>(new string("value for:" + key),
+	using namespace std::chrono_literals;
+	using StringCache = CacheT<int, string>;
+	atomic<int> factoryCalls = 0;
+	bool isFactoryFailing = false;
+	auto cache = make_shared<StringCache>([&](const int& key, auto&& cleaner) {
+		++factoryCalls;
+		if (isFactoryFailing)
+		{
+			throw runtime_error("can't create " + to_string(key));
+		}
+		return shared_ptr<string>(new string(to_string(key)),
 			[cleaner = std::move(cleaner)](string* s) {
 				cleaner();
 				delete s;
 			});
 	});
-	CHECK(*cache.GetValue("one") == "value for:one");
+	vector<function<void()>> tasks;
+	auto executor = [&tasks](function<void()> task) {
+		tasks.push_back(std::move(task));
+	};
+
+	WHEN("a value is cached")
+	{
+		auto value = cache->GetValue(1);
+		auto futureValue = cache->GetValueAsync(1, executor);
+		THEN("it is returned without the executor")
+		{
+			CHECK(futureValue.wait_for(0s) == future_status::ready);
+			CHECK(futureValue.get() == value);
+			CHECK(tasks.empty());
+		}
+	}
+
+	WHEN("a value is requested many times while it is being created")
+	{
+		auto first = cache->GetValueAsync(1, executor);
+		auto second = cache->GetValueAsync(1, executor);
+		auto other = cache->GetValueAsync(2, executor);
+		THEN("the requests share a factory call")
+		{
+			REQUIRE(tasks.size() == 2);
+			CHECK(first.wait_for(0s) == future_status::timeout);
+			tasks[0]();
+			CHECK(*first.get() == "1");
+			CHECK(second.get() == first.get());
+			CHECK(cache->GetValue(1) == first.get());
+			tasks[1]();
+			CHECK(*other.get() == "2");
+			CHECK(factoryCalls == 2);
+			auto metrics = cache->GetMetrics();
+			CHECK(metrics.misses == 2);
+			CHECK(metrics.hits == 2);
+		}
+		THEN("a load completed after the key got another value returns that value")
+		{
+			auto value = cache->GetValue(1);
+			tasks[0]();
+			CHECK(first.get() == value);
+		}
+	}
+
+	WHEN("the factory fails")
+	{
+		isFactoryFailing = true;
+		auto first = cache->GetValueAsync(1, executor);
+		auto second = cache->GetValueAsync(1, executor);
+		tasks[0]();
+		THEN("all the requests get the exception")
+		{
+			CHECK_THROWS_AS(first.get(), runtime_error);
+			CHECK_THROWS_AS(second.get(), runtime_error);
+		}
+		THEN("the next request tries again")
+		{
+			isFactoryFailing = false;
+			auto third = cache->GetValueAsync(1, executor);
+			REQUIRE(tasks.size() == 2);
+			tasks[1]();
+			CHECK(*third.get() == "1");
+		}
+	}
+
+	WHEN("the executor fails")
+	{
+		auto futureValue = cache->GetValueAsync(1, [](function<void()>) {
+			throw runtime_error("executor is stopped");
+		});
+		THEN("the future gets the exception")
+		{
+			CHECK_THROWS_AS(futureValue.get(), runtime_error);
+			CHECK(cache->GetValueAsync(1, executor).wait_for(0s) == future_status::timeout);
+		}
+	}
+
+	WHEN("the executor destroys the task without running it")
+	{
+		auto futureValue = cache->GetValueAsync(1, [](function<void()>) {
+		});
+		THEN("the future is broken")
+		{
+			CHECK_THROWS_AS(futureValue.get(), future_error);
+		}
+		THEN("the next request starts a new load")
+		{
+			auto nextValue = cache->GetValueAsync(1, executor);
+			REQUIRE(tasks.size() == 1);
+			tasks[0]();
+			CHECK(*nextValue.get() == "1");
+			CHECK(factoryCalls == 1);
+			CHECK(cache->GetMetrics().hits == 0);
+		}
+	}
+
+	WHEN("the cache is destroyed before the value is created")
+	{
+		auto futureValue = cache->GetValueAsync(1, executor);
+		cache.reset();
+		tasks[0]();
+		tasks.clear();
+		THEN("the future is broken")
+		{
+			CHECK_THROWS_AS(futureValue.get(), future_error);
+		}
+	}
+
+	WHEN("many threads request the same keys")
+	{
+		mutex loadThreadsMutex;
+		vector<thread> loadThreads;
+		auto threadExecutor = [&](function<void()> task) {
+			lock_guard lock(loadThreadsMutex);
+			loadThreads.emplace_back(std::move(task));
+		};
+		vector<shared_future<StringCache::ValuePtr>> futureValues(64);
+		vector<thread> threads;
+		for (size_t t = 0; t < 4; ++t)
+		{
+			threads.emplace_back([&, t] {
+				for (size_t i = t; i < futureValues.size(); i += 4)
+				{
+					futureValues[i] = cache->GetValueAsync(int(i % 4), threadExecutor);
+				}
+			});
+		}
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+		for (auto& t : loadThreads)
+		{
+			t.join();
+		}
+		THEN("every key gets a single value")
+		{
+			for (size_t i = 0; i < futureValues.size(); ++i)
+			{
+				CHECK(futureValues[i].get() == futureValues[i % 4].get());
+			}
+			// The futures hold the values, so later requests hit them
+			CHECK(factoryCalls == 4);
+		}
+	}
+}
+
+SCENARIO("Negative caching of cache values")
+{
+	using namespace std::chrono_literals;
+	using StringCache = CacheT<int, string>;
+	int factoryCalls = 0;
+	// Negative keys are absent, keys above 100 fail
+	auto makeValue = [&factoryCalls](int key, function<void()> cleaner) -> shared_ptr<string> {
+		++factoryCalls;
+		if (key < 0)
+		{
+			return nullptr;
+		}
+		if (key > 100)
+		{
+			throw runtime_error("backend failed for " + to_string(key));
+		}
+		return shared_ptr<string>(new string(to_string(key)), [cleaner = std::move(cleaner)](string* s) {
+			cleaner();
+			delete s;
+		});
+	};
+	auto cache = make_shared<StringCache>(
+		[makeValue](const int& key, auto&& cleaner) {
+			return makeValue(key, std::move(cleaner));
+		},
+		[makeValue](const vector<int>& keys, vector<function<void()>> cleaners) {
+			vector<shared_ptr<string>> values;
+			for (size_t i = 0; i < keys.size(); ++i)
+			{
+				values.push_back(makeValue(keys[i], std::move(cleaners[i])));
+			}
+			return values;
+		});
+	auto now = StringCache::TimePoint();
+	StringCache::NegativeCachingPolicy policy;
+	policy.absentTimeToLive = 100ms;
+	policy.errorTimeToLive = 10ms;
+	policy.now = [&now] { return now; };
+	cache->SetNegativeCaching(policy);
+
+	WHEN("an absent key is requested again")
+	{
+		CHECK(!cache->GetValue(-1));
+		CHECK(!cache->GetValue(-1));
+		THEN("the factory is not called until the negative entry expires")
+		{
+			CHECK(factoryCalls == 1);
+			CHECK(cache->GetSize() == 0);
+			CHECK(cache->GetMetrics().hits == 1);
+			now += 100ms;
+			CHECK(!cache->GetValue(-1));
+			CHECK(factoryCalls == 2);
+		}
+	}
+
+	WHEN("a failing key is requested again")
+	{
+		CHECK_THROWS_AS(cache->GetValue(101), runtime_error);
+		THEN("the exception is rethrown until the negative entry expires")
+		{
+			CHECK_THROWS_WITH(cache->GetValue(101), "backend failed for 101");
+			CHECK(factoryCalls == 1);
+			now += 10ms;
+			CHECK_THROWS_AS(cache->GetValue(101), runtime_error);
+			CHECK(factoryCalls == 2);
+		}
+	}
+
+	WHEN("values are looked up without exceptions")
+	{
+		auto present = cache->TryGetValue(1);
+		auto absent = cache->TryGetValue(-1);
+		auto failed = cache->TryGetValue(101);
+		THEN("absent keys are told from failures")
+		{
+			CHECK(present.status == CacheValueStatus::Present);
+			CHECK(*present.value == "1");
+			CHECK(absent.status == CacheValueStatus::Absent);
+			CHECK(!absent.value);
+			CHECK(!absent.error);
+			CHECK(failed.status == CacheValueStatus::Failed);
+			CHECK_THROWS_AS(rethrow_exception(failed.error), runtime_error);
+			CHECK(cache->TryGetValue(101).status == CacheValueStatus::Failed);
+			CHECK(factoryCalls == 3);
+		}
+	}
+
+	WHEN("negative entries are invalidated")
+	{
+		cache->GetValue(-1);
+		cache->GetValue(-2);
+		CHECK_THROWS(cache->GetValue(101));
+		THEN("the factory is called again")
+		{
+			cache->Invalidate(-1);
+			cache->GetValue(-1);
+			cache->GetValue(-2);
+			CHECK(factoryCalls == 4);
+			cache->InvalidateNegativeEntries();
+			cache->GetValue(-2);
+			CHECK_THROWS(cache->GetValue(101));
+			CHECK(factoryCalls == 6);
+		}
+	}
+
+	WHEN("a value is invalidated")
+	{
+		auto value = cache->GetValue(1);
+		cache->Invalidate(1);
+		THEN("the next request creates a new value, while holders keep the old one")
+		{
+			auto newValue = cache->GetValue(1);
+			CHECK(newValue != value);
+			CHECK(*value == "1");
+			value.reset();
+			CHECK(cache->GetValue(1) == newValue);
+			CHECK(cache->GetSize() == 1);
+		}
+	}
+
+	WHEN("keys are requested in a batch")
+	{
+		auto values = cache->GetValues({ 1, -1, 2, -1 });
+		THEN("absent keys get null and are remembered")
+		{
+			CHECK(*values[0] == "1");
+			CHECK(!values[1]);
+			CHECK(!values[3]);
+			CHECK(!cache->GetValue(-1));
+			CHECK(factoryCalls == 3);
+		}
+		THEN("a remembered failure fails only its own key")
+		{
+			CHECK_THROWS_AS(cache->GetValue(101), runtime_error);
+			auto results = cache->TryGetValues({ 3, 101, -1 });
+			CHECK(results[0].status == CacheValueStatus::Present);
+			CHECK(*results[0].value == "3");
+			CHECK(results[1].status == CacheValueStatus::Failed);
+			CHECK_THROWS_AS(rethrow_exception(results[1].error), runtime_error);
+			CHECK(results[2].status == CacheValueStatus::Absent);
+			CHECK(factoryCalls == 5);
+			CHECK_THROWS_AS(cache->GetValues({ 3, 101 }), runtime_error);
+			CHECK(factoryCalls == 5);
+		}
+		THEN("a failed batch factory call fails its misses without remembering them")
+		{
+			auto results = cache->TryGetValues({ 3, 101, 3 });
+			CHECK(results[0].status == CacheValueStatus::Failed);
+			CHECK(results[1].error == results[0].error);
+			CHECK(results[2].status == CacheValueStatus::Failed);
+			CHECK(factoryCalls == 5);
+			CHECK(*cache->GetValue(3) == "3");
+			CHECK(factoryCalls == 6);
+		}
+	}
+
+	WHEN("keys are requested in a batch from a cache without a batch factory")
+	{
+		auto perKeyCache = make_shared<StringCache>([makeValue](const int& key, auto&& cleaner) {
+			return makeValue(key, std::move(cleaner));
+		});
+		perKeyCache->SetNegativeCaching(policy);
+		auto results = perKeyCache->TryGetValues({ 101, 1, 102 });
+		THEN("only the failing keys fail and are remembered")
+		{
+			CHECK(results[0].status == CacheValueStatus::Failed);
+			CHECK(results[1].status == CacheValueStatus::Present);
+			CHECK(*results[1].value == "1");
+			CHECK_THROWS_WITH(rethrow_exception(results[2].error), "backend failed for 102");
+			CHECK(factoryCalls == 3);
+			CHECK(perKeyCache->TryGetValues({ 101, 1 })[1].value == results[1].value);
+			CHECK_THROWS_AS(perKeyCache->GetValue(102), runtime_error);
+			CHECK(factoryCalls == 3);
+		}
+	}
+
+	WHEN("negative entries expire without being requested")
+	{
+		for (int key = -1; key > -100; --key)
+		{
+			cache->GetValue(key);
+		}
+		now += 100ms;
+		THEN("sweeps erase them")
+		{
+			cache->Sweep();
+			cache->GetValue(-1);
+			CHECK(factoryCalls == 100);
+		}
+	}
+
+	WHEN("negative caching is set again")
+	{
+		THEN("it is an error")
+		{
+			CHECK_THROWS_AS(cache->SetNegativeCaching(policy), logic_error);
+		}
+	}
+}
+
+SCENARIO("Shrinking caches")
+{
+	using FlatCache = CacheT<int, string, hash<int>, equal_to<int>, FlatMapStorage>;
+	auto cache = make_shared<FlatCache>([](const int& key, auto&& cleaner) {
+		return shared_ptr<string>(new string(to_string(key)), [cleaner = std::move(cleaner)](string* s) {
+			cleaner();
+			delete s;
+		});
+	}, EvictionMode::Deferred);
+	vector<function<void()>> tasks;
+
+	WHEN("values are destroyed while the deferred eviction mode keeps their items")
+	{
+		vector<shared_ptr<string>> values;
+		for (int key = 0; key < 2000; ++key)
+		{
+			values.push_back(cache->GetValue(key));
+		}
+		values.resize(10);
+		THEN("shrinking erases the items and frees the table")
+		{
+			CHECK(cache->GetSize() == 2000);
+			auto result = cache->ShrinkToFit();
+			CHECK(result.erasedCount == 1990);
+			CHECK(result.reclaimedBytes > 1990 * sizeof(FlatCache::ValueWeakPtr));
+			CHECK(cache->GetSize() == 10);
+			CHECK(cache->GetValue(5) == values[5]);
+			CHECK(cache->ShrinkToFit().reclaimedBytes == 0);
+		}
+	}
+
+	WHEN("background compaction is enabled")
+	{
+		cache->EnableBackgroundCompaction([&tasks](function<void()> task) {
+			tasks.push_back(std::move(task));
+		});
+		for (int key = 0; key < 2000; ++key)
+		{
+			cache->GetValue(key);
+		}
+		THEN("it runs once enough items have been erased")
+		{
+			cache->Sweep();
+			REQUIRE(tasks.size() == 1);
+			CHECK(cache->GetSize() == 0);
+			tasks[0]();
+			CHECK(cache->ShrinkToFit().reclaimedBytes == 0);
+			cache->GetValue(1);
+			CHECK(tasks.size() == 1);
+		}
+		THEN("a compaction of a destroyed cache does nothing")
+		{
+			cache->Sweep();
+			cache.reset();
+			tasks[0]();
+		}
+	}
+
+	WHEN("the cache of objects keeps items of destroyed objects")
+	{
+		auto objectCache = make_shared<Cache>(EvictionMode::Deferred);
+		vector<ObjPtr> objects;
+		for (int i = 0; i < 100; ++i)
+		{
+			objects.push_back(objectCache->GetObjectById(to_string(i)));
+		}
+		objects.clear();
+		THEN("shrinking erases them")
+		{
+			auto result = objectCache->ShrinkToFit();
+			CHECK(result.erasedCount == 100);
+			CHECK(result.reclaimedBytes > 0);
+			CHECK(objectCache->GetSize() == 0);
+			CHECK(objectCache->GetMetrics().expirations == 100);
+		}
+	}
 }
 
 SCENARIO("Data cache example")
@@ -438,3 +1107,17 @@ TEST_CASE("Cache access")
 	obj1alias.reset();
 	CHECK(wobj1.expired());
 }
+
+TEST_CASE("Cache access with deferred eviction")
+{
+	auto cache = make_shared<Cache>(EvictionMode::Deferred);
+	auto obj1 = cache->GetObjectById("obj1"s);
+	auto obj2 = cache->GetObjectById("obj2"s);
+	CHECK(cache->GetObjectById("obj1"s) == obj1);
+
+	obj1.reset();
+	CHECK(cache->GetSize() == 2);
+	cache->Sweep();
+	CHECK(cache->GetSize() == 1);
+	CHECK(cache->GetObjectById("obj2"s) == obj2);
+}
@@ -1,13 +1,20 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
 #include <map>
+#include <numeric>
 #include <memory>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 #include <functional>
 #include <iostream>
 #include <optional>
+#include <sstream>
 
 #include "../catch2/catch.hpp"